@@ -0,0 +1,428 @@
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// xjump-analyze: re-simulates a corpus of replay files on all cores and
+// prints statistics about where and why the players die, as CSV.
+//
+// Each worker adds what it sees to tables of its own, which are merged at the
+// end. The replays are streamed: the directories are read as the workers ask
+// for more files, so the memory use depends on the size of the tables and not
+// on the number of replays. The output has one line per table cell:
+//
+//   table,a,b,exposure,deaths
+//
+//   screen   a = column of the hero, b = row of the hero on the screen
+//   tower    a = column of the hero, b = floor / TOWER_BUCKET
+//   pattern  a = width of the next floor, b = shift from the current floor to
+//            the next one, in tiles. Exposure is the number of times that a
+//            player reached a floor with that kind of floor above it.
+//   speed    a = scroll speed / SPEED_BUCKET (MAX_SCROLL_SPEED is the last one)
+//
+// The exposure is the number of frames that the hero spent in that cell,
+// except for the pattern table. Deaths are counted where the hero was the
+// last time that it stood on a floor, before falling off the screen. Cells
+// that are all zeros are not printed.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "game.h"
+#include "replay.h"
+
+//
+// Tables
+// ------
+
+#define TOWER_BUCKET 10     /* Floors per row of the tower table */
+#define TOWER_ROWS   1000   /* The last row has everything above it */
+#define SPEED_BUCKET 100
+#define SPEED_ROWS   (MAX_SCROLL_SPEED / SPEED_BUCKET + 1)
+#define MAX_SHIFT    (FIELD_W / 2)
+
+typedef struct {
+    uint64_t exposure;
+    uint64_t deaths;
+} Cell;
+
+typedef struct {
+    Cell screen[FIELD_W][FIELD_H];
+    Cell tower[FIELD_W][TOWER_ROWS];
+    Cell pattern[FIELD_W + 1][2*MAX_SHIFT + 1];
+    Cell speed[SPEED_ROWS];
+    uint64_t replays;
+    uint64_t ticks;
+    uint64_t deaths;
+    uint64_t errors;
+} Stats;
+
+static int clamp(int x, int lo, int hi)
+{
+    return (x < lo ? lo : x > hi ? hi : x);
+}
+
+static void add_cells(Cell *dst, const Cell *src, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        dst[i].exposure += src[i].exposure;
+        dst[i].deaths   += src[i].deaths;
+    }
+}
+
+static void merge_stats(Stats *dst, const Stats *src)
+{
+    add_cells(&dst->screen[0][0],  &src->screen[0][0],  FIELD_W * FIELD_H);
+    add_cells(&dst->tower[0][0],   &src->tower[0][0],   FIELD_W * TOWER_ROWS);
+    add_cells(&dst->pattern[0][0], &src->pattern[0][0], (FIELD_W + 1) * (2*MAX_SHIFT + 1));
+    add_cells(&dst->speed[0],      &src->speed[0],      SPEED_ROWS);
+    dst->replays += src->replays;
+    dst->ticks   += src->ticks;
+    dst->deaths  += src->deaths;
+    dst->errors  += src->errors;
+}
+
+static void print_cell(const char *table, int a, int b, const Cell *c)
+{
+    if (c->exposure == 0 && c->deaths == 0) return;
+    printf("%s,%d,%d,%" PRIu64 ",%" PRIu64 "\n", table, a, b, c->exposure, c->deaths);
+}
+
+static void print_stats(const Stats *st)
+{
+    printf("table,a,b,exposure,deaths\n");
+    for (int x = 0; x < FIELD_W; x++) {
+        for (int y = 0; y < FIELD_H; y++) {
+            print_cell("screen", x, y, &st->screen[x][y]);
+        }
+    }
+    for (int x = 0; x < FIELD_W; x++) {
+        for (int y = 0; y < TOWER_ROWS; y++) {
+            print_cell("tower", x, y, &st->tower[x][y]);
+        }
+    }
+    for (int w = 0; w <= FIELD_W; w++) {
+        for (int d = 0; d < 2*MAX_SHIFT + 1; d++) {
+            print_cell("pattern", w, d - MAX_SHIFT, &st->pattern[w][d]);
+        }
+    }
+    for (int v = 0; v < SPEED_ROWS; v++) {
+        print_cell("speed", v, 0, &st->speed[v]);
+    }
+}
+
+//
+// Simulation
+// ----------
+
+// The kind of jump from floor k to floor k+1, or NULL if one of them is not
+// in the floor buffer anymore (or yet).
+static Cell *pattern_cell(Stats *st, const Game *g, int64_t k)
+{
+    if (5*k < g->next_floor - NFLOORS || 5*(k+1) >= g->next_floor) return NULL;
+    int64_t lo = 5*k, hi = 5*(k+1);
+    const Floor *a = get_floor(g, lo);
+    const Floor *b = get_floor(g, hi);
+    if (b->left > b->right) return NULL;
+    int width = b->right - b->left + 1;
+    int shift = ((b->left + b->right) - (a->left + a->right)) / 2;
+    return &st->pattern[clamp(width, 0, FIELD_W)][clamp(shift, -MAX_SHIFT, MAX_SHIFT) + MAX_SHIFT];
+}
+
+// Where the hero is, as indices into the tables
+typedef struct {
+    int col, row;
+    int towerRow;
+} Place;
+
+static Place hero_place(const Game *g)
+{
+    Place p;
+    p.col = clamp((g->x + R/2) / S, 0, FIELD_W - 1);
+    p.row = clamp((g->y + R/2) / S, 0, FIELD_H - 1);
+    int64_t level = (g->floorOffset - (g->y + R)/S) / 5;
+    p.towerRow = clamp(level / TOWER_BUCKET, 0, TOWER_ROWS - 1);
+    return p;
+}
+
+static void analyze_replay(Stats *st, const char *path)
+{
+    ReplayReader replay;
+    if (!replay_open(&replay, path)) {
+        st->errors++;
+        return;
+    }
+
+    Game game;
+    Game *g = &game;
+    replay_start(&replay, g);
+
+    Place lastStand = hero_place(g);
+    Cell *nextPattern = pattern_cell(st, g, 0);
+    if (nextPattern) nextPattern->exposure++;
+    int64_t score = 0;
+    bool isDead = false;
+
+    while (replay_feed(&replay, g)) {
+        isDead = updateGame(g);
+        st->ticks++;
+        if (isDead) break;
+
+        Place p = hero_place(g);
+        st->screen[p.col][p.row].exposure++;
+        st->tower[p.col][p.towerRow].exposure++;
+        st->speed[g->scrollSpeed / SPEED_BUCKET].exposure++;
+        if (g->isStanding) lastStand = p;
+
+        // Reached a new floor; what comes next?
+        if (g->score > score) {
+            score = g->score;
+            nextPattern = pattern_cell(st, g, score);
+            if (nextPattern) nextPattern->exposure++;
+        }
+    }
+
+    if (isDead) {
+        st->deaths++;
+        st->screen[lastStand.col][lastStand.row].deaths++;
+        st->tower[lastStand.col][lastStand.towerRow].deaths++;
+        st->speed[g->scrollSpeed / SPEED_BUCKET].deaths++;
+        if (nextPattern) nextPattern->deaths++;
+    }
+    st->replays++;
+    replay_close(&replay);
+}
+
+//
+// Replay stream
+// -------------
+//
+// The workers take the next path from here, one at a time. Directories are
+// walked recursively, keeping only the stack of open directories in memory.
+// The argument "-" reads the paths from stdin, one per line.
+
+#define MAX_DEPTH 32
+
+static pthread_mutex_t streamLock = PTHREAD_MUTEX_INITIALIZER;
+static char **args;
+static int nargs;
+static int nextArg;
+
+static DIR *dirs[MAX_DEPTH];
+static char *dirPaths[MAX_DEPTH];
+static int depth;
+
+static bool isReadingStdin;
+
+static char *join_path(const char *dir, const char *name)
+{
+    size_t len = strlen(dir) + 1 + strlen(name) + 1;
+    char *path = malloc(len);
+    if (!path) { perror("malloc"); exit(1); }
+    snprintf(path, len, "%s/%s", dir, name);
+    return path;
+}
+
+static bool push_dir(const char *path)
+{
+    if (depth == MAX_DEPTH) {
+        fprintf(stderr, "%s: too many nested directories\n", path);
+        return false;
+    }
+    DIR *dir = opendir(path);
+    if (!dir) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+    dirs[depth] = dir;
+    dirPaths[depth] = strdup(path);
+    depth++;
+    return true;
+}
+
+static void pop_dir()
+{
+    depth--;
+    closedir(dirs[depth]);
+    free(dirPaths[depth]);
+}
+
+// Returns a path that the caller must free, or NULL when there are no more
+// replays. Must be called with the lock.
+static char *next_path_locked()
+{
+    while (1) {
+        if (isReadingStdin) {
+            char *line = NULL;
+            size_t cap = 0;
+            ssize_t n = getline(&line, &cap, stdin);
+            if (n > 0) {
+                if (line[n-1] == '\n') line[n-1] = '\0';
+                if (line[0] != '\0') return line;
+                free(line);
+                continue;
+            }
+            free(line);
+            isReadingStdin = false;
+            continue;
+        }
+
+        if (depth > 0) {
+            struct dirent *ent = readdir(dirs[depth-1]);
+            if (!ent) {
+                pop_dir();
+                continue;
+            }
+            if (ent->d_name[0] == '.') continue;
+            char *path = join_path(dirPaths[depth-1], ent->d_name);
+            struct stat st;
+            bool ok = (0 == stat(path, &st));
+            if (ok && S_ISDIR(st.st_mode)) {
+                push_dir(path);
+            } else if (ok && S_ISREG(st.st_mode)) {
+                return path;
+            }
+            free(path);
+            continue;
+        }
+
+        if (nextArg == nargs) return NULL;
+        const char *arg = args[nextArg++];
+        if (0 == strcmp(arg, "-")) {
+            isReadingStdin = true;
+            continue;
+        }
+        struct stat st;
+        if (0 != stat(arg, &st)) {
+            fprintf(stderr, "%s: %s\n", arg, strerror(errno));
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            push_dir(arg);
+            continue;
+        }
+        return strdup(arg);
+    }
+}
+
+static char *next_path()
+{
+    pthread_mutex_lock(&streamLock);
+    char *path = next_path_locked();
+    pthread_mutex_unlock(&streamLock);
+    return path;
+}
+
+//
+// Workers
+// -------
+//
+// A replay takes much longer to simulate than to take from the stream, so the
+// workers simply share the stream, with a lock.
+
+typedef struct {
+    pthread_t thread;
+    Stats *stats;
+} Worker;
+
+static void *worker_main(void *arg)
+{
+    Worker *w = arg;
+    char *path;
+    while ((path = next_path())) {
+        analyze_replay(w->stats, path);
+        free(path);
+    }
+    return NULL;
+}
+
+//
+// Main
+// ----
+
+static void print_usage(const char *progname)
+{
+    printf("Usage: %s [OPTIONS] REPLAY|DIRECTORY|-...\n"
+           "Re-simulates xjump replays and prints where the players spent their time and\n"
+           "where they died, as CSV. Directories are read recursively, and - reads the\n"
+           "paths from stdin, one per line.\n"
+           "\n"
+           "  -h            show this help message and exit\n"
+           "  -j THREADS    number of worker threads (default: number of cores)\n",
+           progname);
+}
+
+int main(int argc, char **argv)
+{
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int c;
+    while ((c = getopt(argc, argv, "hj:")) != -1) {
+        switch (c) {
+            case 'h':
+                print_usage(argv[0]);
+                exit(0);
+
+            case 'j':
+                nthreads = atol(optarg);
+                break;
+
+            default:
+                exit(1);
+        }
+    }
+
+    if (optind == argc) {
+        print_usage(argv[0]);
+        exit(1);
+    }
+    args = &argv[optind];
+    nargs = argc - optind;
+
+    if (nthreads < 1) nthreads = 1;
+    Worker *workers = calloc(nthreads, sizeof(Worker));
+    if (!workers) { perror("calloc"); exit(1); }
+    for (long i = 0; i < nthreads; i++) {
+        workers[i].stats = calloc(1, sizeof(Stats));
+        if (!workers[i].stats) { perror("calloc"); exit(1); }
+        if (0 != pthread_create(&workers[i].thread, NULL, worker_main, &workers[i])) {
+            perror("Could not create thread");
+            exit(1);
+        }
+    }
+
+    Stats *total = calloc(1, sizeof(Stats));
+    if (!total) { perror("calloc"); exit(1); }
+    for (long i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        merge_stats(total, workers[i].stats);
+        free(workers[i].stats);
+    }
+
+    print_stats(total);
+    fprintf(stderr, "%" PRIu64 " replays, %" PRIu64 " ticks, %" PRIu64 " deaths, %" PRIu64 " errors\n",
+            total->replays, total->ticks, total->deaths, total->errors);
+
+    return (total->errors == 0 ? 0 : 1);
+}
@@ -0,0 +1,41 @@
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef XJUMP_ASSETS_H
+#define XJUMP_ASSETS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//
+// Embedded data
+// -------------
+//
+// When configured with --embed-data, the fonts and the themes are compiled
+// into the executable. The build decodes them with xjump-embed into ARGB8888
+// pixels, one uint32_t per pixel, which is also the format of the textures
+// that SDL creates for them. The name is the path under the data directory,
+// for example "themes/classic.bmp".
+
+typedef struct {
+    const char *name;
+    int w, h;
+    const uint32_t *pixels;
+} EmbeddedImage;
+
+extern const EmbeddedImage embeddedImages[];
+extern const int numEmbeddedImages;
+
+#endif
@@ -0,0 +1,408 @@
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "batch.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define BLK XJ_BATCH_BLOCK
+
+// The kernels find the ring slot with a mask instead of mod(), and scroll at
+// most one row per frame at full speed
+_Static_assert((NFLOORS & (NFLOORS-1)) == 0, "NFLOORS must be a power of two");
+_Static_assert(MAX_SCROLL_SPEED <= SCROLL_THRESHOLD, "more than one scroll per frame");
+
+static inline int32_t min32(int32_t x, int32_t y) { return (x < y ? x : y); }
+static inline int32_t max32(int32_t x, int32_t y) { return (x > y ? x : y); }
+
+// Masks have all bits set where the condition holds. sel() picks a where the
+// mask is set and b elsewhere, without a branch.
+static inline int32_t mask(int32_t cond) { return -cond; }
+static inline int32_t sel(int32_t m, int32_t a, int32_t b) { return (a & m) | (b & ~m); }
+
+// The same, for the 64-bit fields. The mask is sign-extended.
+static inline int64_t max64(int64_t x, int64_t y) { return (x > y ? x : y); }
+static inline int64_t sel64(int32_t m, int64_t a, int64_t b) { return (a & m) | (b & ~(int64_t) m); }
+
+static int32_t clamp32(int64_t v)
+{
+    return (v > INT32_MAX ? INT32_MAX : v < INT32_MIN ? INT32_MIN : (int32_t) v);
+}
+
+//
+// Lanes
+// -----
+
+bool xj_batch_init(XjBatch *b, int n, bool isSoftScroll, FloorGenerator floorGenerator)
+{
+    b->n = n;
+    b->nblocks = (n + BLK - 1) / BLK;
+    b->isSoftScroll = isSoftScroll;
+    b->floorGenerator = floorGenerator;
+    b->blocks = calloc(b->nblocks, sizeof(XjLanes));
+    b->games  = calloc((size_t) b->nblocks * BLK, sizeof(Game));
+    if (!b->blocks || !b->games) {
+        xj_batch_free(b);
+        return false;
+    }
+
+    // The padding lanes are dead from the start
+    const int64_t seed[2] = { 0, 0 };
+    for (int i = 0; i < b->nblocks * BLK; i++) {
+        b->games[i].isSoftScroll = isSoftScroll;
+        b->games[i].floorGenerator = floorGenerator;
+        xj_batch_reset(b, i, seed);
+        b->blocks[i / BLK].isDead[i % BLK] = (i >= n);
+    }
+    return true;
+}
+
+void xj_batch_free(XjBatch *b)
+{
+    free(b->blocks);
+    free(b->games);
+    b->blocks = NULL;
+    b->games = NULL;
+    b->n = 0;
+    b->nblocks = 0;
+}
+
+// Same as xj_reset, for one lane
+void xj_batch_reset(XjBatch *b, int lane, const int64_t seed[2])
+{
+    Game *g = &b->games[lane];
+    if (seed) {
+        pcg32_init(&g->rng, seed);
+    }
+    init_game(g);
+
+    XjLanes *L = &b->blocks[lane / BLK];
+    int j = lane % BLK;
+    L->x[j] = g->x;
+    L->y[j] = g->y;
+    L->vx[j] = g->vx;
+    L->vy[j] = g->vy;
+    L->jump[j] = g->jump;
+    L->isStanding[j] = g->isStanding;
+    L->isFacingRight[j] = g->isFacingRight;
+    L->isIdleVariant[j] = g->isIdleVariant;
+    L->idleCount[j] = g->idleCount;
+    L->hasStarted[j] = g->hasStarted;
+    L->floorOffset[j] = g->floorOffset;
+    L->forcedScroll[j] = g->forcedScroll;
+    L->scrollCount[j] = g->scrollCount;
+    L->scrollSpeed[j] = g->scrollSpeed;
+    L->score[j] = g->score;
+    L->isDead[j] = false;
+    L->lastBump[j] = 0;
+    L->action[j] = 0;
+    L->pending[j] = 0;
+    L->ticks[j] = 0;
+    memcpy(L->floors[j], g->floors, sizeof(g->floors));
+}
+
+bool xj_batch_is_dead(const XjBatch *b, int lane)
+{
+    return b->blocks[lane / BLK].isDead[lane % BLK];
+}
+
+// Copies a lane into a scalar context, which then continues the same game
+void xj_batch_get(const XjBatch *b, int lane, XjCore *ctx)
+{
+    const XjLanes *L = &b->blocks[lane / BLK];
+    int j = lane % BLK;
+    Game *g = &ctx->game;
+    *g = b->games[lane];
+    g->x = L->x[j];
+    g->y = L->y[j];
+    g->vx = L->vx[j];
+    g->vy = L->vy[j];
+    g->jump = L->jump[j];
+    g->isStanding = L->isStanding[j];
+    g->isFacingRight = L->isFacingRight[j];
+    g->isIdleVariant = L->isIdleVariant[j];
+    g->idleCount = L->idleCount[j];
+    g->hasStarted = L->hasStarted[j];
+    g->floorOffset = L->floorOffset[j];
+    g->forcedScroll = L->forcedScroll[j];
+    g->scrollCount = L->scrollCount[j];
+    g->scrollSpeed = L->scrollSpeed[j];
+    g->score = L->score[j];
+    memcpy(g->floors, L->floors[j], sizeof(g->floors));
+    ctx->ticks = L->ticks[j];
+    ctx->isDead = L->isDead[j];
+    ctx->lastBump = L->lastBump[j];
+    xj_set_action(ctx, L->action[j]);
+}
+
+// Same as xj_observe, for one lane
+void xj_batch_observe(const XjBatch *b, int lane, int32_t obs[XJ_OBS_SIZE])
+{
+    const XjLanes *L = &b->blocks[lane / BLK];
+    int j = lane % BLK;
+    obs[XJ_OBS_X] = L->x[j];
+    obs[XJ_OBS_Y] = L->y[j];
+    obs[XJ_OBS_VX] = L->vx[j];
+    obs[XJ_OBS_VY] = L->vy[j];
+    obs[XJ_OBS_JUMP] = L->jump[j];
+    obs[XJ_OBS_STANDING] = L->isStanding[j];
+    obs[XJ_OBS_FACING_RIGHT] = L->isFacingRight[j];
+    obs[XJ_OBS_FLOOR_OFFSET] = clamp32(L->floorOffset[j]);
+    obs[XJ_OBS_SCROLL_COUNT] = L->scrollCount[j];
+    obs[XJ_OBS_SCROLL_SPEED] = L->scrollSpeed[j];
+    obs[XJ_OBS_SCORE] = clamp32(L->score[j]);
+    obs[XJ_OBS_TICKS] = clamp32(L->ticks[j]);
+    obs[XJ_OBS_DEAD] = L->isDead[j];
+
+    int32_t *floors = &obs[XJ_OBS_FLOORS];
+    for (int k = 0; k < XJ_OBS_ROWS; k++) {
+        const Floor *f = &L->floors[j][(L->floorOffset[j] - (k - FIELD_EXTRA)) & (NFLOORS-1)];
+        floors[2*k + 0] = f->left;
+        floors[2*k + 1] = f->right;
+    }
+}
+
+//
+// Kernels
+// -------
+//
+// These are updateGame, scroll and xj_settle rewritten for one block of lanes.
+// Each if statement became a mask and a select, and each loop that scrolls one
+// row at a time became a comparison or a division. The floor lookups of
+// isStanding are in a separate loop, so that the arithmetic still vectorizes
+// on targets that have no gather instruction. The same goes for the 64-bit
+// fields: before AVX-512 there is no vector division for them, and a single
+// one would keep the whole loop scalar. Apart from that loop and
+// generate_pending, the kernels vectorize at -O2; see -fopt-info-vec.
+//
+// Dead lanes go through the same arithmetic, but their results are not stored.
+
+// Looks up the floor under the hero, as in isStanding. The result is garbage
+// if the row is outside the field, but then the hero isn't standing anyway.
+static void gather_floors(const XjLanes *restrict L, const int32_t *restrict row,
+                          int32_t *restrict left, int32_t *restrict right)
+{
+    const Floor *floors = &L->floors[0][0];
+    for (int j = 0; j < BLK; j++) {
+        int32_t slot = j*NFLOORS + (int32_t) ((L->floorOffset[j] - row[j]) & (NFLOORS-1));
+        left[j]  = floors[slot].left;
+        right[j] = floors[slot].right;
+    }
+}
+
+static void update_block(XjLanes *restrict L, bool isSoftScroll)
+{
+    const int32_t hardScroll = mask(!isSoftScroll);
+
+    for (int j = 0; j < BLK; j++) {
+        L->ticks[j] += !L->isDead[j];
+    }
+
+    // Movement and the walls
+    int32_t row[BLK];
+    for (int j = 0; j < BLK; j++) {
+        int32_t live = mask(!L->isDead[j]);
+        int32_t vx = L->vx[j];
+        int32_t x  = L->x[j] + vx/2;
+        int32_t y  = L->y[j] + L->vy[j];
+
+        int32_t hitLeft = mask((x < leftLimit) & (vx <= 0));
+        x  = sel(hitLeft, leftLimit + max32(0, leftLimit - x - 2)/2, x);
+        vx = sel(hitLeft, -vx/2, vx);
+
+        int32_t hitRight = mask((x > rightLimit) & (vx >= 0));
+        x  = sel(hitRight, rightLimit - max32(0, x - rightLimit - 2)/2, x);
+        vx = sel(hitRight, -vx/2, vx);
+
+        L->x[j]  = sel(live, x,  L->x[j]);
+        L->y[j]  = sel(live, y,  L->y[j]);
+        L->vx[j] = sel(live, vx, L->vx[j]);
+        row[j] = (L->y[j] + R)/S;
+    }
+
+    int32_t left[BLK], right[BLK];
+    gather_floors(L, row, left, right);
+
+    // The floors, the controls and the scrolling
+    int32_t standing[BLK], standRow[BLK];
+    for (int j = 0; j < BLK; j++) {
+        int32_t live = mask(!L->isDead[j]);
+        int32_t act = L->action[j];
+        int32_t jumpKey  = mask((act & XJ_ACTION_JUMP) != 0);
+        int32_t leftKey  = mask((act & XJ_ACTION_LEFT) != 0);
+        int32_t rightKey = mask((act & XJ_ACTION_RIGHT) != 0);
+        int32_t goLeft  = leftKey & ~rightKey;
+        int32_t goRight = rightKey & ~leftKey;
+
+        int32_t x  = L->x[j];
+        int32_t y  = L->y[j];
+        int32_t vx = L->vx[j];
+        int32_t vy = L->vy[j];
+        int32_t jump = L->jump[j];
+
+        int32_t st = mask((vy >= 0) & (row[j] < FIELD_H) &
+                          (left[j]*S - 24 <= x) & (x <= right[j]*S + 8));
+        int32_t air = ~st;
+
+        y  = sel(st, (y / S) * S, y);
+        vy = vy & air;
+
+        standing[j] = st & live;
+        standRow[j] = (y + R)/S;
+
+        int32_t idleCount = L->idleCount[j] + (st & 1);
+        int32_t flip = mask(idleCount >= 5);
+        int32_t isIdleVariant = L->isIdleVariant[j] ^ (flip & 1);
+        idleCount &= ~flip;
+
+        int32_t jumping = st & jumpKey;
+        jump = sel(jumping, abs(vx)/4 + 7, jump);
+        vy   = sel(jumping, -jump/2 - 12, vy);
+        int32_t starting = jumping & mask(!L->hasStarted[j]);
+        int32_t hasStarted = L->hasStarted[j] | (starting & 1);
+        int32_t scrollSpeed = sel(starting, 200, L->scrollSpeed[j]);
+
+        int32_t accelx = 2 + (st & 1);
+        int32_t friction = sel(mask(vx < -2), vx + 3, sel(mask(vx > 2), vx - 3, 0));
+        vx = sel(goLeft,  max32(vx - accelx, -32),
+             sel(goRight, min32(vx + accelx, 32),
+             sel(st, friction, vx)));
+        int32_t isFacingRight = sel(goLeft, 0, sel(goRight, 1, L->isFacingRight[j]));
+
+        int32_t rising = mask(jump > 0);
+        vy   = sel(air, sel(rising, -jump/2 - 12, min32(vy + 2, 16)), vy);
+        jump = sel(air, (jump - 1) & rising & jumpKey, jump);
+
+        int32_t scrolling = mask(hasStarted);
+        scrollSpeed = sel(scrolling, min32(MAX_SCROLL_SPEED, scrollSpeed + 1), scrollSpeed);
+        int32_t scrollCount = L->scrollCount[j] + (scrollSpeed & scrolling);
+        int32_t scrolls = (scrollCount > SCROLL_THRESHOLD);  // The while loop of updateGame
+        scrollCount -= scrolls * SCROLL_THRESHOLD;
+        y += scrolls * S;
+
+        int32_t bumping = hardScroll & air & mask(y < topLimit);
+        int32_t bumps = (max32(0, topLimit - y + S - 1) / S) & bumping;
+        y += bumps * S;
+        scrolls += bumps;
+
+        // Each scroll takes one row off the forced scroll, if there is one
+        int32_t forcedScroll = L->forcedScroll[j];
+        forcedScroll -= S * min32(scrolls, forcedScroll / S);
+
+        L->y[j]  = sel(live, y,  L->y[j]);
+        L->vx[j] = sel(live, vx, L->vx[j]);
+        L->vy[j] = sel(live, vy, L->vy[j]);
+        L->jump[j]          = sel(live, jump, L->jump[j]);
+        L->isStanding[j]    = sel(live, st & 1, L->isStanding[j]);
+        L->isFacingRight[j] = sel(live, isFacingRight, L->isFacingRight[j]);
+        L->isIdleVariant[j] = sel(live, isIdleVariant, L->isIdleVariant[j]);
+        L->idleCount[j]     = sel(live, idleCount, L->idleCount[j]);
+        L->hasStarted[j]    = sel(live, hasStarted, L->hasStarted[j]);
+        L->forcedScroll[j]  = sel(live, forcedScroll, L->forcedScroll[j]);
+        L->scrollCount[j]   = sel(live, scrollCount, L->scrollCount[j]);
+        L->scrollSpeed[j]   = sel(live, scrollSpeed, L->scrollSpeed[j]);
+        L->pending[j]       = scrolls & live;
+        L->lastBump[j]     &= ~live;
+        L->isDead[j]        = sel(live, y + forcedScroll >= botLimit, L->isDead[j]);
+    }
+
+    // The 64-bit fields. This loop stays scalar.
+    for (int j = 0; j < BLK; j++) {
+        int64_t floorOffset = L->floorOffset[j];
+        int64_t n = (floorOffset - standRow[j]) / 5;
+        L->score[j] = sel64(standing[j], max64(n, L->score[j]), L->score[j]);
+        L->floorOffset[j] = floorOffset + L->pending[j];
+    }
+}
+
+// The forced scroll, as in xj_settle. Only for soft scroll mode.
+static void settle_block(XjLanes *restrict L)
+{
+    int32_t row[BLK];
+    for (int j = 0; j < BLK; j++) {
+        row[j] = (L->y[j] + R)/S;
+    }
+
+    int32_t left[BLK], right[BLK];
+    gather_floors(L, row, left, right);
+
+    for (int j = 0; j < BLK; j++) {
+        int32_t live = mask(!L->isDead[j]);
+        int32_t hx = min32(max32(L->x[j], leftLimit), rightLimit);
+        int32_t st = mask((L->vy[j] >= 0) & (row[j] < FIELD_H) &
+                          (left[j]*S - 24 <= hx) & (hx <= right[j]*S + 8));
+        int32_t hy = sel(st, (L->y[j] / S) * S, L->y[j]);
+        int32_t sy = hy + L->forcedScroll[j] + S*L->scrollCount[j]/SCROLL_THRESHOLD;
+        int32_t bump = (topLimit - sy) & ~st & mask(sy < topLimit) & live;
+
+        int32_t forcedScroll = L->forcedScroll[j] + bump;
+        int32_t scrolls = (forcedScroll / S) & live;
+        forcedScroll -= scrolls * S;
+
+        L->y[j]            += scrolls * S;
+        L->floorOffset[j]  += scrolls;
+        L->forcedScroll[j]  = forcedScroll;
+        L->scrollCount[j]  &= ~mask(bump > 0);
+        L->lastBump[j]      = sel(live, bump, L->lastBump[j]);
+        L->pending[j]       = scrolls;
+    }
+}
+
+// The part of scroll() that can't be vectorized
+static void generate_pending(XjBatch *b, XjLanes *L, int base)
+{
+    // Most frames don't scroll any lane
+    int32_t any = 0;
+    for (int j = 0; j < BLK; j++) {
+        any |= L->pending[j];
+    }
+    if (!any) return;
+
+    for (int j = 0; j < BLK; j++) {
+        Game *g = &b->games[base + j];
+        for (int k = 0; k < L->pending[j]; k++) {
+            int64_t n = g->next_floor;
+            generate_floor(g);
+            L->floors[j][n & (NFLOORS-1)] = *get_floor(g, n);
+        }
+        L->pending[j] = 0;
+    }
+}
+
+// Runs one frame in every lane, with actions[i] as the action of lane i. Then
+// xj_batch_is_dead tells which lanes are over.
+void xj_batch_step(XjBatch *b, const int *actions)
+{
+    // One block at a time, while its lanes are in the cache
+    for (int k = 0; k < b->nblocks; k++) {
+        XjLanes *L = &b->blocks[k];
+        int base = k * BLK;
+        if (base + BLK <= b->n) {
+            memcpy(L->action, actions + base, sizeof(L->action));
+        } else {
+            for (int j = 0; base + j < b->n; j++) {
+                L->action[j] = actions[base + j];
+            }
+        }
+
+        update_block(L, b->isSoftScroll);
+        generate_pending(b, L, base);
+        if (b->isSoftScroll) {
+            settle_block(L);
+            generate_pending(b, L, base);
+        }
+    }
+}
@@ -0,0 +1,89 @@
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef XJUMP_BATCH_H
+#define XJUMP_BATCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "core.h"
+#include "game.h"
+
+//
+// Batched simulation
+// ------------------
+//
+// Steps many games at once, for training environments that need millions of
+// steps per second. Each game is a "lane". The state of the lanes is kept in
+// structure-of-arrays form, one array per field, and the physics runs over
+// blocks of XJ_BATCH_BLOCK lanes with no branches, so that the compiler can
+// turn it into SIMD code. Every lane simulates exactly the same game as an
+// XjCore stepped with xj_step, including the forced scrolls.
+//
+// Generating floors is the only part that runs one lane at a time. It happens
+// when a lane scrolls, which is at most once every four frames at full speed.
+// The generator state stays in a Game per lane; each new floor is copied into
+// the ring of the lane, where the kernels look it up.
+//
+// Dead lanes don't change until they are reset, like xj_step. Lanes in the
+// same batch share the scrolling mode and the floor generator.
+
+#define XJ_BATCH_BLOCK 16
+
+// One block of lanes. Lane j of the block is entry j of each array. The floor
+// ring of lane j is floors[j]. Every field is in its own array, and the arrays
+// are members of the same struct, so the compiler knows that they don't
+// overlap and doesn't have to check it at runtime.
+typedef struct {
+    int32_t x[XJ_BATCH_BLOCK], y[XJ_BATCH_BLOCK];
+    int32_t vx[XJ_BATCH_BLOCK], vy[XJ_BATCH_BLOCK];
+    int32_t jump[XJ_BATCH_BLOCK];
+    int32_t isStanding[XJ_BATCH_BLOCK];
+    int32_t isFacingRight[XJ_BATCH_BLOCK];
+    int32_t isIdleVariant[XJ_BATCH_BLOCK];
+    int32_t idleCount[XJ_BATCH_BLOCK];
+    int32_t hasStarted[XJ_BATCH_BLOCK];
+    int64_t floorOffset[XJ_BATCH_BLOCK];    // 64-bit, as in Game
+    int32_t forcedScroll[XJ_BATCH_BLOCK];
+    int32_t scrollCount[XJ_BATCH_BLOCK];
+    int32_t scrollSpeed[XJ_BATCH_BLOCK];
+    int64_t score[XJ_BATCH_BLOCK];
+    int32_t isDead[XJ_BATCH_BLOCK];
+    int32_t lastBump[XJ_BATCH_BLOCK];
+    int32_t action[XJ_BATCH_BLOCK];
+    int32_t pending[XJ_BATCH_BLOCK];   // Floors that the lane must generate
+    int64_t ticks[XJ_BATCH_BLOCK];
+    Floor floors[XJ_BATCH_BLOCK][NFLOORS];
+} XjLanes;
+
+typedef struct {
+    int n;          // Number of lanes
+    int nblocks;    // The lanes past n only fill up the last block
+    bool isSoftScroll;
+    FloorGenerator floorGenerator;
+    XjLanes *blocks;
+    Game *games;    // Floor generator state, one per lane
+} XjBatch;
+
+bool xj_batch_init(XjBatch *b, int n, bool isSoftScroll, FloorGenerator floorGenerator);
+void xj_batch_free(XjBatch *b);
+void xj_batch_reset(XjBatch *b, int lane, const int64_t seed[2]);
+void xj_batch_step(XjBatch *b, const int *actions);
+bool xj_batch_is_dead(const XjBatch *b, int lane);
+void xj_batch_observe(const XjBatch *b, int lane, int32_t obs[XJ_OBS_SIZE]);
+void xj_batch_get(const XjBatch *b, int lane, XjCore *ctx);
+
+#endif
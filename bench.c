@@ -0,0 +1,469 @@
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// xjump-bench: microbenchmarks for the hot paths of the simulation and of the
+// renderer. Run it with "make bench".
+//
+// Each benchmark takes a number of samples. A sample times a batch of
+// operations and reports the average time per operation, so that the cost of
+// reading the clock doesn't dominate the short functions. The output is one
+// tab-separated line per benchmark, with the times in nanoseconds per op:
+//
+//   name  samples  ops  mean  p50  p90  p99  max
+//
+// Lines starting with # are comments. The render benchmarks draw to an
+// offscreen texture and wait for the GPU at the end of each sample, by
+// reading back a single pixel. They are skipped if SDL can't create a window.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <SDL.h>
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "batch.h"
+#include "core.h"
+#include "game.h"
+#include "render.h"
+
+//
+// Measurement
+// -----------
+
+static int nsamples = 200;
+static double *samples;
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(double p)
+{
+    int i = (int) (p * (nsamples - 1) + 0.5);
+    return samples[i];
+}
+
+static void report(const char *name, long ops)
+{
+    double sum = 0.0;
+    for (int i = 0; i < nsamples; i++) sum += samples[i];
+    qsort(samples, nsamples, sizeof(double), compare_doubles);
+
+    printf("%s\t%d\t%ld\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\n",
+           name, nsamples, ops, sum / nsamples,
+           percentile(0.50), percentile(0.90), percentile(0.99), samples[nsamples-1]);
+    fflush(stdout);
+}
+
+// Keeps the compiler from optimizing away the benchmarked calls
+static volatile uint64_t sink;
+
+//
+// Simulation
+// ----------
+
+// A simple bot that runs from wall to wall and jumps all the time. It is not
+// good at the game, but it exercises the collision and scrolling code.
+static Pcg32 botRng;
+
+static void bot_input(Game *g)
+{
+    LeftRight dir = g->input.horizDirection;
+    if (g->x <= leftLimit + S)  dir = LR_RIGHT;
+    if (g->x >= rightLimit - S) dir = LR_LEFT;
+    if (dir == LR_NEUTRAL || pcg32_bounded(&botRng, 64) == 0) {
+        dir = (pcg32_bounded(&botRng, 2) ? LR_LEFT : LR_RIGHT);
+    }
+    input_set(&g->input, dir, true);
+}
+
+static void new_game(Game *g)
+{
+    static int64_t n = 0;
+    const int64_t seed[2] = { 0x5eed, n++ };
+    g->isSoftScroll = true;
+    g->floorGenerator = FLOORGEN_CLASSIC;
+    pcg32_init(&g->rng, seed);
+    init_game(g);
+}
+
+static void bench_updateGame()
+{
+    const long ops = 1000;
+    Game g;
+    new_game(&g);
+    for (int s = 0; s < nsamples; s++) {
+        // When the bot dies, the sample ends early and we start a new game
+        // outside of the timed region.
+        long i;
+        uint64_t t0 = now_ns();
+        for (i = 0; i < ops; ) {
+            bot_input(&g);
+            i++;
+            if (updateGame(&g)) break;
+        }
+        uint64_t t1 = now_ns();
+        samples[s] = (double) (t1 - t0) / i;
+        if (i < ops) new_game(&g);
+    }
+    report("updateGame", ops);
+}
+
+// A training environment step: the action, the frame and the observation
+static void bench_xj_step()
+{
+    const long ops = 1000;
+    static XjCore ctx;
+    int32_t obs[XJ_OBS_SIZE];
+    const int64_t seed[2] = { 0x5eed, 0 };
+    xj_init(&ctx, true, FLOORGEN_CLASSIC);
+    xj_reset(&ctx, seed);
+    for (int s = 0; s < nsamples; s++) {
+        uint64_t t0 = now_ns();
+        for (long i = 0; i < ops; i++) {
+            int action = XJ_ACTION_JUMP | (pcg32_bounded(&botRng, 2) ? XJ_ACTION_LEFT : XJ_ACTION_RIGHT);
+            if (xj_step(&ctx, action)) xj_reset(&ctx, NULL);
+            xj_observe(&ctx, obs);
+        }
+        uint64_t t1 = now_ns();
+        samples[s] = (double) (t1 - t0) / ops;
+    }
+    report("xj_step", ops);
+}
+
+// The same steps as above, for a batch of lanes. The time is per lane step.
+static void bench_xj_batch_step()
+{
+    enum { NLANES = 256, STEPS = 16 };
+    static XjBatch batch;
+    static int actions[NLANES];
+    int32_t obs[XJ_OBS_SIZE];
+    if (!xj_batch_init(&batch, NLANES, true, FLOORGEN_CLASSIC)) {
+        printf("# xj_batch_step: out of memory\n");
+        return;
+    }
+    for (int i = 0; i < NLANES; i++) {
+        const int64_t seed[2] = { 0x5eed, i };
+        xj_batch_reset(&batch, i, seed);
+    }
+    for (int s = 0; s < nsamples; s++) {
+        uint64_t t0 = now_ns();
+        for (int k = 0; k < STEPS; k++) {
+            for (int i = 0; i < NLANES; i++) {
+                actions[i] = XJ_ACTION_JUMP | (pcg32_bounded(&botRng, 2) ? XJ_ACTION_LEFT : XJ_ACTION_RIGHT);
+            }
+            xj_batch_step(&batch, actions);
+            for (int i = 0; i < NLANES; i++) {
+                if (xj_batch_is_dead(&batch, i)) xj_batch_reset(&batch, i, NULL);
+                xj_batch_observe(&batch, i, obs);
+            }
+        }
+        uint64_t t1 = now_ns();
+        samples[s] = (double) (t1 - t0) / (NLANES * STEPS);
+    }
+    xj_batch_free(&batch);
+    report("xj_batch_step", NLANES * STEPS);
+}
+
+static void bench_generate_floor()
+{
+    const long ops = 1000;
+    Game g;
+    new_game(&g);
+    for (int s = 0; s < nsamples; s++) {
+        uint64_t t0 = now_ns();
+        for (long i = 0; i < ops; i++) {
+            generate_floor(&g);
+        }
+        uint64_t t1 = now_ns();
+        samples[s] = (double) (t1 - t0) / ops;
+    }
+    sink = g.fpos;
+    report("generate_floor", ops);
+}
+
+static void bench_pcg32_bounded()
+{
+    const long ops = 10000;
+    Pcg32 rng = botRng;
+    uint64_t acc = 0;
+    for (int s = 0; s < nsamples; s++) {
+        uint64_t t0 = now_ns();
+        for (long i = 0; i < ops; i++) {
+            acc += pcg32_bounded(&rng, 22);
+        }
+        uint64_t t1 = now_ns();
+        samples[s] = (double) (t1 - t0) / ops;
+    }
+    sink = acc;
+    report("pcg32_bounded", ops);
+}
+
+static void bench_isStanding()
+{
+    const long ops = 10000;
+    Game g;
+    new_game(&g);
+
+    // Positions all over the playing field, so that the branches are not
+    // trivially predictable.
+    enum { NPOS = 1024 };
+    static int xs[NPOS], ys[NPOS];
+    for (int i = 0; i < NPOS; i++) {
+        xs[i] = leftLimit + pcg32_bounded(&botRng, rightLimit - leftLimit + 1);
+        ys[i] = pcg32_bounded(&botRng, botLimit);
+    }
+
+    uint64_t acc = 0;
+    for (int s = 0; s < nsamples; s++) {
+        uint64_t t0 = now_ns();
+        for (long i = 0; i < ops; i++) {
+            int k = i % NPOS;
+            acc += isStanding(&g, xs[k], ys[k]);
+        }
+        uint64_t t1 = now_ns();
+        samples[s] = (double) (t1 - t0) / ops;
+    }
+    sink = acc;
+    report("isStanding", ops);
+}
+
+//
+// Rendering
+// ---------
+
+static void gpu_wait(SDL_Renderer *renderer)
+{
+    const SDL_Rect pixel = { 0, 0, 1, 1 };
+    uint32_t rgba;
+    SDL_RenderReadPixels(renderer, &pixel, SDL_PIXELFORMAT_RGBA8888, &rgba, sizeof(rgba));
+    sink = rgba;
+}
+
+static void bench_text_draw_line(Screen *screen)
+{
+    const long ops = 100;
+    const SDL_Color white = { 255, 255, 255, 255 };
+    SDL_Renderer *renderer = screen->renderer;
+    for (int s = 0; s < nsamples; s++) {
+        uint64_t t0 = now_ns();
+        for (long i = 0; i < ops; i++) {
+            text_batch_add(&screen->uiText, "0000012345", &screen->fields[0].scoreDigitsDst, white);
+            text_batch_flush(&screen->uiText);
+        }
+        gpu_wait(renderer);
+        uint64_t t1 = now_ns();
+        samples[s] = (double) (t1 - t0) / ops;
+    }
+    report("text_draw_line", ops);
+}
+
+// One frame of the main loop, in soft scroll mode, while the screen is moving.
+// The ghosts are bots of their own, drawn where their hero is in their game.
+static void bench_render_frame(Screen *screen, int nghosts, const char *name)
+{
+    const long ops = 1;
+    Game g;
+    new_game(&g);
+    Game ghosts[MAX_GHOSTS];
+    for (int k = 0; k < nghosts; k++) {
+        new_game(&ghosts[k]);
+    }
+    for (int s = 0; s < nsamples; s++) {
+        bot_input(&g);
+        if (updateGame(&g)) new_game(&g);
+        g.hasStarted = 1;
+        for (int k = 0; k < nghosts; k++) {
+            bot_input(&ghosts[k]);
+            if (updateGame(&ghosts[k])) new_game(&ghosts[k]);
+        }
+
+        int dt = (s * 7*INTERP_ONE/3) % (GAME_SPEED*INTERP_ONE);
+
+        uint64_t t0 = now_ns();
+        int sx, sy, bump;
+        int interpScroll = interpolateHeroFine(&g, dt, &sx, &sy, &bump);
+        GhostView ghostViews[MAX_GHOSTS];
+        for (int k = 0; k < nghosts; k++) {
+            int gbump;
+            ghostViews[k].game = &ghosts[k];
+            interpolateHeroFine(&ghosts[k], dt, &ghostViews[k].sx, &ghostViews[k].sy, &gbump);
+            applyForcedScroll(&ghosts[k], gbump);
+        }
+        const int64_t score = g.score;
+        const FieldView view = { &g, sx, sy, interpScroll, BANNER_NONE, ghostViews, nghosts };
+        screen_draw_frame(screen, &score);
+        screen_draw_games(screen, &view);
+        applyForcedScroll(&g, bump);
+        gpu_wait(screen->renderer);
+        uint64_t t1 = now_ns();
+        samples[s] = (double) (t1 - t0) / ops;
+    }
+    report(name, ops);
+}
+
+static bool run_render_benchmarks(const char *dataDir)
+{
+    if (0 != SDL_Init(SDL_INIT_VIDEO)) {
+        fprintf(stderr, "Skipping the render benchmarks. %s\n", SDL_GetError());
+        return false;
+    }
+    atexit(SDL_Quit);
+
+    char themePath[1024], uiFontPath[1024], hsFontPath[1024];
+    snprintf(themePath,  sizeof(themePath),  "%s/themes/jumpnbump.bmp", dataDir);
+    snprintf(uiFontPath, sizeof(uiFontPath), "%s/font-ui.bmp", dataDir);
+    snprintf(hsFontPath, sizeof(hsFontPath), "%s/font-hs.bmp", dataDir);
+
+    SDL_Surface *spritesSurface = loadThemeFile(themePath);
+    SDL_Surface *uiFontSurface = SDL_LoadBMP(uiFontPath);
+    SDL_Surface *hsFontSurface = SDL_LoadBMP(hsFontPath);
+    if (!spritesSurface || !uiFontSurface || !hsFontSurface) {
+        fprintf(stderr, "Could not load the data files. %s\n", SDL_GetError());
+        return false;
+    }
+
+    Screen screen;
+    screen_layout(&screen, 1);
+
+    SDL_Window *window = SDL_CreateWindow("xjump-bench",
+        SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+        screen.windowW, screen.windowH, SDL_WINDOW_HIDDEN);
+    if (!window) {
+        fprintf(stderr, "Skipping the render benchmarks. %s\n", SDL_GetError());
+        return false;
+    }
+
+    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1,
+        SDL_RENDERER_ACCELERATED | SDL_RENDERER_TARGETTEXTURE);
+    if (!renderer) {
+        fprintf(stderr, "Skipping the render benchmarks. %s\n", SDL_GetError());
+        return false;
+    }
+
+    SDL_RendererInfo info;
+    if (0 == SDL_GetRendererInfo(renderer, &info)) {
+        printf("# renderer %s\n", info.name);
+    }
+
+    if (!screen_init(&screen, renderer, spritesSurface, uiFontSurface, hsFontSurface)) {
+        return false;
+    }
+    SDL_FreeSurface(spritesSurface);
+    SDL_FreeSurface(uiFontSurface);
+    SDL_FreeSurface(hsFontSurface);
+
+    SDL_Texture *target = SDL_CreateTexture(
+            renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET,
+            screen.windowW, screen.windowH);
+    if (!target) {
+        fprintf(stderr, "Could not create the offscreen target. %s\n", SDL_GetError());
+        return false;
+    }
+    SDL_SetRenderTarget(renderer, target);
+
+    bench_text_draw_line(&screen);
+    bench_render_frame(&screen, 0, "render_frame");
+    bench_render_frame(&screen, MAX_GHOSTS, "render_frame_ghosts");
+
+    SDL_SetRenderTarget(renderer, NULL);
+    SDL_DestroyTexture(target);
+    screen_destroy(&screen);
+    SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(window);
+    return true;
+}
+
+//
+// Main
+// ----
+
+static void print_usage(const char *progname)
+{
+    printf("Usage: %s [OPTIONS]\n"
+           "Runs the xjump microbenchmarks and prints the time per operation, in ns.\n"
+           "\n"
+           "  -h            show this help message and exit\n"
+           "  -n SAMPLES    number of samples per benchmark (default: 200)\n"
+           "  -d DIR        directory with the fonts and themes (default: data)\n"
+           "  -s            only run the simulation benchmarks\n",
+           progname);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dataDir = "data";
+    bool simOnly = false;
+
+    int c;
+    while ((c = getopt(argc, argv, "hn:d:s")) != -1) {
+        switch (c) {
+            case 'h':
+                print_usage(argv[0]);
+                exit(0);
+
+            case 'n':
+                nsamples = atoi(optarg);
+                break;
+
+            case 'd':
+                dataDir = optarg;
+                break;
+
+            case 's':
+                simOnly = true;
+                break;
+
+            default:
+                exit(1);
+        }
+    }
+    if (nsamples < 1) nsamples = 1;
+
+    samples = malloc(nsamples * sizeof(double));
+    if (!samples) { perror("malloc"); exit(1); }
+
+    const int64_t seed[2] = { 0xbe7c4, 0 };
+    pcg32_init(&botRng, seed);
+
+    printf("# name\tsamples\tops\tmean\tp50\tp90\tp99\tmax\n");
+    bench_updateGame();
+    bench_xj_step();
+    bench_xj_batch_step();
+    bench_generate_floor();
+    bench_pcg32_bounded();
+    bench_isStanding();
+    if (!simOnly) {
+        run_render_benchmarks(dataDir);
+    }
+
+    free(samples);
+    return 0;
+}
@@ -0,0 +1,770 @@
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "broadcast.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "replay.h"
+
+#define SYM_SCROLL   6
+#define SYM_OVER     (0 << 3 | 7)
+#define SYM_SNAPSHOT (1 << 3 | 7)
+#define SYM_NEWGAME  (2 << 3 | 7)
+#define SYM_CHECK    (3 << 3 | 7)
+
+#define HELLO_SIZE 5
+
+static const char magic[4] = { 'X', 'J', 'B', 'C' };
+
+//
+// Buffers
+// -------
+//
+// If we run out of memory the data is dropped. The spectators notice it at the
+// next checksum and reconnect.
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t capacity;
+} Buffer;
+
+static bool buf_put(Buffer *b, const void *src, size_t n)
+{
+    if (b->len + n > b->capacity) {
+        size_t capacity = (b->capacity ? b->capacity : 256);
+        while (capacity < b->len + n) capacity *= 2;
+        uint8_t *data = realloc(b->data, capacity);
+        if (!data) return false;
+        b->data = data;
+        b->capacity = capacity;
+    }
+    if (n > 0) memcpy(b->data + b->len, src, n);
+    b->len += n;
+    return true;
+}
+
+static void buf_byte(Buffer *b, uint8_t x)
+{
+    buf_put(b, &x, 1);
+}
+
+static void buf_u64(Buffer *b, uint64_t x)
+{
+    uint8_t buf[8];
+    for (int i = 0; i < 8; i++) {
+        buf[i] = (x >> (8*i)) & 0xff;
+    }
+    buf_put(b, buf, 8);
+}
+
+static void buf_consume(Buffer *b, size_t n)
+{
+    memmove(b->data, b->data + n, b->len - n);
+    b->len -= n;
+}
+
+static void buf_swap(Buffer *a, Buffer *b)
+{
+    Buffer t = *a;
+    *a = *b;
+    *b = t;
+}
+
+static uint64_t get_u64(const uint8_t *buf)
+{
+    uint64_t x = 0;
+    for (int i = 0; i < 8; i++) {
+        x |= ((uint64_t) buf[i]) << (8*i);
+    }
+    return x;
+}
+
+// Same as in replay.c. Returns the number of bytes consumed, or 0 if the
+// varint is malformed or runs past the end of the buffer.
+static size_t get_varint(const uint8_t *buf, size_t len, uint32_t *out)
+{
+    uint32_t x = 0;
+    for (size_t i = 0; i < len && i < 5; i++) {
+        x |= ((uint32_t) (buf[i] & 0x7f)) << (7*i);
+        if (!(buf[i] & 0x80)) {
+            *out = x;
+            return i+1;
+        }
+    }
+    return 0;
+}
+
+//
+// Broadcaster
+// -----------
+
+static int listenSock = -1;
+static int wakePipe[2] = { -1, -1 };    // The main thread pokes the worker
+static void (*bcNotify)(void);
+static pthread_t bcThread;
+static bool bcRunning;
+
+// Only used by the main thread
+static Buffer out;          // Encoded since the last flush
+static int outSym = -1;     // Input of the current run
+static int outRun;          // Length of the current run
+static int ticksSinceCheck;
+
+// Shared with the worker, under the lock
+static pthread_mutex_t bcLock = PTHREAD_MUTEX_INITIALIZER;
+static bool bcQuit;
+static Buffer pending;      // Flushed, but not yet sent
+static Buffer joinMsg;      // Snapshot for the spectators that just connected
+static size_t joinOffset;   // Where the bytes that come after the snapshot start in pending
+static bool hasJoinMsg;
+static bool needsJoin;      // Some spectator is waiting for a snapshot
+static int numSpectators;
+
+// Only used by the worker
+typedef struct {
+    int fd;
+    bool isLive;    // Got the snapshot; from now on it gets the deltas
+    bool isDead;
+    Buffer backlog; // What the socket didn't take yet
+} Spectator;
+
+static Spectator clients[BROADCAST_MAX_CLIENTS];
+static int nclients;
+
+// Sends what the socket takes right away and keeps the rest for later.
+// Returns false if the spectator has to be dropped.
+static bool client_send(Spectator *c, const uint8_t *data, size_t n)
+{
+    if (c->backlog.len == 0 && n > 0) {
+        ssize_t k = send(c->fd, data, n, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (k < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return false;
+        if (k > 0) {
+            data += k;
+            n -= k;
+        }
+    }
+    if (n == 0) return true;
+    if (c->backlog.len + n > BROADCAST_MAX_BACKLOG) return false;
+    return buf_put(&c->backlog, data, n);
+}
+
+static bool client_drain(Spectator *c)
+{
+    ssize_t k = send(c->fd, c->backlog.data, c->backlog.len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (k < 0) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+    buf_consume(&c->backlog, k);
+    return true;
+}
+
+static void client_accept()
+{
+    int fd = accept(listenSock, NULL, NULL);
+    if (fd < 0) return;
+    if (nclients == BROADCAST_MAX_CLIENTS) {
+        close(fd);
+        return;
+    }
+
+    Spectator *c = &clients[nclients++];
+    *c = (Spectator){ fd, false, false, { 0 } };
+    uint8_t hello[HELLO_SIZE];
+    memcpy(hello, magic, 4);
+    hello[4] = BROADCAST_VERSION;
+    c->isDead = !client_send(c, hello, sizeof(hello));
+
+    pthread_mutex_lock(&bcLock);
+    numSpectators++;
+    needsJoin = true;
+    pthread_mutex_unlock(&bcLock);
+
+    // The main thread might be asleep, waiting for events
+    if (bcNotify) bcNotify();
+}
+
+static void remove_dead_clients()
+{
+    int n = 0;
+    for (int i = 0; i < nclients; i++) {
+        if (clients[i].isDead) {
+            close(clients[i].fd);
+            free(clients[i].backlog.data);
+        } else {
+            clients[n++] = clients[i];
+        }
+    }
+    if (n < nclients) {
+        pthread_mutex_lock(&bcLock);
+        numSpectators -= (nclients - n);
+        pthread_mutex_unlock(&bcLock);
+    }
+    nclients = n;
+}
+
+static void *broadcast_worker(void *unused)
+{
+    (void) unused;
+    Buffer chunk = { 0 };
+    Buffer join = { 0 };
+
+    while (1) {
+        struct pollfd fds[2 + BROADCAST_MAX_CLIENTS];
+        fds[0] = (struct pollfd){ wakePipe[0], POLLIN, 0 };
+        fds[1] = (struct pollfd){ listenSock, POLLIN, 0 };
+        for (int i = 0; i < nclients; i++) {
+            short events = POLLIN | (clients[i].backlog.len > 0 ? POLLOUT : 0);
+            fds[2+i] = (struct pollfd){ clients[i].fd, events, 0 };
+        }
+        int n = nclients;
+        if (poll(fds, 2 + n, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        // Spectators don't send anything, so readable means closed
+        for (int i = 0; i < n; i++) {
+            Spectator *c = &clients[i];
+            short ev = fds[2+i].revents;
+            if (ev & (POLLIN | POLLERR | POLLHUP)) {
+                uint8_t tmp[64];
+                ssize_t k = recv(c->fd, tmp, sizeof(tmp), MSG_DONTWAIT);
+                if (k == 0 || (k < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                    c->isDead = true;
+                }
+            }
+            if ((ev & POLLOUT) && !c->isDead) {
+                c->isDead = !client_drain(c);
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            uint8_t tmp[64];
+            while (read(wakePipe[0], tmp, sizeof(tmp)) > 0) {
+                // Drain
+            }
+
+            pthread_mutex_lock(&bcLock);
+            if (bcQuit) {
+                pthread_mutex_unlock(&bcLock);
+                break;
+            }
+            buf_swap(&chunk, &pending);
+            pending.len = 0;
+            bool hasJoin = hasJoinMsg;
+            size_t offset = joinOffset;
+            if (hasJoin) {
+                buf_swap(&join, &joinMsg);
+                hasJoinMsg = false;
+            }
+            pthread_mutex_unlock(&bcLock);
+
+            // The same bytes for everyone
+            for (int i = 0; i < nclients; i++) {
+                Spectator *c = &clients[i];
+                if (c->isDead) continue;
+                if (c->isLive) {
+                    c->isDead = !client_send(c, chunk.data, chunk.len);
+                } else if (hasJoin) {
+                    c->isDead = !client_send(c, join.data, join.len) ||
+                                !client_send(c, chunk.data + offset, chunk.len - offset);
+                    c->isLive = true;
+                }
+            }
+        }
+
+        if (fds[1].revents & POLLIN) {
+            client_accept();
+        }
+
+        remove_dead_clients();
+    }
+
+    for (int i = 0; i < nclients; i++) {
+        clients[i].isDead = true;
+    }
+    remove_dead_clients();
+    free(chunk.data);
+    free(join.data);
+    return NULL;
+}
+
+// Listens on all interfaces. The notify function is called from the worker
+// thread when a spectator connects, so that the main thread calls
+// broadcast_flush even if it is waiting for events.
+bool broadcast_start(const char *port, void (*notify)(void))
+{
+    struct addrinfo hints = { 0 };
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    struct addrinfo *addrs;
+    int err = getaddrinfo(NULL, port, &hints, &addrs);
+    if (err != 0) {
+        fprintf(stderr, "Broadcast: invalid port '%s'. %s\n", port, gai_strerror(err));
+        return false;
+    }
+
+    for (struct addrinfo *a = addrs; a != NULL; a = a->ai_next) {
+        listenSock = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (listenSock < 0) continue;
+        int yes = 1;
+        setsockopt(listenSock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if (0 == bind(listenSock, a->ai_addr, a->ai_addrlen) && 0 == listen(listenSock, 16)) break;
+        close(listenSock);
+        listenSock = -1;
+    }
+    freeaddrinfo(addrs);
+
+    if (listenSock < 0) {
+        fprintf(stderr, "Broadcast: could not listen on port %s. %s\n", port, strerror(errno));
+        return false;
+    }
+
+    if (0 != pipe(wakePipe)) {
+        fprintf(stderr, "Broadcast: could not create pipe. %s\n", strerror(errno));
+        return false;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(wakePipe[i], F_SETFL, fcntl(wakePipe[i], F_GETFL) | O_NONBLOCK);
+    }
+
+    bcNotify = notify;
+    if (0 != pthread_create(&bcThread, NULL, broadcast_worker, NULL)) {
+        fprintf(stderr, "Could not start broadcast thread\n");
+        return false;
+    }
+    bcRunning = true;
+    return true;
+}
+
+static void out_flush_run()
+{
+    if (outRun > 0) {
+        buf_byte(&out, (outRun - 1) << 3 | outSym);
+        outRun = 0;
+    }
+}
+
+// The flags are the same as in replay files
+void broadcast_new_game(uint8_t flags, const int64_t seed[2])
+{
+    if (!bcRunning) return;
+    out_flush_run();
+    buf_byte(&out, SYM_NEWGAME);
+    buf_byte(&out, flags);
+    buf_u64(&out, seed[0]);
+    buf_u64(&out, seed[1]);
+    ticksSinceCheck = 0;
+}
+
+// Must be called right before each simulation frame, after the input is set
+void broadcast_tick(const Game *g)
+{
+    if (!bcRunning) return;
+    int sym = input_encode(&g->input);
+    if (sym != outSym || outRun == REPLAY_MAX_RUN) {
+        out_flush_run();
+        outSym = sym;
+    }
+    outRun++;
+    ticksSinceCheck++;
+}
+
+void broadcast_scroll(int distance)
+{
+    if (!bcRunning || distance <= 0) return;
+    out_flush_run();
+    buf_byte(&out, SYM_SCROLL);
+    uint32_t x = distance;
+    do {
+        uint8_t b = x & 0x7f;
+        x >>= 7;
+        buf_byte(&out, b | (x ? 0x80 : 0));
+    } while (x);
+}
+
+void broadcast_game_over()
+{
+    if (!bcRunning) return;
+    out_flush_run();
+    buf_byte(&out, SYM_OVER);
+}
+
+// Hands what was encoded during this frame to the worker. Must be called once
+// per frame, after the forced scrolls, so that the game is in the same state
+// as a spectator that has played everything up to here.
+void broadcast_flush(const Game *g, bool isOver)
+{
+    if (!bcRunning) return;
+    out_flush_run();
+    if (ticksSinceCheck >= BROADCAST_CHECK_INTERVAL) {
+        buf_byte(&out, SYM_CHECK);
+        buf_u64(&out, game_checksum(g));
+        ticksSinceCheck = 0;
+    }
+
+    pthread_mutex_lock(&bcLock);
+    bool wake = false;
+    if (numSpectators > 0 && out.len > 0) {
+        buf_put(&pending, out.data, out.len);
+        wake = true;
+    }
+    if (needsJoin) {
+        uint8_t snapshot[GAME_SNAPSHOT_SIZE];
+        game_save(g, snapshot);
+        joinMsg.len = 0;
+        buf_byte(&joinMsg, SYM_SNAPSHOT);
+        buf_put(&joinMsg, snapshot, sizeof(snapshot));
+        if (isOver) buf_byte(&joinMsg, SYM_OVER);
+        joinOffset = pending.len;
+        hasJoinMsg = true;
+        needsJoin = false;
+        wake = true;
+    }
+    pthread_mutex_unlock(&bcLock);
+    out.len = 0;
+
+    if (wake) {
+        uint8_t b = 0;
+        if (write(wakePipe[1], &b, 1) < 0) {
+            // The pipe is full, so the worker is going to wake up anyway
+        }
+    }
+}
+
+void broadcast_stop()
+{
+    if (!bcRunning) return;
+    pthread_mutex_lock(&bcLock);
+    bcQuit = true;
+    pthread_mutex_unlock(&bcLock);
+    uint8_t b = 0;
+    if (write(wakePipe[1], &b, 1) < 0) {
+        // Same as above
+    }
+    pthread_join(bcThread, NULL);
+    bcRunning = false;
+
+    close(listenSock);
+    close(wakePipe[0]);
+    close(wakePipe[1]);
+    free(out.data);
+    free(pending.data);
+    free(joinMsg.data);
+}
+
+//
+// Spectator
+// ---------
+
+static char *specHost;
+static char *specPort;
+static void (*specNotify)(void);
+static pthread_t specThread;
+static bool specRunning;
+
+// Shared with the receiver thread, under the lock
+static pthread_mutex_t specLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t specCond = PTHREAD_COND_INITIALIZER;
+static bool specQuit;
+static int specSock = -1;
+static Buffer received;         // Not yet played
+static uint64_t generation;     // Incremented for each new connection
+
+// Only used by the main thread
+static uint64_t readGeneration;
+static bool isSynced;   // We have the game that the deltas apply to
+static int runSym;      // Input of the current run
+static int runLeft;     // Remaining frames of the current run
+
+static int connect_to(const char *host, const char *port)
+{
+    struct addrinfo hints = { 0 };
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *addrs;
+    int err = getaddrinfo(host, port, &hints, &addrs);
+    if (err != 0) {
+        fprintf(stderr, "Spectate: could not resolve %s. %s\n", host, gai_strerror(err));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *a = addrs; a != NULL; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd < 0) continue;
+        if (0 == connect(fd, a->ai_addr, a->ai_addrlen)) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addrs);
+
+    if (fd < 0) {
+        fprintf(stderr, "Spectate: could not connect to %s:%s\n", host, port);
+    }
+    return fd;
+}
+
+// Receives the stream of one connection, until it is closed. Returns false if
+// the other side is not an xjump broadcast, in which case there is no point in
+// trying again.
+static bool receive_stream(int fd)
+{
+    uint8_t hello[HELLO_SIZE];
+    ssize_t k = recv(fd, hello, sizeof(hello), MSG_WAITALL);
+    if (k != sizeof(hello)) return true;
+    if (0 != memcmp(hello, magic, 4) || hello[4] != BROADCAST_VERSION) {
+        fprintf(stderr, "Spectate: %s:%s is not an xjump broadcast, or has a different version\n", specHost, specPort);
+        return false;
+    }
+
+    while (1) {
+        uint8_t buf[4096];
+        k = recv(fd, buf, sizeof(buf), 0);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) break;
+        pthread_mutex_lock(&specLock);
+        buf_put(&received, buf, k);
+        pthread_mutex_unlock(&specLock);
+        if (specNotify) specNotify();
+    }
+    return true;
+}
+
+static void *spectate_worker(void *unused)
+{
+    (void) unused;
+    pthread_mutex_lock(&specLock);
+    while (!specQuit) {
+        pthread_mutex_unlock(&specLock);
+        int fd = connect_to(specHost, specPort);
+        pthread_mutex_lock(&specLock);
+
+        if (fd >= 0 && !specQuit) {
+            specSock = fd;
+            received.len = 0;
+            generation++;
+            pthread_mutex_unlock(&specLock);
+
+            bool ok = receive_stream(fd);
+
+            pthread_mutex_lock(&specLock);
+            specSock = -1;
+            close(fd);
+            if (!ok) break;
+            if (!specQuit) {
+                fprintf(stderr, "Spectate: disconnected from %s:%s\n", specHost, specPort);
+            }
+        } else if (fd >= 0) {
+            close(fd);
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += SPECTATE_RETRY;
+        while (!specQuit) {
+            if (ETIMEDOUT == pthread_cond_timedwait(&specCond, &specLock, &deadline)) break;
+        }
+    }
+    pthread_mutex_unlock(&specLock);
+    return NULL;
+}
+
+// The address is HOST or HOST:PORT. The notify function is called from the
+// receiver thread when new data arrives.
+bool spectate_start(const char *address, void (*notify)(void))
+{
+    const char *colon = strrchr(address, ':');
+    if (colon && colon == strchr(address, ':')) {
+        specHost = strndup(address, colon - address);
+        specPort = strdup(colon + 1);
+    } else {
+        specHost = strdup(address);
+        specPort = strdup(BROADCAST_DEFAULT_PORT);
+    }
+    if (!specHost || !specPort || !*specHost || !*specPort) {
+        fprintf(stderr, "Invalid spectate address '%s'. It should look like host[:port]\n", address);
+        return false;
+    }
+
+    specNotify = notify;
+    if (0 != pthread_create(&specThread, NULL, spectate_worker, NULL)) {
+        fprintf(stderr, "Could not start spectate thread\n");
+        return false;
+    }
+    specRunning = true;
+    return true;
+}
+
+// Must be called with the lock. The receiver thread starts over with a new
+// connection, and a new snapshot.
+static void request_reconnect()
+{
+    if (specSock >= 0) shutdown(specSock, SHUT_RDWR);
+    received.len = 0;
+    isSynced = false;
+    runLeft = 0;
+}
+
+// The size of the message at the start of the buffer, 0 if it hasn't arrived
+// completely yet, or -1 if it is invalid.
+static long message_size(const uint8_t *d, size_t n)
+{
+    if (n == 0) return 0;
+    uint8_t code = d[0];
+    if ((code & 7) <= REPLAY_MAX_INPUT) return 1;
+
+    size_t size;
+    switch (code) {
+        case SYM_SCROLL: {
+            uint32_t distance;
+            size_t k = get_varint(d + 1, n - 1, &distance);
+            if (k == 0) return (n - 1 >= 5 ? -1 : 0);
+            return 1 + k;
+        }
+        case SYM_OVER:     size = 1; break;
+        case SYM_SNAPSHOT: size = 1 + GAME_SNAPSHOT_SIZE; break;
+        case SYM_NEWGAME:  size = 1 + 1 + 16; break;
+        case SYM_CHECK:    size = 1 + 8; break;
+        default:           return -1;
+    }
+    return (n >= size ? (long) size : 0);
+}
+
+// Plays the stream up to the next frame. Forced scrolls and checksums are
+// handled here; the other events are for the caller.
+SpectateEvent spectate_feed(Game *g)
+{
+    if (!specRunning) return SPECTATE_WAIT;
+    SpectateEvent ev = SPECTATE_WAIT;
+    pthread_mutex_lock(&specLock);
+
+    if (readGeneration != generation) {
+        readGeneration = generation;
+        isSynced = false;
+        runLeft = 0;
+    }
+
+    if (runLeft > 0) {
+        runLeft--;
+        input_decode(&g->input, runSym);
+        pthread_mutex_unlock(&specLock);
+        return SPECTATE_TICK;
+    }
+
+    size_t pos = 0;
+    while (ev == SPECTATE_WAIT) {
+        const uint8_t *d = received.data + pos;
+        size_t n = received.len - pos;
+        long size = message_size(d, n);
+        if (size == 0) break;
+        if (size < 0) {
+            fprintf(stderr, "Spectate: invalid data from the broadcast. Reconnecting.\n");
+            request_reconnect();
+            pos = 0;
+            break;
+        }
+        pos += size;
+
+        uint8_t code = d[0];
+        if (code == SYM_SNAPSHOT) {
+            game_load(g, d + 1, GAME_SNAPSHOT_SIZE);
+            isSynced = true;
+            ev = SPECTATE_NEWGAME;
+        } else if (code == SYM_NEWGAME) {
+            g->isSoftScroll = (d[1] & REPLAY_FLAG_SOFTSCROLL) != 0;
+            g->floorGenerator = ((d[1] & REPLAY_FLAG_COUNTERFLOORS) ? FLOORGEN_COUNTER : FLOORGEN_CLASSIC);
+            const int64_t seed[2] = { get_u64(d + 2), get_u64(d + 10) };
+            pcg32_init(&g->rng, seed);
+            init_game(g);
+            isSynced = true;
+            ev = SPECTATE_NEWGAME;
+        } else if (!isSynced) {
+            // Left over from before the snapshot
+        } else if ((code & 7) <= REPLAY_MAX_INPUT) {
+            runSym = code & 7;
+            runLeft = code >> 3;
+            input_decode(&g->input, runSym);
+            ev = SPECTATE_TICK;
+        } else if (code == SYM_SCROLL) {
+            uint32_t distance = 0;
+            get_varint(d + 1, n - 1, &distance);
+            applyForcedScroll(g, distance);
+        } else if (code == SYM_OVER) {
+            ev = SPECTATE_GAMEOVER;
+        } else if (code == SYM_CHECK) {
+            if (get_u64(d + 1) != game_checksum(g)) {
+                fprintf(stderr, "Spectate: the game diverged from the broadcast. Reconnecting.\n");
+                request_reconnect();
+                pos = 0;
+                break;
+            }
+        }
+    }
+    buf_consume(&received, pos);
+
+    pthread_mutex_unlock(&specLock);
+    return ev;
+}
+
+// How many frames have arrived but not been played yet
+int spectate_lag()
+{
+    if (!specRunning) return 0;
+    pthread_mutex_lock(&specLock);
+    int lag = runLeft;
+    size_t pos = 0;
+    while (1) {
+        long size = message_size(received.data + pos, received.len - pos);
+        if (size <= 0) break;
+        uint8_t code = received.data[pos];
+        if ((code & 7) <= REPLAY_MAX_INPUT) lag += 1 + (code >> 3);
+        pos += size;
+    }
+    pthread_mutex_unlock(&specLock);
+    return lag;
+}
+
+void spectate_stop()
+{
+    if (!specRunning) return;
+    pthread_mutex_lock(&specLock);
+    specQuit = true;
+    if (specSock >= 0) shutdown(specSock, SHUT_RDWR);
+    pthread_cond_signal(&specCond);
+    pthread_mutex_unlock(&specLock);
+    pthread_join(specThread, NULL);
+    specRunning = false;
+
+    free(received.data);
+    free(specHost);
+    free(specPort);
+}
@@ -0,0 +1,82 @@
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef XJUMP_BROADCAST_H
+#define XJUMP_BROADCAST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "game.h"
+
+//
+// Spectator broadcast
+// -------------------
+//
+// Streams a game while it is played, to spectators that simulate it on their
+// own machines. The simulation is deterministic, so the stream only has to
+// carry the seed and the input of each frame, about 40 bytes per second. It
+// is a TCP stream that starts with "XJBC" and a version byte (u8), followed
+// by the same one-byte codes as a replay file, (run << 3 | sym):
+//
+//   0-5  input for the next run+1 frames
+//   6    forced scroll, followed by the distance in pixels, as a LEB128 varint
+//   7    run=0: the game is over
+//        run=1: snapshot of the current game, GAME_SNAPSHOT_SIZE bytes
+//        run=2: new game, followed by flags (u8) and seed (2 x i64)
+//        run=3: checksum of the game state (u64)
+//
+// A spectator that connects in the middle of a game gets a snapshot first,
+// and the deltas from then on. There is a checksum every
+// BROADCAST_CHECK_INTERVAL frames; if the spectator's game doesn't match, it
+// reconnects to get a new snapshot.
+//
+// The main thread encodes the stream once per frame, into a single buffer,
+// and a background thread sends that same buffer to each spectator. The
+// sockets don't block, and spectators that fall too far behind are dropped.
+//
+// On the spectator side, a background thread receives the stream and the main
+// thread plays it back with spectate_feed, in the same way as a replay.
+
+#define BROADCAST_VERSION 2   /* 2: 64-bit floor numbers in the snapshots */
+#define BROADCAST_DEFAULT_PORT "7447"
+#define BROADCAST_MAX_CLIENTS 64
+#define BROADCAST_MAX_BACKLOG (64 << 10)   /* Bytes waiting for a slow spectator */
+#define BROADCAST_CHECK_INTERVAL 200       /* Five seconds of game time */
+
+#define SPECTATE_MAX_LAG 8  /* Frames behind the broadcast before we catch up */
+#define SPECTATE_RETRY   2  /* Seconds between connection attempts */
+
+bool broadcast_start(const char *port, void (*notify)(void));
+void broadcast_new_game(uint8_t flags, const int64_t seed[2]);
+void broadcast_tick(const Game *g);
+void broadcast_scroll(int distance);
+void broadcast_game_over();
+void broadcast_flush(const Game *g, bool isOver);
+void broadcast_stop();
+
+typedef enum {
+    SPECTATE_TICK,      // The input for the next frame is set
+    SPECTATE_WAIT,      // Nothing new from the broadcaster yet
+    SPECTATE_NEWGAME,   // The game was replaced, by a new game or a snapshot
+    SPECTATE_GAMEOVER,
+} SpectateEvent;
+
+bool spectate_start(const char *address, void (*notify)(void));
+SpectateEvent spectate_feed(Game *g);
+int spectate_lag();
+void spectate_stop();
+
+#endif
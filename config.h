@@ -0,0 +1,8 @@
+/* Do not edit this file by hand */
+/* It was generated by the build system */
+#define XJUMP_VERSION "3.0.4"
+#define XJUMP_PREFIX  "/usr/local"
+#define XJUMP_BINDIR  "/usr/local/bin"
+#define XJUMP_DATADIR "/usr/local/share"
+#define XJUMP_APPNAME "br.com.gualandi.Xjump"
+#define XJUMP_EMBED_DATA 0
@@ -0,0 +1,8 @@
+# Generated by the ./configure script
+version = 3.0.4
+prefix  = /usr/local
+bindir  = ${prefix}/bin
+datadir = ${prefix}/share
+appname = br.com.gualandi.Xjump
+SDL_CFLAGS = -I/tmp/sdlstub
+SDL_LIBS   = -L/tmp/sdlstub -lSDL2stub
@@ -0,0 +1,111 @@
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "core.h"
+
+#include <string.h>
+
+void xj_init(XjCore *ctx, bool isSoftScroll, FloorGenerator floorGenerator)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->game.isSoftScroll = isSoftScroll;
+    ctx->game.floorGenerator = floorGenerator;
+}
+
+// Starts a new game. With a NULL seed, the RNG carries on from the previous
+// game, which is what xjump does between runs.
+void xj_reset(XjCore *ctx, const int64_t seed[2])
+{
+    if (seed) {
+        pcg32_init(&ctx->game.rng, seed);
+    }
+    init_game(&ctx->game);
+    ctx->ticks = 0;
+    ctx->isDead = false;
+    ctx->lastBump = 0;
+}
+
+void xj_set_action(XjCore *ctx, int action)
+{
+    bool left  = (action & XJ_ACTION_LEFT);
+    bool right = (action & XJ_ACTION_RIGHT);
+    LeftRight dir = (left == right ? LR_NEUTRAL : left ? LR_LEFT : LR_RIGHT);
+    input_set(&ctx->game.input, dir, (action & XJ_ACTION_JUMP));
+}
+
+// Runs one frame with the current input. Returns whether the hero died.
+bool xj_update(XjCore *ctx)
+{
+    ctx->isDead = updateGame(&ctx->game);
+    ctx->ticks++;
+    ctx->lastBump = 0;
+    return ctx->isDead;
+}
+
+// Applies the forced scroll that the renderer would have applied at the end
+// of the frame. Returns the size of the scroll, in pixels.
+int xj_settle(XjCore *ctx)
+{
+    Game *g = &ctx->game;
+    int bump = 0;
+    if (g->isSoftScroll && !ctx->isDead) {
+        int sx, sy;
+        interpolateHero(g, 0, &sx, &sy, &bump);
+        applyForcedScroll(g, bump);
+    }
+    ctx->lastBump = bump;
+    return bump;
+}
+
+// Returns whether the game is over. Once it is, further steps do nothing
+// until the next reset.
+bool xj_step(XjCore *ctx, int action)
+{
+    if (ctx->isDead) return true;
+    xj_set_action(ctx, action);
+    xj_update(ctx);
+    xj_settle(ctx);
+    return ctx->isDead;
+}
+
+static int32_t clamp32(int64_t v)
+{
+    return (v > INT32_MAX ? INT32_MAX : v < INT32_MIN ? INT32_MIN : (int32_t) v);
+}
+
+void xj_observe(const XjCore *ctx, int32_t obs[XJ_OBS_SIZE])
+{
+    const Game *g = &ctx->game;
+    obs[XJ_OBS_X] = g->x;
+    obs[XJ_OBS_Y] = g->y;
+    obs[XJ_OBS_VX] = g->vx;
+    obs[XJ_OBS_VY] = g->vy;
+    obs[XJ_OBS_JUMP] = g->jump;
+    obs[XJ_OBS_STANDING] = g->isStanding;
+    obs[XJ_OBS_FACING_RIGHT] = g->isFacingRight;
+    obs[XJ_OBS_FLOOR_OFFSET] = clamp32(g->floorOffset);
+    obs[XJ_OBS_SCROLL_COUNT] = g->scrollCount;
+    obs[XJ_OBS_SCROLL_SPEED] = g->scrollSpeed;
+    obs[XJ_OBS_SCORE] = clamp32(g->score);
+    obs[XJ_OBS_TICKS] = clamp32(ctx->ticks);
+    obs[XJ_OBS_DEAD] = ctx->isDead;
+
+    int32_t *floors = &obs[XJ_OBS_FLOORS];
+    for (int i = 0; i < XJ_OBS_ROWS; i++) {
+        const Floor *f = get_floor(g, g->floorOffset - (i - FIELD_EXTRA));
+        floors[2*i + 0] = f->left;
+        floors[2*i + 1] = f->right;
+    }
+}
@@ -0,0 +1,99 @@
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef XJUMP_CORE_H
+#define XJUMP_CORE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "game.h"
+
+//
+// Simulation library
+// ------------------
+//
+// libxjump-core is the simulation of game.c plus a small step/reset interface
+// on top of it, for programs that want to play the game without a window,
+// such as training environments. The xjump executable uses the same functions,
+// so both always simulate the same game.
+//
+// Everything lives in the XjCore struct, which the caller allocates. None of
+// these functions allocate memory, and contexts in different threads are
+// independent.
+//
+// One step is one simulation frame (GAME_SPEED milliseconds of game time). In
+// soft scroll mode, the forced scrolls are applied the same way as in the
+// --headless mode of xjump, with the hero where it is at the end of the frame.
+
+typedef struct {
+    Game game;
+    int64_t ticks;  // Steps since the last reset
+    bool isDead;
+    int lastBump;   // Forced scroll applied at the end of the last step
+} XjCore;
+
+// Actions are a combination of these flags. LEFT and RIGHT together are the
+// same as neither.
+#define XJ_ACTION_LEFT  1
+#define XJ_ACTION_RIGHT 2
+#define XJ_ACTION_JUMP  4
+
+void xj_init(XjCore *ctx, bool isSoftScroll, FloorGenerator floorGenerator);
+void xj_reset(XjCore *ctx, const int64_t seed[2]);
+bool xj_step(XjCore *ctx, int action);
+
+// The parts of xj_step, for front-ends that get the input from somewhere else
+// and that record or replay the game as they go.
+void xj_set_action(XjCore *ctx, int action);
+bool xj_update(XjCore *ctx);
+int xj_settle(XjCore *ctx);
+
+//
+// Observations
+// ------------
+//
+// A flat array of int32_t, so that it can be shared with other languages
+// without conversions. Positions are in pixels, from the top-left corner of
+// the visible part of the tower. After the fixed fields come the floors of
+// the visible rows, from the top, as left and right tile columns; a row without
+// a floor has left > right. Row i starts at pixel (i - FIELD_EXTRA) * S, so
+// the first FIELD_EXTRA rows are the ones just above the screen. The floor
+// offset, the score and the ticks are 64-bit in the game, and saturate at
+// INT32_MAX here.
+
+#define XJ_OBS_ROWS (FIELD_H + FIELD_EXTRA)
+
+typedef enum {
+    XJ_OBS_X,
+    XJ_OBS_Y,
+    XJ_OBS_VX,              // In half-pixels per frame
+    XJ_OBS_VY,
+    XJ_OBS_JUMP,
+    XJ_OBS_STANDING,
+    XJ_OBS_FACING_RIGHT,
+    XJ_OBS_FLOOR_OFFSET,    // Floor number of the row at the top of the screen
+    XJ_OBS_SCROLL_COUNT,
+    XJ_OBS_SCROLL_SPEED,
+    XJ_OBS_SCORE,
+    XJ_OBS_TICKS,
+    XJ_OBS_DEAD,
+    XJ_OBS_FLOORS,          // 2 * XJ_OBS_ROWS values
+    XJ_OBS_SIZE = XJ_OBS_FLOORS + 2*XJ_OBS_ROWS
+} XjObsField;
+
+void xj_observe(const XjCore *ctx, int32_t obs[XJ_OBS_SIZE]);
+
+#endif
@@ -0,0 +1,189 @@
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// Build tool for the embedded data. Decodes the bitmaps in the data directory
+// and prints a C file with their pixels, in the ARGB8888 format of the
+// textures, so that the game can upload them without touching the disk.
+//
+// Usage: xjump-embed DATADIR NAME... > embedded.c
+//
+// Each NAME is the path of a bitmap relative to DATADIR, which is also what
+// it will be called in the table. We only need to understand the bitmaps we
+// ship: uncompressed, bottom-up or top-down, with 24 bits per pixel or with
+// 32 bits per pixel and color masks.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "assets.h"
+
+static uint32_t get_u16(const uint8_t *p) { return p[0] | p[1] << 8; }
+static uint32_t get_u32(const uint8_t *p) { return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24; }
+
+// Extracts the channel given by the mask and scales it to 8 bits
+static uint32_t channel(uint32_t px, uint32_t mask)
+{
+    if (mask == 0) return 0xff;
+    int shift = 0;
+    while (!((mask >> shift) & 1)) shift++;
+    uint32_t max = mask >> shift;
+    return ((px & mask) >> shift) * 255 / max;
+}
+
+static uint8_t *read_file(const char *path, size_t *size)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    long n = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *data = malloc(n > 0 ? n : 1);
+    if (!data || n <= 0 || (size_t) n != fread(data, 1, n, f)) {
+        fprintf(stderr, "%s: could not read file\n", path);
+        free(data);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    *size = n;
+    return data;
+}
+
+static uint32_t *decode_bmp(const char *path, int *w, int *h)
+{
+    size_t size;
+    uint8_t *data = read_file(path, &size);
+    if (!data) return NULL;
+
+    uint32_t *pixels = NULL;
+    if (size < 54 || data[0] != 'B' || data[1] != 'M') {
+        fprintf(stderr, "%s: not a bitmap file\n", path);
+        goto done;
+    }
+
+    uint32_t offset      = get_u32(data + 10);
+    uint32_t headerSize  = get_u32(data + 14);
+    int32_t  width       = (int32_t) get_u32(data + 18);
+    int32_t  height      = (int32_t) get_u32(data + 22);
+    uint32_t bpp         = get_u16(data + 28);
+    uint32_t compression = get_u32(data + 30);
+
+    uint32_t rmask = 0xff0000, gmask = 0xff00, bmask = 0xff, amask = 0;
+    if (compression == 3 && bpp == 32 && headerSize >= 56) {
+        rmask = get_u32(data + 54);
+        gmask = get_u32(data + 58);
+        bmask = get_u32(data + 62);
+        amask = get_u32(data + 66);
+    } else if (!(compression == 0 && (bpp == 24 || bpp == 32))) {
+        fprintf(stderr, "%s: unsupported bitmap format (%u bpp, compression %u)\n", path, bpp, compression);
+        goto done;
+    }
+
+    bool topDown = (height < 0);
+    if (topDown) height = -height;
+    size_t stride = ((size_t) width * bpp / 8 + 3) & ~(size_t) 3;
+    if (width <= 0 || height <= 0 || offset + stride * height > size) {
+        fprintf(stderr, "%s: truncated bitmap\n", path);
+        goto done;
+    }
+
+    pixels = malloc((size_t) width * height * sizeof(uint32_t));
+    if (!pixels) {
+        fprintf(stderr, "Out of memory\n");
+        goto done;
+    }
+    for (int y = 0; y < height; y++) {
+        const uint8_t *row = data + offset + stride * (topDown ? y : height - 1 - y);
+        for (int x = 0; x < width; x++) {
+            uint32_t px = (bpp == 32 ? get_u32(row + 4*x) :
+                           (uint32_t) row[3*x] | row[3*x+1] << 8 | row[3*x+2] << 16);
+            pixels[y*width + x] = channel(px, amask) << 24 | channel(px, rmask) << 16 |
+                                  channel(px, gmask) << 8  | channel(px, bmask);
+        }
+    }
+
+    // Like SDL_LoadBMP, treat a 32-bit bitmap whose alpha is all zero as opaque
+    bool hasAlpha = false;
+    for (int k = 0; k < width*height; k++) {
+        if (pixels[k] >> 24) hasAlpha = true;
+    }
+    if (!hasAlpha) {
+        for (int k = 0; k < width*height; k++) pixels[k] |= 0xff000000;
+    }
+
+    *w = width;
+    *h = height;
+
+done:
+    free(data);
+    return pixels;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s DATADIR NAME...\n", argv[0]);
+        return 1;
+    }
+    const char *dir = argv[1];
+    char **names = argv + 2;
+    int n = argc - 2;
+
+    int *ws = malloc(n * sizeof(int));
+    int *hs = malloc(n * sizeof(int));
+    if (!ws || !hs) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    printf("// Generated by xjump-embed. Do not edit this file by hand.\n\n");
+    printf("#include \"assets.h\"\n\n");
+
+    for (int i = 0; i < n; i++) {
+        const char *name = names[i];
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+        int w, h;
+        uint32_t *pixels = decode_bmp(path, &w, &h);
+        if (!pixels) return 1;
+        ws[i] = w;
+        hs[i] = h;
+
+        printf("static const uint32_t pixels%d[%d] = {", i, w*h);
+        for (int k = 0; k < w*h; k++) {
+            printf("%s0x%08x,", (k % 8 == 0 ? "\n    " : " "), pixels[k]);
+        }
+        printf("\n};\n\n");
+        free(pixels);
+    }
+
+    printf("const EmbeddedImage embeddedImages[] = {\n");
+    for (int i = 0; i < n; i++) {
+        printf("    { \"%s\", %d, %d, pixels%d },\n", names[i], ws[i], hs[i], i);
+    }
+    printf("};\n\n");
+    printf("const int numEmbeddedImages = %d;\n", n);
+
+    free(ws);
+    free(hs);
+    return 0;
+}
@@ -0,0 +1,164 @@
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#include "export.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static SDL_Renderer *renderer;
+static int width;
+static int height;
+static FILE *out;
+static bool isStdout;
+
+static SDL_Thread *writerThread;
+static SDL_mutex *lock;
+static SDL_cond *cond;      // Signaled when a buffer is filled or emptied
+
+// Shared with the writer, under the lock. The buffers are used in a ring:
+// the main thread fills them in order and the writer empties them in order.
+static uint8_t *buffers[EXPORT_NBUFFERS];
+static bool isFull[EXPORT_NBUFFERS];
+static bool isDone;         // No more frames are coming
+static bool hasError;       // The output could not be written
+
+// Only used by the main thread
+static int nextFill;
+static uint64_t nframes;
+
+static int export_worker(void *unused)
+{
+    (void) unused;
+    size_t frameSize = (size_t) width * height * EXPORT_BYTES_PER_PIXEL;
+    int next = 0;
+
+    SDL_LockMutex(lock);
+    while (1) {
+        while (!isFull[next] && !isDone) {
+            SDL_CondWait(cond, lock);
+        }
+        if (!isFull[next]) break;
+        SDL_UnlockMutex(lock);
+
+        bool ok = (fwrite(buffers[next], 1, frameSize, out) == frameSize);
+        if (!ok) {
+            fprintf(stderr, "Could not write the exported frames. %s\n", strerror(errno));
+        }
+
+        SDL_LockMutex(lock);
+        isFull[next] = false;
+        hasError = !ok;
+        SDL_CondSignal(cond);
+        if (!ok) break;
+        next = (next + 1) % EXPORT_NBUFFERS;
+    }
+    SDL_UnlockMutex(lock);
+    return 0;
+}
+
+// The frames are read from the current render target of the renderer, which
+// should be a w x h texture. The path "-" means stdout.
+bool export_start(const char *path, SDL_Renderer *r, int w, int h)
+{
+    renderer = r;
+    width = w;
+    height = h;
+
+    isStdout = (0 == strcmp(path, "-"));
+    out = (isStdout ? stdout : fopen(path, "wb"));
+    if (!out) {
+        fprintf(stderr, "Could not open %s. %s\n", path, strerror(errno));
+        return false;
+    }
+
+    for (int i = 0; i < EXPORT_NBUFFERS; i++) {
+        buffers[i] = malloc((size_t) w * h * EXPORT_BYTES_PER_PIXEL);
+        if (!buffers[i]) {
+            fprintf(stderr, "Could not allocate the frame buffers\n");
+            return false;
+        }
+    }
+
+    lock = SDL_CreateMutex();
+    cond = SDL_CreateCond();
+    writerThread = SDL_CreateThread(export_worker, "export", NULL);
+    if (!lock || !cond || !writerThread) {
+        fprintf(stderr, "Could not start export thread: %s\n", SDL_GetError());
+        return false;
+    }
+    return true;
+}
+
+// Reads back what was drawn since the last frame. Only waits if the writer is
+// still busy with all the other buffers. Returns false if the output can't be
+// written anymore.
+bool export_frame()
+{
+    int i = nextFill;
+    SDL_LockMutex(lock);
+    while (isFull[i] && !hasError) {
+        SDL_CondWait(cond, lock);
+    }
+    bool ok = !hasError;
+    SDL_UnlockMutex(lock);
+    if (!ok) return false;
+
+    // The buffer is ours until we mark it as full
+    if (0 != SDL_RenderReadPixels(renderer, NULL, EXPORT_FORMAT, buffers[i], width * EXPORT_BYTES_PER_PIXEL)) {
+        fprintf(stderr, "Could not read the frame back: %s\n", SDL_GetError());
+        return false;
+    }
+
+    SDL_LockMutex(lock);
+    isFull[i] = true;
+    SDL_CondSignal(cond);
+    SDL_UnlockMutex(lock);
+
+    nextFill = (i + 1) % EXPORT_NBUFFERS;
+    nframes++;
+    return true;
+}
+
+// Waits for the writer to get through the remaining frames. Returns whether
+// all of them were written.
+bool export_finish(uint64_t *n)
+{
+    if (!writerThread) return false;
+    SDL_LockMutex(lock);
+    isDone = true;
+    SDL_CondSignal(cond);
+    SDL_UnlockMutex(lock);
+    SDL_WaitThread(writerThread, NULL);
+    writerThread = NULL;
+
+    bool ok = !hasError;
+    if (isStdout) {
+        ok = (0 == fflush(out)) && ok;
+    } else {
+        ok = (0 == fclose(out)) && ok;
+    }
+    for (int i = 0; i < EXPORT_NBUFFERS; i++) {
+        free(buffers[i]);
+    }
+    SDL_DestroyCond(cond);
+    SDL_DestroyMutex(lock);
+
+    *n = nframes;
+    return ok;
+}
@@ -0,0 +1,52 @@
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#ifndef XJUMP_EXPORT_H
+#define XJUMP_EXPORT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <SDL.h>
+
+//
+// Frame export
+// ------------
+//
+// Writes every frame that the game draws as raw pixels, for turning replays
+// into videos. The frames are drawn into an offscreen texture at a fixed frame
+// rate, as fast as the GPU can go, and the output is a plain sequence of
+// width x height RGB24 images, with no header, that can be piped into an
+// encoder. For example:
+//
+//   xjump --replay run.xjr --export-frames - |
+//       ffmpeg -f rawvideo -pixel_format rgb24 -video_size 560x604 -framerate 60 -i - run.mp4
+//
+// Reading the pixels back waits for the GPU, and writing them out waits for
+// the encoder, so we do the two in parallel. There are EXPORT_NBUFFERS frame
+// buffers: while a background thread writes one of them to the output, the
+// main thread draws the next frame and reads it into another one.
+
+#define EXPORT_NBUFFERS 2
+#define EXPORT_FORMAT SDL_PIXELFORMAT_RGB24
+#define EXPORT_BYTES_PER_PIXEL 3
+#define EXPORT_DEFAULT_FPS 60
+
+bool export_start(const char *path, SDL_Renderer *renderer, int w, int h);
+bool export_frame();
+bool export_finish(uint64_t *nframes);
+
+#endif
@@ -0,0 +1,698 @@
+// Copyright 1997-1999 Tatsuya Kudoh
+// Copyright 1997-1999 Masato Taruishi
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "game.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+//
+// Helper functions
+// ----------------
+
+static int min(int x, int y)
+{
+    return (x < y ? x : y);
+}
+
+static int max(int x, int y)
+{
+    return (x > y ? x : y);
+}
+
+static int mod(int n, int m)
+{
+    assert(m > 0);
+    int r = n % m;
+    return (r >= 0 ? r : r + m);
+}
+
+//
+// Random Number Generator
+// -----------------------
+//
+// References:
+// https://www.pcg-random.org
+// https://www.pcg-random.org/posts/bounded-rands.html
+
+void pcg32_init(Pcg32 *rng, const int64_t seed[2])
+{
+    rng->state = seed[0];
+    rng->seq = (seed[1] << 1) | 1;
+}
+
+uint32_t pcg32_next(Pcg32 *rng)
+{
+    rng->state = rng->state * 6364136223846793005ULL + rng->seq;
+    uint32_t xorshifted = ((rng->state >> 18u) ^ rng->state) >> 27u;
+    uint32_t rot = rng->state >> 59u;
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+// Skips ahead delta steps in O(log delta) time. This is the jump-ahead trick
+// from the PCG paper: composing the LCG step with itself by repeated squaring.
+void pcg32_advance(Pcg32 *rng, uint64_t delta)
+{
+    uint64_t curMult = 6364136223846793005ULL;
+    uint64_t curPlus = rng->seq;
+    uint64_t accMult = 1;
+    uint64_t accPlus = 0;
+    while (delta > 0) {
+        if (delta & 1) {
+            accMult *= curMult;
+            accPlus = accPlus * curMult + curPlus;
+        }
+        curPlus = (curMult + 1) * curPlus;
+        curMult *= curMult;
+        delta /= 2;
+    }
+    rng->state = accMult * rng->state + accPlus;
+}
+
+// Returns an uniformly distributed integer in the range [0,a)
+uint32_t pcg32_bounded(Pcg32 *rng, uint32_t n)
+{
+    uint32_t x, r;
+    do {
+        x = pcg32_next(rng);
+        r = x % n;
+    } while (x - r > (-n));
+    return r;
+}
+
+// Returns an uniformly distributed integer in the range [a, b], inclusive
+uint32_t rnd(Pcg32 *rng, uint32_t a, uint32_t b)
+{
+    return a + pcg32_bounded(rng, b-a+1);
+}
+
+//
+// Joystick state
+// --------------
+
+// This component keeps track of the "joystick" state.
+// If both LEFT and RIGHT a pressed at the same time, the most recent one wins.
+
+void input_init(Joystick *K)
+{
+    K->horizDirection = LR_NEUTRAL;
+    for (int i = 0; i < INPUT_OTHER; i++) {
+        K->isPressing[i] = false;
+    }
+}
+
+void input_press(Joystick *K, Input input)
+{
+    if (input != INPUT_OTHER) {
+        K->isPressing[input] = true;
+        switch (input) {
+            case INPUT_LEFT:
+                K->horizDirection = LR_LEFT;
+                break;
+
+            case INPUT_RIGHT:
+                K->horizDirection = LR_RIGHT;
+                break;
+
+            default:
+                break;
+        }
+    }
+}
+
+void input_release(Joystick *K, Input input)
+{
+    if (input != INPUT_OTHER) {
+        K->isPressing[input] = false;
+        switch (input) {
+            case INPUT_LEFT:
+                K->horizDirection = (K->isPressing[INPUT_RIGHT] ? LR_RIGHT : LR_NEUTRAL);
+                break;
+
+            case INPUT_RIGHT:
+                K->horizDirection  = (K->isPressing[INPUT_LEFT] ? LR_LEFT : LR_NEUTRAL);
+                break;
+
+            default:
+                break;
+        }
+    }
+}
+
+// Used when the input doesn't come from the keyboard
+void input_set(Joystick *K, LeftRight dir, bool jump)
+{
+    K->horizDirection = dir;
+    K->isPressing[INPUT_LEFT]  = (dir == LR_LEFT);
+    K->isPressing[INPUT_RIGHT] = (dir == LR_RIGHT);
+    K->isPressing[INPUT_JUMP]  = jump;
+}
+
+// Compact representation of the input, used by the replay files
+int input_encode(const Joystick *K)
+{
+    return K->horizDirection*2 + K->isPressing[INPUT_JUMP];
+}
+
+void input_decode(Joystick *K, int sym)
+{
+    input_set(K, sym/2, sym%2);
+}
+
+//
+// Game Logic
+// ----------
+
+// HERE BE DRAGONS (SHOULD THIS BE REFACTORED?)
+// The game logic that I am using is taken almost directly from the original
+// XJump source code, with soft scrolling bolted on top. This causes the soft
+// scrolling parts to be a bit unnatural. The original logic is heavily tied
+// to the idea that the hero position is it's position in pixels. However, in
+// soft scrolling mode this is no longer true because the screen can scroll
+// between frames. The end result is stuff like forcedScroll and interpScroll.
+//
+// Part of me really wants to rewrite this code so that the hero coordinates
+// are relative to the bottom of the tower. That would greatly simplify the
+// scrolling logic, because that way the scrolling becomes mostly about the
+// camera position, not the hero position. But that will wait for another day
+// because I don't want to break working code.
+//
+// We should also consider if we really want to keep supporting the legacy
+// --hard-scroll mode. It took a lot of effort to stamp out all the scrolling
+// bugs and in the end the hard scroll logic was completely different than the
+// --soft-scroll one...
+
+// NFLOORS is a power of two, so the mask is the same as mod(n, NFLOORS), also
+// for negative floor numbers
+_Static_assert((NFLOORS & (NFLOORS-1)) == 0, "NFLOORS must be a power of two");
+
+const Floor *get_floor(const Game *g, int64_t n)
+{
+    return &g->floors[n & (NFLOORS-1)];
+}
+
+// Floor positions are measured in tiles and are stored in a circular
+// buffer. The left and right positions are inclusive, ranging [1,30].
+// The left and right walls are in positions 0 and 31, respectively.
+// The "origin" of each floor ranges [5,26] and is encoded by the fpos
+// variable, which can range between [0,21]. There can be between 2-4
+// tiles to the left and to the right of the origin, totaling 5-9 tiles.
+static void random_floor(Pcg32 *rng, int *fpos, Floor *floor)
+{
+    int sign = (rnd(rng, 0,1) ? +1 : -1);
+    int magnitude = rnd(rng, 5,9);
+    *fpos = mod(*fpos + sign*magnitude, 22);
+    floor->left  = *fpos+5 - rnd(rng, 2,4);
+    floor->right = *fpos+5 + rnd(rng, 2,4);
+}
+
+static const Floor wideFloor  = {   1,  30 };
+static const Floor emptyFloor = { -10, -20 };
+
+// Counter-based generator
+// The layout of each block of 5 floors comes from a PCG seeded by a hash of
+// the floor seed and the block number. The fpos starts over at every wide
+// floor, so computing a floor takes at most 49 steps, no matter how high it is.
+
+static uint64_t mix64(uint64_t z)
+{
+    // SplitMix64 finalizer
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static Pcg32 block_rng(const Game *g, int64_t key)
+{
+    Pcg32 rng;
+    rng.state = mix64(g->floorSeed + (uint64_t) key * 0x9e3779b97f4a7c15ULL);
+    rng.seq   = (g->floorSeed << 1) | 1;
+    return rng;
+}
+
+// Position of the first floor after the wide floor number 250*k
+static int segment_fpos(const Game *g, int64_t k)
+{
+    Pcg32 rng = block_rng(g, -1 - (int64_t) k);
+    return rnd(&rng, 0,21);
+}
+
+// Computes floor n using the counter-based generator. With the classic
+// generator, n must be one of the floors currently held in memory.
+Floor compute_floor(const Game *g, int64_t n)
+{
+    if (g->floorGenerator == FLOORGEN_CLASSIC) {
+        assert(g->next_floor - NFLOORS <= n && n < g->next_floor);
+        return *get_floor(g, n);
+    }
+
+    if (n < 0 || n % 5 != 0) return emptyFloor;
+    if (n % 250 == 0) return wideFloor;
+
+    Floor floor;
+    int fpos = segment_fpos(g, n / 250);
+    for (int64_t b = (n / 250) * 50 + 1; b <= n / 5; b++) {
+        Pcg32 rng = block_rng(g, b);
+        random_floor(&rng, &fpos, &floor);
+    }
+    return floor;
+}
+
+void generate_floor(Game *g)
+{
+    int64_t n = g->next_floor++;
+    Floor *floor = &g->floors[n & (NFLOORS-1)];
+    if (n % 250 == 0) {
+        *floor = wideFloor;
+        if (g->floorGenerator == FLOORGEN_COUNTER) {
+            g->fpos = segment_fpos(g, n / 250);
+        }
+    } else if (n % 5 == 0) {
+        if (g->floorGenerator == FLOORGEN_COUNTER) {
+            Pcg32 rng = block_rng(g, n / 5);
+            random_floor(&rng, &g->fpos, floor);
+        } else {
+            random_floor(&g->rng, &g->fpos, floor);
+        }
+    } else {
+        *floor = emptyFloor;
+    }
+}
+
+// The RNG and the configuration must be initialized beforehand
+void init_game(Game *g)
+{
+    input_init(&g->input);
+
+    g->score = 0;
+
+    g->x    = (FIELD_W/2)*S - R/2;
+    g->y    = (FIELD_H-4)*S - R;
+    g->vx   = 0;
+    g->vy   = 0;
+    g->jump = 0;
+
+    g->isStanding    = true;
+    g->isFacingRight = false;
+    g->isIdleVariant = false;
+    g->idleCount     = 0;
+
+    g->hasStarted   = false;
+    g->floorOffset  = 20;
+    g->forcedScroll = 0;
+    g->scrollCount  = 0;
+    g->scrollSpeed  = 0;
+
+    if (g->floorGenerator == FLOORGEN_COUNTER) {
+        g->floorSeed = (uint64_t) pcg32_next(&g->rng) << 32 | pcg32_next(&g->rng);
+        g->fpos = 0; // Set by the first wide floor
+    } else {
+        g->floorSeed = 0;
+        g->fpos = rnd(&g->rng, 0,21);
+    }
+    g->next_floor = -3;
+    for (int i=0; i < NFLOORS; i++) {
+        generate_floor(g);
+    }
+}
+
+void scroll(Game *g)
+{
+    generate_floor(g);
+    g->floorOffset += 1;
+    g->y += S;
+    if (g->forcedScroll >= S) {
+        g->forcedScroll -= S;
+    }
+}
+
+bool isStanding(const Game *g, int hx, int hy)
+{
+    if (g->vy < 0) {
+        return false;
+    }
+
+    int y = (hy + R)/S;
+    if (y >= FIELD_H) {
+        return false;
+    }
+
+    // We're standing as long as 8/32 pixels touch the ground.
+    const Floor *fl = get_floor(g, g->floorOffset - y);
+    return (fl->left*S - 24 <= hx && hx <= fl->right*S + 8);
+}
+
+int collideWithFloor(int hy) {
+    return (hy / S) * S;
+}
+
+bool updateGame(Game *g)
+{
+    const Joystick *K = &g->input;
+
+    g->x += g->vx / 2;
+    g->y += g->vy;
+
+    // First we collide with the walls, setting the x coordinate.
+    // The original version of xjump just set the x coordinate glued to the wall. This version makes
+    // the walls subtly bouncier by taking into account the X velocity after the bounce. It's subtle
+    // but feels better, IMO, specially if you are just bouncing off the walls before the game
+    // starts. The "-2" in the formula is a dampening factor to avoid "flickering" 1px bounces.
+    if (g->x < leftLimit && g->vx <= 0) {
+        g->x  = leftLimit + max(0, leftLimit - g->x - 2)/2;
+        g->vx = -g->vx/2;
+    }
+
+    if (g->x > rightLimit && g->vx >= 0) {
+        g->x  = rightLimit - max(0, g->x - rightLimit - 2)/2;
+        g->vx = -g->vx/2;
+    }
+
+    // Next we collide with the floors, setting the y coordinate.
+    // This must be after the wall collisions because it depends on the x.
+    g->isStanding = isStanding(g, g->x, g->y);
+    if (g->isStanding) {
+        g->y = collideWithFloor(g->y);
+        g->vy = 0;
+
+        int64_t n = (g->floorOffset - (g->y + R)/S) / 5;
+        if (n > g->score) {
+            g->score = n;
+        }
+
+        if (++g->idleCount >= 5) {
+          g->isIdleVariant = !g->isIdleVariant;
+          g->idleCount = 0;
+        }
+
+        if (K->isPressing[INPUT_JUMP]) {
+          g->jump = abs(g->vx)/4+7;
+          g->vy = -g->jump/2-12;
+          g->isStanding = true;
+          if (!g->hasStarted) {
+              g->hasStarted = true;
+              g->scrollSpeed = 200;
+          }
+        }
+    }
+
+    int accelx = (g->isStanding ? 3 : 2);
+    switch (K->horizDirection) {
+        case LR_LEFT:
+            g->vx = max(g->vx - accelx, -32);
+            g->isFacingRight = false;
+            break;
+        case LR_RIGHT:
+            g->vx = min(g->vx + accelx, 32);
+            g->isFacingRight = true;
+            break;
+        case LR_NEUTRAL:
+            if (g->isStanding) {
+                if      (g->vx < -2) g->vx += 3;
+                else if (g->vx >  2) g->vx -= 3;
+                else                 g->vx = 0;
+            }
+            break;
+    }
+
+    if (!g->isStanding) {
+        if (g->jump > 0) {
+            g->vy   = -g->jump/2 - 12;
+            g->jump = (K->isPressing[INPUT_JUMP] ? g->jump-1 : 0);
+        } else {
+            g->vy = min(g->vy + 2, 16);
+            g->jump = 0;
+        }
+    }
+
+    // Now we scroll the screen.
+    // This must be after we know the x and y.
+    if (g->hasStarted) {
+        g->scrollSpeed = min(MAX_SCROLL_SPEED, g->scrollSpeed + 1);
+        g->scrollCount += g->scrollSpeed;
+    }
+
+    while (g->scrollCount > SCROLL_THRESHOLD) {
+        g->scrollCount -= SCROLL_THRESHOLD;
+        scroll(g);
+    }
+
+    // Force scroll if too close to the top. But only if we are in the air, to
+    // avoid big jumps in the scroll due to collideWithFloor. (For softscroll
+    // mode, we do this in the rendering loop)
+    if (!g->isSoftScroll && !g->isStanding) {
+        while (g->y < topLimit) {
+            scroll(g);
+        }
+    }
+
+    if (g->y + g->forcedScroll >= botLimit) {
+        return true;
+    }
+
+    return false;
+}
+
+// FNV-1a hash of the game state, including the RNG. We use this to check that
+// a replay reproduced the original game exactly.
+uint64_t game_checksum(const Game *g)
+{
+    int64_t fields[] = {
+        g->score,
+        g->x, g->y, g->vx, g->vy, g->jump,
+        g->isStanding, g->isFacingRight, g->isIdleVariant, g->idleCount,
+        g->hasStarted, g->floorOffset, g->forcedScroll, g->scrollCount, g->scrollSpeed,
+        g->fpos, g->next_floor,
+        (int64_t) g->rng.state, (int64_t) g->rng.seq,
+    };
+
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < sizeof(fields)/sizeof(fields[0]); i++) {
+        h = (h ^ (uint64_t) fields[i]) * 0x100000001b3ULL;
+    }
+    for (int i = 0; i < NFLOORS; i++) {
+        h = (h ^ (uint64_t) g->floors[i].left)  * 0x100000001b3ULL;
+        h = (h ^ (uint64_t) g->floors[i].right) * 0x100000001b3ULL;
+    }
+    if (g->floorGenerator != FLOORGEN_CLASSIC) {
+        h = (h ^ (uint64_t) g->floorGenerator) * 0x100000001b3ULL;
+        h = (h ^ g->floorSeed) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// In soft scroll mode the screen keeps scrolling in between simulation frames.
+// This predicts where the hero should be drawn, dt milliseconds after the last
+// simulation frame. If the hero got too close to the top of the screen, we also
+// compute how much we must increase the forcedScroll (see applyForcedScroll).
+// Returns the interpolated scroll, in pixels.
+// Predict current hero position (without scroll)
+static int predictHero(const Game *g, int dt, int *phx, int *phy)
+{
+    int hx = g->x + (g->vx/2)*dt/GAME_SPEED;
+    if (hx < leftLimit) { hx = leftLimit; }
+    if (hx > rightLimit) { hx = rightLimit; }
+    int hy = g->y + (g->vy)*dt/GAME_SPEED;
+    int stand = isStanding(g, hx, hy);
+    if (stand) { hy = collideWithFloor(hy); }
+    *phx = hx;
+    *phy = hy;
+    return stand;
+}
+
+int interpolateHero(const Game *g, int dt, int *sx, int *sy, int *bump)
+{
+    int hx, hy;
+    int stand = predictHero(g, dt, &hx, &hy);
+
+    // Predict current hero position (with scroll)
+    int c = g->scrollCount + dt*g->scrollSpeed/GAME_SPEED;
+    *sx = hx;
+    *sy = hy + g->forcedScroll + S*c/SCROLL_THRESHOLD;
+    *bump = 0;
+    if (!stand && *sy < topLimit) {
+        *bump = topLimit - *sy;
+        *sy = topLimit;
+    }
+
+    return *sy - hy;
+}
+
+// Same as interpolateHero, but dt and the outputs are fixed-point numbers with
+// INTERP_ONE units per millisecond or per pixel. This makes the motion smoother
+// on high refresh rate displays, where several frames fit in one millisecond
+// of game time or in one pixel of movement. Whether the hero is standing and
+// the forced scroll (which affects the simulation, and goes in the replays)
+// are still computed from whole milliseconds, exactly like interpolateHero.
+int interpolateHeroFine(const Game *g, int dt, int *sx, int *sy, int *bump)
+{
+    const int one = INTERP_ONE;
+
+    int ihx, ihy;
+    int stand = predictHero(g, dt / one, &ihx, &ihy);
+
+    // The forced scroll, the same way as interpolateHero
+    int ic = g->scrollCount + (dt / one)*g->scrollSpeed/GAME_SPEED;
+    int isy = ihy + g->forcedScroll + S*ic/SCROLL_THRESHOLD;
+    *bump = (!stand && isy < topLimit ? topLimit - isy : 0);
+
+    int64_t hx = (int64_t) g->x*one + (int64_t) (g->vx/2)*dt/GAME_SPEED;
+    if (hx < leftLimit*one) { hx = leftLimit*one; }
+    if (hx > rightLimit*one) { hx = rightLimit*one; }
+    int64_t hy = (int64_t) g->y*one + (int64_t) (g->vy)*dt/GAME_SPEED;
+    if (stand) { hy = (int64_t) ihy*one; }
+
+    int64_t c = (int64_t) g->scrollCount*one + (int64_t) dt*g->scrollSpeed/GAME_SPEED;
+    int64_t y = hy + (int64_t) g->forcedScroll*one + S*c/SCROLL_THRESHOLD;
+    if (!stand && y < topLimit*one) {
+        y = topLimit*one;
+    }
+
+    *sx = hx;
+    *sy = y;
+    return y - hy;
+}
+
+// Must be called after drawing the floors, otherwise it messes up the
+// floorOffset that the renderer is using.
+void applyForcedScroll(Game *g, int bump)
+{
+    if (bump > 0) {
+        g->forcedScroll += bump;
+        g->scrollCount = 0;
+    }
+    while (g->forcedScroll >= S) {
+        scroll(g);
+    }
+}
+
+//
+// Snapshots
+// ---------
+
+static uint8_t *put_u32(uint8_t *p, uint32_t x)
+{
+    for (int i = 0; i < 4; i++) { *p++ = (x >> (8*i)) & 0xff; }
+    return p;
+}
+
+static uint8_t *put_u64(uint8_t *p, uint64_t x)
+{
+    for (int i = 0; i < 8; i++) { *p++ = (x >> (8*i)) & 0xff; }
+    return p;
+}
+
+static const uint8_t *get_u32(const uint8_t *p, uint32_t *x)
+{
+    *x = 0;
+    for (int i = 0; i < 4; i++) { *x |= ((uint32_t) *p++) << (8*i); }
+    return p;
+}
+
+static const uint8_t *get_u64(const uint8_t *p, uint64_t *x)
+{
+    *x = 0;
+    for (int i = 0; i < 8; i++) { *x |= ((uint64_t) *p++) << (8*i); }
+    return p;
+}
+
+// The int fields, in the order that they are stored in the snapshot. For the
+// two floor numbers, this is only the low half.
+#define GAME_INT_FIELDS(X) \
+    X(x) X(y) X(vx) X(vy) X(jump) \
+    X(isStanding) X(isFacingRight) X(isIdleVariant) X(idleCount) \
+    X(hasStarted) X(floorOffset) X(forcedScroll) X(scrollCount) X(scrollSpeed) \
+    X(fpos) X(next_floor)
+
+void game_save(const Game *g, uint8_t *buf)
+{
+    uint8_t *p = buf;
+
+    *p++ = g->isSoftScroll;
+    *p++ = g->input.horizDirection;
+    for (int i = 0; i <= INPUT_OTHER; i++) {
+        *p++ = g->input.isPressing[i];
+    }
+
+    p = put_u64(p, g->rng.state);
+    p = put_u64(p, g->rng.seq);
+    p = put_u64(p, g->score);
+
+#define PUT_INT(f) p = put_u32(p, (uint32_t) g->f);
+    GAME_INT_FIELDS(PUT_INT)
+#undef PUT_INT
+    for (int i = 0; i < NFLOORS; i++) {
+        p = put_u32(p, g->floors[i].left);
+        p = put_u32(p, g->floors[i].right);
+    }
+
+    *p++ = g->floorGenerator;
+    p = put_u64(p, g->floorSeed);
+
+    p = put_u32(p, (uint64_t) g->floorOffset >> 32);
+    p = put_u32(p, (uint64_t) g->next_floor >> 32);
+
+    assert(p - buf == GAME_SNAPSHOT_SIZE);
+}
+
+// The size tells which version of the snapshot this is
+void game_load(Game *g, const uint8_t *buf, size_t size)
+{
+    const uint8_t *p = buf;
+
+    g->isSoftScroll = *p++;
+    g->input.horizDirection = *p++;
+    for (int i = 0; i <= INPUT_OTHER; i++) {
+        g->input.isPressing[i] = *p++;
+    }
+
+    uint64_t score;
+    p = get_u64(p, &g->rng.state);
+    p = get_u64(p, &g->rng.seq);
+    p = get_u64(p, &score);
+    g->score = score;
+
+#define GET_INT(f) { uint32_t x; p = get_u32(p, &x); g->f = (int32_t) x; }
+    GAME_INT_FIELDS(GET_INT)
+#undef GET_INT
+    for (int i = 0; i < NFLOORS; i++) {
+        uint32_t l, r;
+        p = get_u32(p, &l);
+        p = get_u32(p, &r);
+        g->floors[i].left  = l;
+        g->floors[i].right = r;
+    }
+
+    if (size >= GAME_SNAPSHOT_SIZE_V3) {
+        g->floorGenerator = *p++;
+        p = get_u64(p, &g->floorSeed);
+    } else {
+        g->floorGenerator = FLOORGEN_CLASSIC;
+        g->floorSeed = 0;
+    }
+
+    if (size >= GAME_SNAPSHOT_SIZE) {
+        uint32_t hi;
+        p = get_u32(p, &hi);
+        g->floorOffset = (int64_t) ((uint64_t) hi << 32 | (uint32_t) g->floorOffset);
+        p = get_u32(p, &hi);
+        g->next_floor = (int64_t) ((uint64_t) hi << 32 | (uint32_t) g->next_floor);
+    }
+
+    assert((size_t) (p - buf) == size);
+}
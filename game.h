@@ -0,0 +1,173 @@
+// Copyright 1997-1999 Tatsuya Kudoh
+// Copyright 1997-1999 Masato Taruishi
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef XJUMP_GAME_H
+#define XJUMP_GAME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The simulation does not depend on SDL. All of its state lives inside a Game
+// struct, so that several games can be simulated at the same time, in
+// different threads, without any shared mutable state.
+
+#define S 16  /* Size of a sprite tile, in pixels */
+#define R 32  /* Size of the player sprite, in pixels */
+
+#define FIELD_W 32 /* Width of playing field, in tiles */
+#define FIELD_H 24 /* Height of playing field, in tiles */
+#define FIELD_EXTRA 3 /* Number of extra rows that we have to draw, to support scrolling */
+
+#define NFLOORS 64    /* Number of floors held in memory */
+
+#define GAME_SPEED 25 /* (40 FPS) Time per simulation frame, in milliseconds */
+#define MAX_SCROLL_SPEED 5000  /* scrollCount increment per frame, at max speed */
+#define SCROLL_THRESHOLD 20000 /* scrollCount that triggers a frame change */
+
+static const int leftLimit = S;                  // x coordinate that collides with left
+static const int rightLimit = (FIELD_W-1)*S - R; // x coordinate that collides with right
+static const int topLimit = 5*S;        // y coordinate that triggers a forced scroll
+static const int botLimit = FIELD_H*S;  // y coordinate that triggers a game over
+
+//
+// Random Number Generator
+// -----------------------
+
+typedef struct {
+    uint64_t state; // Mutable state of the RNG
+    uint64_t seq;   // PCG "sequence" parameter
+} Pcg32;
+
+void pcg32_init(Pcg32 *rng, const int64_t seed[2]);
+uint32_t pcg32_next(Pcg32 *rng);
+void pcg32_advance(Pcg32 *rng, uint64_t delta);
+uint32_t pcg32_bounded(Pcg32 *rng, uint32_t n);
+uint32_t rnd(Pcg32 *rng, uint32_t a, uint32_t b);
+
+//
+// Joystick state
+// --------------
+
+typedef enum {
+    LR_NEUTRAL,
+    LR_LEFT,
+    LR_RIGHT
+} LeftRight;
+
+typedef enum {
+    INPUT_JUMP,
+    INPUT_LEFT,
+    INPUT_RIGHT,
+    INPUT_OTHER,
+} Input;
+
+typedef struct {
+    LeftRight horizDirection;
+    bool isPressing[INPUT_OTHER+1];
+} Joystick;
+
+void input_init(Joystick *K);
+void input_press(Joystick *K, Input input);
+void input_release(Joystick *K, Input input);
+void input_set(Joystick *K, LeftRight dir, bool jump);
+int input_encode(const Joystick *K);
+void input_decode(Joystick *K, int sym);
+
+//
+// Game Logic
+// ----------
+
+typedef struct {
+    int left;
+    int right;
+} Floor;
+
+// The classic generator is sequential: each floor depends on the RNG stream
+// and on the position of the previous floor. The counter-based generator
+// computes each floor from the floor seed and the floor number alone, so any
+// part of the tower can be computed without generating the floors below it.
+typedef enum {
+    FLOORGEN_CLASSIC,
+    FLOORGEN_COUNTER,
+} FloorGenerator;
+
+typedef struct {
+
+    // Configuration
+    bool isSoftScroll;
+    FloorGenerator floorGenerator;
+
+    Pcg32 rng;
+    Joystick input;
+
+    int64_t score;
+
+    // Physics
+    int x, y;   // Top-left of the hero sprite, relative to top-left of screen.
+    int vx, vy; // Speed. vy is in pixels per frame but vx is in half-pixels.
+    int jump;   // Lowers the gravity during the rising arc of jump, if JUMP button is held.
+
+    // Animations
+    int isStanding;
+    int isFacingRight;
+    int isIdleVariant;
+    int idleCount;
+
+    // Scrolling. The floor numbers are 64-bit because bots can play for long
+    // enough to climb past INT_MAX rows.
+    int hasStarted;   // Don't start scrolling until we jump for the first time
+    int64_t floorOffset;  // Tile height of the row at the top of the screen
+    int forcedScroll; // Additional scroll distance in pixels. Happens when you get close to the top.
+    int scrollCount;
+    int scrollSpeed;
+
+    // Floors
+    uint64_t floorSeed; // (Only for the counter-based generator)
+    int fpos;
+    int64_t next_floor;
+    Floor floors[NFLOORS];
+} Game;
+
+void init_game(Game *g);
+const Floor *get_floor(const Game *g, int64_t n);
+void generate_floor(Game *g);
+Floor compute_floor(const Game *g, int64_t n);
+void scroll(Game *g);
+bool isStanding(const Game *g, int hx, int hy);
+int collideWithFloor(int hy);
+bool updateGame(Game *g);
+int interpolateHero(const Game *g, int dt, int *sx, int *sy, int *bump);
+#define INTERP_ONE 256  /* Fixed-point scale of interpolateHeroFine */
+int interpolateHeroFine(const Game *g, int dt, int *sx, int *sy, int *bump);
+void applyForcedScroll(Game *g, int bump);
+uint64_t game_checksum(const Game *g);
+
+// Snapshots are a portable serialization of the full Game, including the RNG,
+// the input and the floor buffer. (6 flags, 3 x int64 and 144 x int32). The
+// floor generator fields were added later, at the end. Older snapshots don't
+// have them and can only be used with the classic generator. Later still, the
+// floor numbers became 64-bit; their high halves are at the very end, and are
+// taken to be the sign extension of the low halves in older snapshots.
+#define GAME_SNAPSHOT_SIZE_V2 (6 + 3*8 + (16 + 2*NFLOORS)*4)
+#define GAME_SNAPSHOT_SIZE_V3 (GAME_SNAPSHOT_SIZE_V2 + 1 + 8)
+#define GAME_SNAPSHOT_SIZE (GAME_SNAPSHOT_SIZE_V3 + 2*4)
+
+void game_save(const Game *g, uint8_t *buf);
+void game_load(Game *g, const uint8_t *buf, size_t size);
+
+#endif
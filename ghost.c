@@ -0,0 +1,75 @@
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#include "ghost.h"
+
+bool ghost_open(Ghost *gh, const char *path)
+{
+    if (!replay_open(&gh->reader, path)) return false;
+    ghost_restart(gh);
+    return true;
+}
+
+// Goes back to the start of the run, for a new race
+void ghost_restart(Ghost *gh)
+{
+    replay_rewind(&gh->reader);
+    replay_start(&gh->reader, &gh->game);
+    gh->isRunning = true;
+}
+
+// Runs the ghost's next frame, along with a frame of the live game
+void ghost_tick(Ghost *gh)
+{
+    if (!gh->isRunning) return;
+    if (!replay_feed(&gh->reader, &gh->game) || updateGame(&gh->game)) {
+        gh->isRunning = false;
+    }
+}
+
+// Where to draw the ghost in a field that shows the game g, in the same
+// fixed-point coordinates as interpolateHeroFine. The dt and interpScroll are
+// the ones of the field. Floor n is at the same height in both towers, so we
+// move the ghost by the difference between the scroll positions of the games.
+void ghost_locate(const Ghost *gh, const Game *g, int dt, int interpScroll, int *sx, int *sy)
+{
+    // Like the hero, the ghost is not interpolated in hard scroll mode
+    int x, y, ghostScroll;
+    if (gh->game.isSoftScroll) {
+        int bump;
+        ghostScroll = interpolateHeroFine(&gh->game, dt, &x, &y, &bump);
+    } else {
+        x = gh->game.x * INTERP_ONE;
+        y = gh->game.y * INTERP_ONE;
+        ghostScroll = 0;
+    }
+    int64_t rows = (int64_t) g->floorOffset - gh->game.floorOffset;
+    int64_t fy = (int64_t) y - ghostScroll + rows * S * INTERP_ONE + interpScroll;
+
+    // Far away ghosts are off screen anyway; don't let them overflow
+    const int64_t limit = (int64_t) 4 * FIELD_H * S * INTERP_ONE;
+    if (fy < -limit) fy = -limit;
+    if (fy > limit) fy = limit;
+
+    *sx = x;
+    *sy = fy;
+}
+
+void ghost_close(Ghost *gh)
+{
+    replay_close(&gh->reader);
+    gh->isRunning = false;
+}
@@ -0,0 +1,51 @@
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#ifndef XJUMP_GHOST_H
+#define XJUMP_GHOST_H
+
+#include <stdbool.h>
+
+#include "game.h"
+#include "replay.h"
+
+//
+// Ghosts
+// ------
+//
+// A ghost is a replay that plays along with the live game, so that the player
+// can race against an earlier run. Each ghost has a game of its own, which is
+// simulated in lockstep with the live one, one frame per frame, from the
+// replay stream. Nothing is precomputed, so the memory doesn't depend on the
+// length of the run, and reading the replay doesn't touch the disk: the file
+// is mapped and checked when it is opened.
+//
+// The ghost's tower doesn't have to be the same as the player's. The ghost is
+// drawn at the same height above the ground as it is in its own game.
+
+typedef struct {
+    ReplayReader reader;
+    Game game;
+    bool isRunning;     // Still climbing; ghosts disappear when they die
+} Ghost;
+
+bool ghost_open(Ghost *gh, const char *path);
+void ghost_restart(Ghost *gh);
+void ghost_tick(Ghost *gh);
+void ghost_locate(const Ghost *gh, const Game *g, int dt, int interpScroll, int *sx, int *sy);
+void ghost_close(Ghost *gh);
+
+#endif
@@ -0,0 +1,451 @@
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "leaderboard.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "config.h"
+
+typedef struct {
+    uint64_t id;
+    ScoreRecord rec;
+    char *replayPath;   // Or NULL
+} Run;
+
+static char *host;
+static char *port;
+static char *path;
+static void (*notifyFn)(void);
+
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static bool isRunning;
+static bool quit;
+
+static Run queue[LEADERBOARD_QUEUE_SIZE]; // Ring buffer
+static int qhead;
+static int qlen;
+static uint64_t nextId;
+
+static bool hasResult;
+static ScoreSummary result;
+
+//
+// Request body
+// ------------
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+} Buffer;
+
+static bool buf_reserve(Buffer *b, size_t n)
+{
+    if (b->len + n <= b->capacity) return true;
+    size_t capacity = (b->capacity ? b->capacity : 1024);
+    while (capacity < b->len + n) capacity *= 2;
+    char *data = realloc(b->data, capacity);
+    if (!data) return false;
+    b->data = data;
+    b->capacity = capacity;
+    return true;
+}
+
+static bool buf_printf(Buffer *b, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0 || !buf_reserve(b, n+1)) return false;
+    va_start(ap, fmt);
+    vsnprintf(b->data + b->len, n+1, fmt, ap);
+    va_end(ap);
+    b->len += n;
+    return true;
+}
+
+static bool buf_base64(Buffer *b, const uint8_t *src, size_t n)
+{
+    static const char digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    if (!buf_reserve(b, (n + 2) / 3 * 4)) return false;
+    char *out = b->data + b->len;
+    for (size_t i = 0; i < n; i += 3) {
+        uint32_t x = (uint32_t) src[i] << 16;
+        if (i+1 < n) x |= (uint32_t) src[i+1] << 8;
+        if (i+2 < n) x |= (uint32_t) src[i+2];
+        *out++ = digits[(x >> 18) & 63];
+        *out++ = digits[(x >> 12) & 63];
+        *out++ = (i+1 < n ? digits[(x >> 6) & 63] : '=');
+        *out++ = (i+2 < n ? digits[x & 63] : '=');
+    }
+    b->len = out - b->data;
+    return true;
+}
+
+// Appends the replay to the body. It was written by the main thread when the
+// game ended, but reading it is our job.
+static bool add_replay(Buffer *b, const char *replayPath)
+{
+    FILE *f = fopen(replayPath, "rb");
+    if (!f) return true; // Send the run without it
+
+    bool ok = true;
+    uint8_t *data = malloc(LEADERBOARD_MAX_REPLAY);
+    size_t n = (data ? fread(data, 1, LEADERBOARD_MAX_REPLAY, f) : 0);
+    if (data && !ferror(f) && n < LEADERBOARD_MAX_REPLAY && n > 0) {
+        ok = buf_printf(b, " ") && buf_base64(b, data, n);
+    }
+    free(data);
+    fclose(f);
+    return ok;
+}
+
+static bool build_body(Buffer *b, const Run *runs, int n)
+{
+    for (int i = 0; i < n; i++) {
+        const ScoreRecord *r = &runs[i].rec;
+        if (!buf_printf(b, "run %" PRId64 " %" PRId64 " %" PRId64 " %" PRId64 " %" PRIu64 " %u %s",
+                        r->score, r->time, r->seed[0], r->seed[1], r->ticks, r->flags,
+                        (r->theme[0] ? r->theme : "-"))) return false;
+        if (runs[i].replayPath && !add_replay(b, runs[i].replayPath)) return false;
+        if (!buf_printf(b, "\n")) return false;
+    }
+    return true;
+}
+
+//
+// HTTP
+// ----
+//
+// Just enough of HTTP/1.1 to talk to our own server: we send a request with
+// a Content-Length and expect a response with a Content-Length. Anything else
+// is treated as an error and we reconnect.
+
+static int sock = -1;
+
+static void disconnect()
+{
+    if (sock >= 0) {
+        close(sock);
+        sock = -1;
+    }
+}
+
+static bool connect_server()
+{
+    struct addrinfo hints = { 0 };
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *addrs;
+    int err = getaddrinfo(host, port, &hints, &addrs);
+    if (err != 0) {
+        fprintf(stderr, "Leaderboard: could not resolve %s. %s\n", host, gai_strerror(err));
+        return false;
+    }
+
+    for (struct addrinfo *a = addrs; a != NULL; a = a->ai_next) {
+        sock = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (sock < 0) continue;
+
+        struct timeval tv = { LEADERBOARD_TIMEOUT, 0 };
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        if (0 == connect(sock, a->ai_addr, a->ai_addrlen)) break;
+        disconnect();
+    }
+    freeaddrinfo(addrs);
+
+    if (sock < 0) {
+        fprintf(stderr, "Leaderboard: could not connect to %s:%s\n", host, port);
+        return false;
+    }
+    return true;
+}
+
+static bool send_all(const char *data, size_t n)
+{
+    while (n > 0) {
+        ssize_t k = send(sock, data, n, MSG_NOSIGNAL);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return false;
+        data += k;
+        n -= k;
+    }
+    return true;
+}
+
+// Reads the response into the buffer. Returns the start of the body, or NULL.
+static char *receive_response(Buffer *b, int *status, bool *keepAlive)
+{
+    b->len = 0;
+    size_t body = 0; // Offset, because the buffer can move
+    size_t contentLength = 0;
+
+    while (1) {
+        if (!buf_reserve(b, 4096 + 1)) return NULL;
+        ssize_t k = recv(sock, b->data + b->len, 4096, 0);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return NULL;
+        b->len += k;
+        b->data[b->len] = '\0';
+
+        if (!body) {
+            char *end = strstr(b->data, "\r\n\r\n");
+            if (!end) continue;
+            *end = '\0';
+            body = end + 4 - b->data;
+
+            if (1 != sscanf(b->data, "HTTP/1.%*d %d", status)) return NULL;
+            char *cl = strstr(b->data, "\nContent-Length:");
+            if (!cl) cl = strstr(b->data, "\ncontent-length:");
+            if (!cl) return NULL;
+            contentLength = strtoul(cl + 16, NULL, 10);
+            *keepAlive = !strstr(b->data, "\nConnection: close") &&
+                         !strstr(b->data, "\nconnection: close");
+        }
+
+        if (b->len - body >= contentLength) {
+            b->data[body + contentLength] = '\0';
+            return b->data + body;
+        }
+    }
+}
+
+static bool post(const Buffer *req, ScoreSummary *out)
+{
+    if (sock < 0 && !connect_server()) return false;
+
+    char header[512];
+    int n = snprintf(header, sizeof(header),
+                     "POST %s HTTP/1.1\r\n"
+                     "Host: %s\r\n"
+                     "User-Agent: xjump/" XJUMP_VERSION "\r\n"
+                     "Content-Type: text/plain\r\n"
+                     "Content-Length: %zu\r\n"
+                     "\r\n",
+                     path, host, req->len);
+    if (n < 0 || (size_t) n >= sizeof(header)) return false;
+
+    Buffer resp = { 0 };
+    bool ok = false;
+    int status = 0;
+    bool keepAlive = false;
+
+    if (send_all(header, n) && send_all(req->data, req->len)) {
+        char *body = receive_response(&resp, &status, &keepAlive);
+        if (body && status == 200) {
+            long best = 0, today = 0, expiration = 0;
+            if (3 == sscanf(body, "best %ld\ntoday %ld %ld", &best, &today, &expiration)) {
+                out->best = best;
+                out->today = today;
+                out->expiration = expiration;
+                ok = true;
+            } else {
+                fprintf(stderr, "Leaderboard: could not understand the response\n");
+            }
+        } else if (body) {
+            fprintf(stderr, "Leaderboard: server returned status %d\n", status);
+        }
+    }
+
+    if (!ok || !keepAlive) disconnect();
+    free(resp.data);
+    return ok;
+}
+
+//
+// Worker thread
+// -------------
+
+static void free_runs(Run *runs, int n)
+{
+    for (int i = 0; i < n; i++) {
+        free(runs[i].replayPath);
+    }
+}
+
+// Must be called with the lock
+static void pop_front()
+{
+    free(queue[qhead].replayPath);
+    queue[qhead].replayPath = NULL;
+    qhead = (qhead + 1) % LEADERBOARD_QUEUE_SIZE;
+    qlen--;
+}
+
+static void *worker(void *unused)
+{
+    (void) unused;
+    int backoff = 0; // Seconds
+
+    pthread_mutex_lock(&lock);
+    while (1) {
+        while (qlen == 0 && !quit) {
+            pthread_cond_wait(&cond, &lock);
+        }
+        if (quit) break;
+
+        // Copy the batch, but leave it in the queue until it has been sent
+        Run batch[LEADERBOARD_BATCH_SIZE];
+        int n = (qlen < LEADERBOARD_BATCH_SIZE ? qlen : LEADERBOARD_BATCH_SIZE);
+        for (int i = 0; i < n; i++) {
+            batch[i] = queue[(qhead + i) % LEADERBOARD_QUEUE_SIZE];
+            if (batch[i].replayPath) batch[i].replayPath = strdup(batch[i].replayPath);
+        }
+        pthread_mutex_unlock(&lock);
+
+        Buffer req = { 0 };
+        ScoreSummary summary;
+        bool ok = build_body(&req, batch, n) && post(&req, &summary);
+        free(req.data);
+        free_runs(batch, n);
+
+        pthread_mutex_lock(&lock);
+        if (ok) {
+            // The main thread may have dropped some of them in the meantime,
+            // if the queue got full, so we go by the ids.
+            uint64_t lastSent = batch[n-1].id;
+            while (qlen > 0 && queue[qhead].id <= lastSent) {
+                pop_front();
+            }
+            hasResult = true;
+            result = summary;
+            backoff = 0;
+            if (notifyFn) notifyFn();
+        } else {
+            // Exponential backoff, from one second to five minutes
+            backoff = (backoff == 0 ? 1 : backoff < 300/2 ? 2*backoff : 300);
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += backoff;
+            while (!quit) {
+                if (ETIMEDOUT == pthread_cond_timedwait(&cond, &lock, &deadline)) break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    disconnect();
+    return NULL;
+}
+
+//
+// Public interface
+// ----------------
+
+// Only plain http:// URLs are supported. The server is expected to be on the
+// local network; anything that needs TLS can go through a reverse proxy.
+static bool parse_url(const char *url)
+{
+    const char *prefix = "http://";
+    if (0 != strncmp(url, prefix, strlen(prefix))) return false;
+    const char *h = url + strlen(prefix);
+    const char *p = h + strcspn(h, ":/");
+    const char *s = p + strcspn(p, "/");
+    if (p == h) return false;
+
+    host = strndup(h, p - h);
+    port = (*p == ':' ? strndup(p+1, s - (p+1)) : strdup("80"));
+    path = (*s ? strdup(s) : strdup("/"));
+    return host && port && path && *port;
+}
+
+// The notify function is called from the worker thread when there is a new
+// result for leaderboard_poll.
+bool leaderboard_start(const char *url, void (*notify)(void))
+{
+    if (!parse_url(url)) {
+        fprintf(stderr, "Invalid leaderboard URL '%s'. It should look like http://host[:port]/path\n", url);
+        return false;
+    }
+    notifyFn = notify;
+    if (0 != pthread_create(&thread, NULL, worker, NULL)) {
+        fprintf(stderr, "Could not start leaderboard thread\n");
+        return false;
+    }
+    isRunning = true;
+    return true;
+}
+
+// Queues a run. The replay file, if there is one, must be complete.
+void leaderboard_submit(const ScoreRecord *rec, const char *replayPath)
+{
+    if (!isRunning) return;
+    pthread_mutex_lock(&lock);
+    if (qlen == LEADERBOARD_QUEUE_SIZE) {
+        pop_front();
+    }
+    Run *run = &queue[(qhead + qlen) % LEADERBOARD_QUEUE_SIZE];
+    run->id = nextId++;
+    run->rec = *rec;
+    run->replayPath = (replayPath ? strdup(replayPath) : NULL);
+    qlen++;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+// Returns the global best scores, if they changed since the last call
+bool leaderboard_poll(ScoreSummary *out)
+{
+    if (!isRunning) return false;
+    pthread_mutex_lock(&lock);
+    bool has = hasResult;
+    if (has) {
+        *out = result;
+        hasResult = false;
+    }
+    pthread_mutex_unlock(&lock);
+    return has;
+}
+
+// Runs that haven't been sent yet are lost. We don't wait for the network
+// when the player wants to quit, but we do wait for the current request, which
+// is bounded by the socket timeouts.
+void leaderboard_stop()
+{
+    if (!isRunning) return;
+    pthread_mutex_lock(&lock);
+    quit = true;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, NULL);
+    isRunning = false;
+
+    free_runs(&queue[0], LEADERBOARD_QUEUE_SIZE);
+    free(host);
+    free(port);
+    free(path);
+}
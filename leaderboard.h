@@ -0,0 +1,55 @@
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef XJUMP_LEADERBOARD_H
+#define XJUMP_LEADERBOARD_H
+
+#include <stdbool.h>
+
+#include "scores.h"
+
+//
+// Leaderboard client
+// ------------------
+//
+// Sends the finished runs to a central leaderboard server, from a background
+// thread. Runs are queued and sent in batches, as the body of an HTTP/1.1
+// POST request over a persistent connection. The body has one line per run,
+// with the fields of the ScoreRecord and, optionally, the replay file in
+// base64:
+//
+//   run SCORE TIME SEED0 SEED1 TICKS FLAGS THEME [REPLAY]
+//
+// The server answers with the global best scores, in the same format as the
+// old highscore file:
+//
+//   best SCORE
+//   today SCORE EXPIRATION
+//
+// If the server can't be reached, we keep the runs and try again later,
+// waiting longer after each failure. If too many runs pile up, the oldest
+// ones are dropped; the local score log still has them.
+
+#define LEADERBOARD_QUEUE_SIZE 64  /* Runs waiting to be sent */
+#define LEADERBOARD_BATCH_SIZE 16  /* Runs per request */
+#define LEADERBOARD_TIMEOUT    10  /* Seconds, for each socket operation */
+#define LEADERBOARD_MAX_REPLAY (4 << 20) /* Larger replays are sent without the replay */
+
+bool leaderboard_start(const char *url, void (*notify)(void));
+void leaderboard_submit(const ScoreRecord *rec, const char *replayPath);
+bool leaderboard_poll(ScoreSummary *out);
+void leaderboard_stop();
+
+#endif
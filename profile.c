@@ -0,0 +1,212 @@
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "profile.h"
+
+static const char *phaseNames[NPHASES] = { "events", "update", "draw", "present" };
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Bucket 0 is for less than 1us. Bucket i is for [2^(i-1), 2^i) us.
+static int bucket(uint32_t ns)
+{
+    uint32_t us = ns / 1000;
+    int b = 0;
+    while (us > 0 && b < PROFILE_NBUCKETS-1) {
+        us >>= 1;
+        b++;
+    }
+    return b;
+}
+
+void profile_init(Profiler *p, bool keepLog)
+{
+    memset(p, 0, sizeof(*p));
+    p->enabled = true;
+    p->keepLog = keepLog;
+    p->start = now_ns(); // F3 turns the profiler on in the middle of a frame
+}
+
+// Called at the start of each iteration of the main loop
+void profile_start(Profiler *p)
+{
+    if (!p->enabled) return;
+    memset(&p->cur, 0, sizeof(p->cur));
+    p->start = now_ns();
+}
+
+// Charges the time since the previous mark to the given phase
+void profile_mark(Profiler *p, Phase phase)
+{
+    if (!p->enabled) return;
+    uint64_t t = now_ns();
+    uint64_t ns = p->cur.ns[phase] + (t - p->start);
+    p->cur.ns[phase] = (ns > UINT32_MAX ? UINT32_MAX : ns);
+    p->start = t;
+}
+
+void profile_tick(Profiler *p)
+{
+    if (!p->enabled) return;
+    p->cur.ticks++;
+}
+
+// Ticks skipped by an automatic pause
+void profile_drop(Profiler *p, uint32_t ticks)
+{
+    if (!p->enabled) return;
+    p->cur.dropped += ticks;
+    p->dropped += ticks;
+}
+
+// Ticks skipped to slow the game down after a stall
+void profile_dilate(Profiler *p, uint32_t ticks)
+{
+    if (!p->enabled) return;
+    p->cur.dilated += ticks;
+    p->dilated += ticks;
+}
+
+// Called after a frame is presented
+void profile_frame(Profiler *p)
+{
+    if (!p->enabled) return;
+
+    for (int i = 0; i < NPHASES; i++) {
+        p->hist[i][bucket(p->cur.ns[i])]++;
+    }
+    p->recent[p->nframes % PROFILE_WINDOW] = p->cur;
+    p->nframes++;
+
+    if (p->keepLog) {
+        if (p->nlog == p->capacity) {
+            size_t capacity = (p->capacity ? 2*p->capacity : 4096);
+            FrameSample *log = realloc(p->log, capacity * sizeof(FrameSample));
+            if (!log) {
+                // Not worth crashing the game over
+                p->keepLog = false;
+                return;
+            }
+            p->log = log;
+            p->capacity = capacity;
+        }
+        p->log[p->nlog++] = p->cur;
+    }
+}
+
+// Upper bound of the bucket that contains the given quantile, in ms
+static double hist_quantile(const uint64_t *hist, uint64_t total, double q)
+{
+    uint64_t target = (uint64_t) (q * total);
+    uint64_t count = 0;
+    for (int b = 0; b < PROFILE_NBUCKETS; b++) {
+        count += hist[b];
+        if (count > target) {
+            return (double) (1u << b) / 1000.0;
+        }
+    }
+    return (double) (1u << (PROFILE_NBUCKETS-1)) / 1000.0;
+}
+
+// Formats the text of the overlay: the last frame, the average and the
+// maximum of the recent frames, and the 99th percentile since the start.
+// Returns the number of lines.
+int profile_overlay(const Profiler *p, char lines[PROFILE_NLINES][PROFILE_LINE])
+{
+    size_t n = (p->nframes < PROFILE_WINDOW ? p->nframes : PROFILE_WINDOW);
+    const FrameSample *last = &p->recent[(p->nframes + PROFILE_WINDOW - 1) % PROFILE_WINDOW];
+
+    int k = 0;
+    snprintf(lines[k++], PROFILE_LINE, "%-8s %6s %6s %6s %6s", "ms", "last", "avg", "max", "p99");
+
+    for (int i = 0; i < NPHASES; i++) {
+        double sum = 0.0, max = 0.0;
+        for (size_t j = 0; j < n; j++) {
+            double ms = p->recent[j].ns[i] / 1e6;
+            sum += ms;
+            if (ms > max) max = ms;
+        }
+        snprintf(lines[k++], PROFILE_LINE, "%-8s %6.2f %6.2f %6.2f %6.2f",
+                 phaseNames[i],
+                 (n ? last->ns[i] / 1e6 : 0.0),
+                 (n ? sum / n : 0.0),
+                 max,
+                 hist_quantile(p->hist[i], p->nframes, 0.99));
+    }
+
+    double sum = 0.0;
+    uint32_t max = 0;
+    for (size_t j = 0; j < n; j++) {
+        sum += p->recent[j].ticks;
+        if (p->recent[j].ticks > max) max = p->recent[j].ticks;
+    }
+    snprintf(lines[k++], PROFILE_LINE, "%-8s %6u %6.2f %6u",
+             "ticks", (n ? last->ticks : 0), (n ? sum / n : 0.0), max);
+
+    snprintf(lines[k++], PROFILE_LINE, "%-8s dropped %" PRIu64 ", dilated %" PRIu64,
+             "ticks", p->dropped, p->dilated);
+
+    return k;
+}
+
+bool profile_write_csv(const Profiler *p, const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+
+    fprintf(f, "frame");
+    for (int i = 0; i < NPHASES; i++) {
+        fprintf(f, ",%s_ns", phaseNames[i]);
+    }
+    fprintf(f, ",ticks,dropped,dilated\n");
+
+    for (size_t j = 0; j < p->nlog; j++) {
+        const FrameSample *s = &p->log[j];
+        fprintf(f, "%zu", j);
+        for (int i = 0; i < NPHASES; i++) {
+            fprintf(f, ",%u", s->ns[i]);
+        }
+        fprintf(f, ",%u,%u,%u\n", s->ticks, s->dropped, s->dilated);
+    }
+
+    if (0 != fclose(f)) {
+        perror(path);
+        return false;
+    }
+    return true;
+}
+
+void profile_free(Profiler *p)
+{
+    free(p->log);
+    p->log = NULL;
+    p->nlog = p->capacity = 0;
+}
@@ -0,0 +1,87 @@
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef XJUMP_PROFILE_H
+#define XJUMP_PROFILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// Frame timing
+// ------------
+//
+// Measures how long each phase of the main loop takes, to find out where the
+// stutters come from. A frame with several simulation ticks means that the
+// simulation had to catch up, while a long present means that we were blocked
+// waiting for the compositor. When the whole process stalls, the main loop
+// skips part of the missed ticks instead (see --on-stall), and counts them:
+// dilated ticks are game time that was given up to slow the game down, and
+// dropped ticks are the time that an automatic pause swallowed.
+//
+// Everything is updated from the main loop thread, so the histograms are just
+// plain counters and there are no locks in the way. When the profiler is not
+// enabled, every function returns right away.
+
+typedef enum {
+    PHASE_EVENTS,   // Draining the SDL event queue
+    PHASE_UPDATE,   // Simulation ticks (including catch-up)
+    PHASE_DRAW,     // Submitting the draw calls
+    PHASE_PRESENT,  // SDL_RenderPresent, where vsync blocks
+    NPHASES
+} Phase;
+
+#define PROFILE_NBUCKETS 24  /* Power-of-two histogram buckets, from 1us to 8s */
+#define PROFILE_WINDOW   120 /* Number of recent frames shown in the overlay */
+#define PROFILE_LINE     48  /* Size of each line of overlay text */
+#define PROFILE_NLINES   (NPHASES + 3)
+
+typedef struct {
+    uint32_t ns[NPHASES];
+    uint32_t ticks;
+    uint32_t dropped;
+    uint32_t dilated;
+} FrameSample;
+
+typedef struct {
+    bool enabled;
+    bool keepLog;       // Keep every frame, for the CSV dump
+    uint64_t start;     // Start time of the current phase
+    FrameSample cur;
+
+    uint64_t nframes;
+    uint64_t dropped;   // Totals since the start
+    uint64_t dilated;
+    uint64_t hist[NPHASES][PROFILE_NBUCKETS];
+    FrameSample recent[PROFILE_WINDOW];
+
+    FrameSample *log;
+    size_t nlog;
+    size_t capacity;
+} Profiler;
+
+void profile_init(Profiler *p, bool keepLog);
+void profile_start(Profiler *p);
+void profile_mark(Profiler *p, Phase phase);
+void profile_tick(Profiler *p);
+void profile_drop(Profiler *p, uint32_t ticks);
+void profile_dilate(Profiler *p, uint32_t ticks);
+void profile_frame(Profiler *p);
+int profile_overlay(const Profiler *p, char lines[PROFILE_NLINES][PROFILE_LINE]);
+bool profile_write_csv(const Profiler *p, const char *path);
+void profile_free(Profiler *p);
+
+#endif
@@ -0,0 +1,1549 @@
+// Copyright 1997-1999 Tatsuya Kudoh
+// Copyright 1997-1999 Masato Taruishi
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "assets.h"
+#include "config.h"
+#include "render.h"
+
+//
+// Colors
+//
+
+static const SDL_Color backgroundColor  = {   0,   0,   0, 255 };
+static const SDL_Color textColor        = { 255, 255, 255, 255 };
+static const SDL_Color copyrightColor   = {   0, 255,   0, 255 };
+static const SDL_Color boxBorderColor   = {   0,   0, 128, 255 };
+static const SDL_Color boxColor         = {   0,   0, 255, 255 };
+static const SDL_Color scoreBorderColor = { 255, 255, 255, 255 };
+
+static const Uint8 ghostAlpha = 96;   // Opacity of the ghost heroes
+
+//
+// Text rendering
+// --------------
+//
+// To preserve the classic Xjump look, we ship with a copies of the fonts that
+// the original used. On Fedora you needed package xorg-x11-fonts-100dpi.
+//
+//   - Courrier Bold Oblique 18pt, 100dpi variant (courBO18)
+//   - FixedMedim 10x20
+//
+// To accurately emulate the classic Xjump look we need to use bitmapped fonts.
+// I experimented with using the SDL_TTF library to render the text but the
+// True Type fonts only looked nice if we used antialiasing and that doesn't
+// match the look that we want... Not to mention that the fonts are not the
+// same as the original and that locating system fonts on Linux is a pain.
+// The big downside of bitmapped fonts is that they can't represent special
+// characters. We are effectively restricted to ACII.
+//
+// On the matter of font dimensions, both of our fonts are monospaced, where
+// the text is arranged in a rectangular grid. However, one subtlety is that in
+// the oblique font each letter might reach into the text box for the glyph to
+// their right. For this reason, the glyphs in the font file might be arranged
+// farther apart than they are in the text.
+
+const FontSize uiFZ = { 15, 28, 20, 28 };
+const FontSize hsFZ = { 10, 20, 10, 20 };
+
+void text_batch_init(TextBatch *b, SDL_Renderer *renderer, SDL_Texture *font, const FontSize *fz, int fontX, int fontY)
+{
+    b->renderer = renderer;
+    b->fz = fz;
+    b->nglyphs = 0;
+    text_batch_set_texture(b, font, 1);
+
+    // The glyphs are in a grid of 16 columns
+    for (int c = 0; c < TEXT_NGLYPHS; c++) {
+        int oi = c % 16;
+        int oj = c / 16;
+        b->glyphs[c] = (SDL_Rect){ fontX + oi*fz->ow, fontY + oj*fz->oh, fz->ow, fz->oh };
+    }
+}
+
+// For when the font texture is created again, at a different scale
+void text_batch_set_texture(TextBatch *b, SDL_Texture *font, int scale)
+{
+    b->font = font;
+    b->scale = scale;
+    if (0 != SDL_QueryTexture(font, NULL, NULL, &b->texW, &b->texH)) {
+        b->texW = b->texH = 1;
+    }
+}
+
+void text_batch_add(TextBatch *b, const char *message, const SDL_Rect *where, SDL_Color color)
+{
+    int w  = b->fz->w;
+    int ow = b->fz->ow;
+    int oh = b->fz->oh;
+
+    int x = where->x;
+    int y = where->y;
+
+    for (int i = 0; message[i] != '\0'; i++) {
+        if (b->nglyphs == TEXT_BATCH_SIZE) text_batch_flush(b);
+
+        char c = message[i];
+        if (c < ' ' || '~' < c) { c = 127; } // Default glyph
+        int k = b->nglyphs++;
+        b->src[k] = b->glyphs[c - ' '];
+        b->dst[k] = (SDL_Rect){ x + i*w, y, ow, oh };
+        b->color[k] = color;
+    }
+}
+
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+
+void text_batch_flush(TextBatch *b)
+{
+    static SDL_Vertex vertices[4*TEXT_BATCH_SIZE];
+    static int indices[6*TEXT_BATCH_SIZE];
+
+    int n = b->nglyphs;
+    if (n == 0) return;
+
+    const float tw = (float) b->texW / b->scale;
+    const float th = (float) b->texH / b->scale;
+    for (int k = 0; k < n; k++) {
+        const SDL_Rect *src = &b->src[k];
+        const SDL_Rect *dst = &b->dst[k];
+        float x0 = dst->x, x1 = dst->x + dst->w;
+        float y0 = dst->y, y1 = dst->y + dst->h;
+        float u0 = src->x / tw, u1 = (src->x + src->w) / tw;
+        float v0 = src->y / th, v1 = (src->y + src->h) / th;
+
+        SDL_Vertex *v = &vertices[4*k];
+        v[0] = (SDL_Vertex){ { x0, y0 }, b->color[k], { u0, v0 } };
+        v[1] = (SDL_Vertex){ { x1, y0 }, b->color[k], { u1, v0 } };
+        v[2] = (SDL_Vertex){ { x1, y1 }, b->color[k], { u1, v1 } };
+        v[3] = (SDL_Vertex){ { x0, y1 }, b->color[k], { u0, v1 } };
+
+        int *ix = &indices[6*k];
+        ix[0] = 4*k + 0; ix[1] = 4*k + 1; ix[2] = 4*k + 2;
+        ix[3] = 4*k + 0; ix[4] = 4*k + 2; ix[5] = 4*k + 3;
+    }
+
+    // The vertex colors take the place of the texture color mod
+    SDL_RenderGeometry(b->renderer, b->font, vertices, 4*n, indices, 6*n);
+    b->nglyphs = 0;
+}
+
+#else
+
+// Older versions of SDL don't have RenderGeometry. Fall back to one
+// RenderCopy per glyph.
+void text_batch_flush(TextBatch *b)
+{
+    Uint8 r, g, bl;
+    SDL_GetTextureColorMod(b->font, &r, &g, &bl);
+    const int z = b->scale;
+    for (int k = 0; k < b->nglyphs; k++) {
+        SDL_Color c = b->color[k];
+        const SDL_Rect *src = &b->src[k];
+        const SDL_Rect texels = { src->x*z, src->y*z, src->w*z, src->h*z };
+        SDL_SetTextureColorMod(b->font, c.r, c.g, c.b);
+        SDL_RenderCopy(b->renderer, b->font, &texels, &b->dst[k]);
+    }
+    SDL_SetTextureColorMod(b->font, r, g, bl);
+    b->nglyphs = 0;
+}
+
+#endif
+
+// Draws a single line, in the color set by text_set_color
+void text_draw_line(
+        SDL_Renderer *renderer,
+        SDL_Texture *font,
+        const FontSize *fz,
+        const char *message,
+        const SDL_Rect *where)
+{
+    static TextBatch b;
+    text_batch_init(&b, renderer, font, fz, 0, 0);
+
+    SDL_Color color = { 255, 255, 255, 255 };
+    SDL_GetTextureColorMod(font, &color.r, &color.g, &color.b);
+
+    text_batch_add(&b, message, where, color);
+    text_batch_flush(&b);
+}
+
+void text_set_color(SDL_Texture *font, SDL_Color color)
+{
+    // This method of setting colors assumes that the original texture has
+    // white text on a transparent background.
+    SDL_SetTextureColorMod(font, color.r, color.g, color.b);
+}
+
+
+// Boxes around text
+// -------------------------
+
+#define boxBorder 4
+#define boxPadding 4
+
+static void box_rects(const SDL_Rect *content, SDL_Rect *border, SDL_Rect *padding)
+{
+    *padding = (SDL_Rect){
+        content->x - boxPadding,
+        content->y - boxPadding,
+        content->w + 2*boxPadding,
+        content->h + 2*boxPadding,
+    };
+    *border = (SDL_Rect){
+       padding->x - boxBorder,
+       padding->y - boxBorder,
+       padding->w + 2*boxBorder,
+       padding->h + 2*boxBorder,
+    };
+}
+
+void text_draw_box(SDL_Renderer *renderer, const SDL_Rect *content)
+{
+    SDL_Rect border, padding;
+    box_rects(content, &border, &padding);
+
+    SDL_SetRenderDrawColor(renderer, boxBorderColor.r, boxBorderColor.g, boxBorderColor.b, boxBorderColor.a);
+    SDL_RenderFillRect(renderer, &border);
+
+    SDL_SetRenderDrawColor(renderer, boxColor.r, boxColor.g, boxColor.b, boxColor.a);
+    SDL_RenderFillRect(renderer, &padding);
+}
+
+//
+// Window placement
+//
+
+// Parameters
+
+static const int windowMarginTop   = 24;
+static const int windowMarginLeft  = 24;
+static const int windowMarginInner = 24;
+
+static const int windowMarginBottom = windowMarginTop;
+static const int windowMarginRight  = windowMarginLeft;
+
+static char titleBuf[] = "FALLING TOWER ver " XJUMP_VERSION;
+static const char *titleMsg      = titleBuf;
+static const char *scoreLabelMsg = "Floor";
+static const char *copyrightMsg  = "(C) 1997 ROYALPANDA";
+static const char *gameOverMsg   = "Game Over";
+static const char *pauseMsg      = "Pause";
+static const char *highscoreMsg1 = "High Score";
+static const char *highscoreMsg2 = "Today     "; // Please make these two strings have the same length
+
+static const int NscoreDigits = 10;
+
+// Game spritesheet
+
+static const SDL_Rect skySprite   = { 4*R, 0*S, S, S};
+static const SDL_Rect LWallSprite = { 4*R, 1*S, S, S};
+static const SDL_Rect RWallSprite = { 4*R, 2*S, S, S};
+static const SDL_Rect floorSprite = { 4*R, 3*S, S, S};
+static const SDL_Rect heroSprite[8] = {
+    { 0*R, 0*R, R, R}, // Stand L (1/2)
+    { 1*R, 0*R, R, R}, // Stand R (1/2)
+    { 2*R, 0*R, R, R}, // Stand L (2/2)
+    { 3*R, 0*R, R, R}, // Stand R (2/2)
+    { 0*R, 1*R, R, R}, // Jump L
+    { 1*R, 1*R, R, R}, // Jump R
+    { 2*R, 1*R, R, R}, // Fall L
+    { 3*R, 1*R, R, R}, // Fall R
+};
+
+static const int backgroundW = S * FIELD_W;
+
+// Which of the heroSprite goes with the current state of the hero
+static int hero_sprite(const Game *g)
+{
+    int isFlying  = !g->isStanding;
+    int isRight   = g->isFacingRight;
+    int isVariant = (g->isStanding? g->isIdleVariant : (g->vy > 0));
+    return (isFlying&1) << 2 | (isVariant&1) << 1 | (isRight&1) << 0;
+}
+
+static void init_title()
+{
+    // Hide the minor version number from the app title
+    int n = 0;
+    for (char *p = titleBuf; *p != 0; p++) {
+        if (*p == '.') {
+            if (++n == 2) {
+                *p = '\0';
+                break;
+            }
+        }
+    }
+}
+
+// Widths, heights and screen positions. The fields are side by side, each
+// with its own score above it, and the title and the copyright are centered
+// over all of them.
+void screen_layout(Screen *s, int nfields)
+{
+    init_title();
+
+    const int scoreLabelW = uiFZ.w * strlen(scoreLabelMsg);
+    const int gameOverW   = uiFZ.w * strlen(gameOverMsg);
+    const int pauseW      = uiFZ.w * strlen(pauseMsg);
+
+    const int textBoxH = uiFZ.h + boxBorder + 2*boxPadding + boxBorder;
+
+    const int gameW = S * FIELD_W;
+    const int gameH = S * FIELD_H;
+
+    const int scoreDigitsW = uiFZ.w * NscoreDigits;
+    const int scoreW = scoreLabelW + uiFZ.w + scoreDigitsW;
+
+    const int windowW = windowMarginLeft + nfields*gameW + (nfields-1)*windowMarginInner + windowMarginRight;
+    const int windowH = windowMarginTop + 3*windowMarginInner + textBoxH + 2*uiFZ.h + + gameH + windowMarginBottom;
+
+    const int titleY = windowMarginTop + boxBorder + boxPadding;
+    const int scoreY = titleY + uiFZ.h + boxPadding + boxBorder + windowMarginInner;
+    const int gameY  = scoreY + uiFZ.h + windowMarginInner;
+
+    s->windowW = windowW;
+    s->windowH = windowH;
+    s->nfields = nfields;
+
+    for (int i = 0; i < nfields; i++) {
+        Field *f = &s->fields[i];
+
+        const int gameX  = windowMarginLeft + i*(gameW + windowMarginInner);
+        const int scoreX = gameX + (gameW - scoreW)/2;
+
+        f->gameX = gameX;
+        f->gameY = gameY;
+        f->gameW = gameW;
+        f->gameH = gameH;
+
+        const int scoreDigitsX = scoreX + scoreLabelW + uiFZ.w;
+
+        const int gameOverX = gameX + (gameW - gameOverW)/2;
+        const int gameOverY = gameY + (gameH - uiFZ.h)*2/5;
+
+        const int pauseX = gameX + (gameW - pauseW)/2;
+        const int pauseY = gameY + (gameH - uiFZ.h)*2/5;
+
+        f->scoreDigitsDst = (SDL_Rect){ scoreDigitsX, scoreY, scoreDigitsW, uiFZ.h };
+        f->gameOverDst    = (SDL_Rect){ gameOverX, gameOverY, gameOverW, uiFZ.h };
+        f->pauseDst       = (SDL_Rect){ pauseX, pauseY, pauseW, uiFZ.h };
+        f->gameDst        = (SDL_Rect){ gameX, gameY, gameW, gameH };
+
+        f->ringY  = i * PLAYFIELD_ROWS * S;
+        f->scoreY = i * uiFZ.h;
+    }
+}
+
+// Loads one of our bitmaps. If the data files are embedded in the executable,
+// the surface points straight at the pixels from the embedded table, so the
+// texture upload doesn't need any file I/O or pixel conversion.
+SDL_Surface *loadDataFile(const char *filename)
+{
+#if XJUMP_EMBED_DATA
+    const char *prefix = XJUMP_DATADIR "/xjump/";
+    size_t len = strlen(prefix);
+    if (0 == strncmp(filename, prefix, len)) {
+        for (int i = 0; i < numEmbeddedImages; i++) {
+            const EmbeddedImage *img = &embeddedImages[i];
+            if (0 == strcmp(filename + len, img->name)) {
+                return SDL_CreateRGBSurfaceWithFormatFrom(
+                        (void *) img->pixels, img->w, img->h, 32, 4 * img->w,
+                        SDL_PIXELFORMAT_ARGB8888);
+            }
+        }
+    }
+#endif
+    return SDL_LoadBMP(filename);
+}
+
+// Takes ownership of the surface, which may be NULL
+SDL_Surface *checkThemeSurface(SDL_Surface *surface)
+{
+    if (!surface) {
+        fprintf(stderr, "Error loading theme file. %s\n.", SDL_GetError());
+        return NULL;
+    }
+    if (surface->w != 4*R + S || surface->h != 2*R) {
+        fprintf(stderr, "Theme spritesheet has the wrong dimensions.\n");
+        SDL_FreeSurface(surface);
+        return NULL;
+    }
+    return surface;
+}
+
+SDL_Surface *loadThemeFile(const char *filename)
+{
+    return checkThemeSurface(loadDataFile(filename));
+}
+
+static bool fail(const char *what)
+{
+    fprintf(stderr, "%s. %s\n", what, SDL_GetError());
+    return false;
+}
+
+// Where the text that never changes goes. There is one score label per field.
+static void background_layout(const Screen *s, SDL_Rect *titleDst, SDL_Rect scoreLabelDst[MAX_FIELDS], SDL_Rect *copyrightDst)
+{
+    const Field *f0 = &s->fields[0];
+
+    const int titleW      = uiFZ.w * strlen(titleMsg);
+    const int scoreLabelW = uiFZ.w * strlen(scoreLabelMsg);
+    const int copyrightW  = uiFZ.w * strlen(copyrightMsg);
+
+    const int titleX     = (s->windowW - titleW)/2;
+    const int copyrightX = (s->windowW - copyrightW)/2;
+
+    const int titleY     = windowMarginTop + boxBorder + boxPadding;
+    const int copyrightY = f0->gameY + f0->gameH + windowMarginInner;
+
+    *titleDst      = (SDL_Rect){ titleX, titleY, titleW, uiFZ.h };
+    *copyrightDst  = (SDL_Rect){ copyrightX, copyrightY, copyrightW, uiFZ.h };
+    for (int i = 0; i < s->nfields; i++) {
+        const Field *f = &s->fields[i];
+        scoreLabelDst[i] = (SDL_Rect){ f->scoreDigitsDst.x - scoreLabelW - uiFZ.w, f->scoreDigitsDst.y, scoreLabelW, uiFZ.h };
+    }
+}
+
+// Draws into one of our textures. The renderer scale maps the layout to the
+// texels, and SDL resets it when the target changes again.
+static void set_texture_target(Screen *s, SDL_Texture *texture)
+{
+    SDL_SetRenderTarget(s->renderer, texture);
+    SDL_RenderSetScale(s->renderer, s->scale, s->scale);
+}
+
+// Draws the parts of the screen that never change into their textures
+static void draw_backgrounds(Screen *s)
+{
+    SDL_Renderer *r = s->renderer;
+
+    // Saves the current target, in case we are drawing offscreen
+    SDL_Texture *target = SDL_GetRenderTarget(r);
+
+    {
+        SDL_Rect titleDst, scoreLabelDst[MAX_FIELDS], copyrightDst;
+        background_layout(s, &titleDst, scoreLabelDst, &copyrightDst);
+
+        set_texture_target(s, s->windowBackground);
+
+        SDL_SetRenderDrawColor(r, backgroundColor.r,  backgroundColor.g, backgroundColor.b, backgroundColor.a);
+        SDL_RenderClear(r);
+
+        text_draw_box(r, &titleDst);
+        text_batch_add(&s->uiText, titleMsg, &titleDst, textColor);
+        for (int i = 0; i < s->nfields; i++) {
+            text_batch_add(&s->uiText, scoreLabelMsg, &scoreLabelDst[i], textColor);
+        }
+        text_batch_add(&s->uiText, copyrightMsg, &copyrightDst, copyrightColor);
+        text_batch_flush(&s->uiText);
+
+        SDL_RenderPresent(r);
+        SDL_SetRenderTarget(r, target);
+    }
+}
+
+// Copies a surface into the atlas as-is, including the alpha channel
+static bool atlas_put(SDL_Surface *atlas, SDL_Surface *src, const SDL_Rect *srcRect, int x, int y)
+{
+    SDL_Rect dst = { x, y, 0, 0 };
+    SDL_SetSurfaceBlendMode(src, SDL_BLENDMODE_NONE);
+    return 0 == SDL_BlitSurface(src, srcRect, atlas, &dst);
+}
+
+// The theme: the spritesheet, and the playfield rows made from its tiles
+static bool atlas_put_theme(Screen *s, SDL_Surface *spritesSurface)
+{
+    SDL_Surface *atlas = s->atlasSurface;
+    bool ok = atlas_put(atlas, spritesSurface, NULL, s->spritesSrc.x, s->spritesSrc.y);
+    for (int x = 0; ok && x < FIELD_W; x++) {
+        const SDL_Rect *src = ((x == 0) ? &LWallSprite : (x == FIELD_W-1) ? &RWallSprite : &skySprite);
+        ok = atlas_put(atlas, spritesSurface, src, x*S, s->skyRowSrc.y) &&
+             atlas_put(atlas, spritesSurface, &floorSprite, x*S, s->floorRowSrc.y);
+    }
+    return ok;
+}
+
+// Packs everything we draw from into one texture. The fonts and the sprites go
+// side by side in the first shelf, and the two playfield rows, which we build
+// here from the wall, sky and floor tiles, go below them.
+static bool create_atlas(Screen *s,
+        SDL_Surface *spritesSurface, SDL_Surface *uiFontSurface, SDL_Surface *hsFontSurface)
+{
+    const int uiX = 0;
+    const int hsX = uiX + uiFontSurface->w;
+    const int spritesX = hsX + hsFontSurface->w;
+    int shelfH = uiFontSurface->h;
+    if (hsFontSurface->h > shelfH) shelfH = hsFontSurface->h;
+    if (spritesSurface->h > shelfH) shelfH = spritesSurface->h;
+
+    const int skyY = shelfH;
+    const int floorY = skyY + S;
+
+    int atlasW = spritesX + spritesSurface->w;
+    if (backgroundW > atlasW) atlasW = backgroundW;
+    const int atlasH = floorY + S;
+
+    for (int i = 0; i < 8; i++) {
+        s->heroSrc[i] = heroSprite[i];
+        s->heroSrc[i].x += spritesX;
+    }
+    s->spritesSrc  = (SDL_Rect){ spritesX, 0, spritesSurface->w, spritesSurface->h };
+    s->skyRowSrc   = (SDL_Rect){ 0, skyY,   backgroundW, S };
+    s->floorRowSrc = (SDL_Rect){ 0, floorY, backgroundW, S };
+
+    // We keep a copy of the pixels, for when the theme changes
+    SDL_Surface *atlas = SDL_CreateRGBSurfaceWithFormat(0, atlasW, atlasH, 32, SDL_PIXELFORMAT_ARGB8888);
+    if (!atlas) return fail("Could not create atlas surface");
+    SDL_FillRect(atlas, NULL, SDL_MapRGBA(atlas->format, 0, 0, 0, 0));
+    s->atlasSurface = atlas;
+
+    bool ok = atlas_put(atlas, uiFontSurface, NULL, uiX, 0) &&
+              atlas_put(atlas, hsFontSurface, NULL, hsX, 0) &&
+              atlas_put_theme(s, spritesSurface);
+    if (!ok) return fail("Could not build the atlas");
+
+    // The texture comes later, in create_textures. The CPU path draws
+    // straight from the surface.
+    text_batch_init(&s->uiText, s->renderer, NULL, &uiFZ, uiX, 0);
+    text_batch_init(&s->hsText, s->renderer, NULL, &hsFZ, hsX, 0);
+    return true;
+}
+
+// A rect in the layout, or in the atlas surface, in the texels of the
+// textures, which may have been drawn at a larger scale
+static SDL_Rect texels(const Screen *s, const SDL_Rect *rect)
+{
+    const int z = s->scale;
+    return (SDL_Rect){ rect->x*z, rect->y*z, rect->w*z, rect->h*z };
+}
+
+// Copies part of a surface with each pixel repeated into a z by z square. Both
+// surfaces are ARGB8888.
+static SDL_Surface *scale_surface(SDL_Surface *src, const SDL_Rect *rect, int z)
+{
+    SDL_Surface *dst = SDL_CreateRGBSurfaceWithFormat(0, rect->w*z, rect->h*z, 32, SDL_PIXELFORMAT_ARGB8888);
+    if (!dst) return NULL;
+    for (int y = 0; y < dst->h; y++) {
+        const Uint32 *in = (const Uint32 *) ((const Uint8 *) src->pixels + (rect->y + y/z) * src->pitch) + rect->x;
+        Uint32 *out = (Uint32 *) ((Uint8 *) dst->pixels + y * dst->pitch);
+        for (int x = 0; x < dst->w; x++) {
+            out[x] = in[x/z];
+        }
+    }
+    return dst;
+}
+
+// Uploads part of the atlas surface to the atlas texture
+static bool upload_atlas(Screen *s, const SDL_Rect *rect)
+{
+    SDL_Surface *atlas = s->atlasSurface;
+    if (s->scale == 1) {
+        const Uint8 *pixels = (const Uint8 *) atlas->pixels + rect->y * atlas->pitch + 4 * rect->x;
+        return 0 == SDL_UpdateTexture(s->atlas, rect, pixels, atlas->pitch);
+    }
+
+    SDL_Surface *scaled = scale_surface(atlas, rect, s->scale);
+    if (!scaled) return false;
+    const SDL_Rect dst = texels(s, rect);
+    bool ok = (0 == SDL_UpdateTexture(s->atlas, &dst, scaled->pixels, scaled->pitch));
+    SDL_FreeSurface(scaled);
+    return ok;
+}
+
+// Forgets what is in the playfield rings and the score digits, so that they are
+// drawn again on the next frame
+static void invalidate_fields(Screen *s)
+{
+    for (int i = 0; i < MAX_FIELDS; i++) {
+        Field *f = &s->fields[i];
+        memset(f->isRowValid, 0, sizeof(f->isRowValid));
+        f->isScoreValid = false;
+    }
+}
+
+// The size of the largest texture, at scale 1
+static void max_texture_size(const Screen *s, int *w, int *h)
+{
+    const int playfieldH = s->nfields * PLAYFIELD_ROWS * S;
+    *w = s->windowW;
+    if (backgroundW > *w) *w = backgroundW;
+    if (s->atlasSurface->w > *w) *w = s->atlasSurface->w;
+    *h = s->windowH;
+    if (playfieldH > *h) *h = playfieldH;
+    if (s->atlasSurface->h > *h) *h = s->atlasSurface->h;
+}
+
+static void destroy_textures(Screen *s)
+{
+    SDL_Texture *textures[] = { s->scoreTexture, s->playfield, s->windowBackground, s->atlas };
+    for (int i = 0; i < 4; i++) {
+        if (textures[i]) SDL_DestroyTexture(textures[i]);
+    }
+    s->scoreTexture = s->playfield = s->windowBackground = s->atlas = NULL;
+}
+
+// Creates the textures at the current scale, and draws the parts that don't
+// change. The old textures must have been destroyed.
+static bool create_textures(Screen *s)
+{
+    SDL_Renderer *r = s->renderer;
+    const int z = s->scale;
+
+    if (z == 1) {
+        s->atlas = SDL_CreateTextureFromSurface(r, s->atlasSurface);
+    } else {
+        const SDL_Rect all = { 0, 0, s->atlasSurface->w, s->atlasSurface->h };
+        SDL_Surface *scaled = scale_surface(s->atlasSurface, &all, z);
+        if (!scaled) return fail("Could not scale the atlas");
+        s->atlas = SDL_CreateTextureFromSurface(r, scaled);
+        SDL_FreeSurface(scaled);
+    }
+    if (!s->atlas) return fail("Could not create atlas texture");
+    SDL_SetTextureBlendMode(s->atlas, SDL_BLENDMODE_BLEND);
+    text_batch_set_texture(&s->uiText, s->atlas, z);
+    text_batch_set_texture(&s->hsText, s->atlas, z);
+
+    s->windowBackground = SDL_CreateTexture(
+            r, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET,
+            z * s->windowW, z * s->windowH);
+    if (!s->windowBackground) return fail("Could not create window background texture");
+
+    s->playfield = SDL_CreateTexture(
+            r, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET,
+            z * backgroundW, z * s->nfields * PLAYFIELD_ROWS * S);
+    if (!s->playfield) return fail("Could not create playfield texture");
+    SDL_SetTextureBlendMode(s->playfield, SDL_BLENDMODE_BLEND);
+
+    // The last glyph reaches a bit further to the right
+    const SDL_Rect *digits = &s->fields[0].scoreDigitsDst;
+    s->scoreTexture = SDL_CreateTexture(
+            r, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET,
+            z * (digits->w + uiFZ.ow - uiFZ.w), z * s->nfields * digits->h);
+    if (!s->scoreTexture) return fail("Could not create score texture");
+    SDL_SetTextureBlendMode(s->scoreTexture, SDL_BLENDMODE_BLEND);
+    invalidate_fields(s);
+
+    draw_backgrounds(s);
+
+    return true;
+}
+
+// Creates the textures. Must be called after screen_layout. The surfaces are
+// not freed.
+bool screen_init(Screen *s, SDL_Renderer *renderer,
+        SDL_Surface *spritesSurface, SDL_Surface *uiFontSurface, SDL_Surface *hsFontSurface)
+{
+    s->renderer = renderer;
+    s->soft = NULL;
+    s->scale = 1;
+    s->scoreTexture = s->playfield = s->windowBackground = s->atlas = NULL;
+
+    if (!create_atlas(s, spritesSurface, uiFontSurface, hsFontSurface)) return false;
+    return create_textures(s);
+}
+
+void screen_destroy(Screen *s)
+{
+    if (s->soft) {
+        SDL_FreeSurface(s->soft->playfield);
+        SDL_FreeSurface(s->soft->background);
+        free(s->soft);
+    } else {
+        destroy_textures(s);
+    }
+    SDL_FreeSurface(s->atlasSurface);
+}
+
+// Must be called when the contents of the render targets are lost
+// (SDL_RENDER_TARGETS_RESET)
+void screen_invalidate(Screen *s)
+{
+    if (s->soft) {
+        screen_damage_all(s);
+        return;
+    }
+    draw_backgrounds(s);
+    invalidate_fields(s);
+}
+
+// Replaces the theme while the game is running. The surface must have passed
+// checkThemeSurface. Only the parts of the atlas that came from the theme are
+// uploaded again, and the playfield is redrawn on the next frame.
+bool screen_set_theme(Screen *s, SDL_Surface *spritesSurface)
+{
+    if (!atlas_put_theme(s, spritesSurface)) return fail("Could not update the atlas");
+
+    // The CPU path notices the rows that changed on its own
+    for (int i = 0; i < MAX_FIELDS; i++) {
+        memset(s->fields[i].isRowValid, 0, sizeof(s->fields[i].isRowValid));
+    }
+    if (!s->atlas) return true;
+
+    const SDL_Rect rows = { 0, s->skyRowSrc.y, backgroundW, s->floorRowSrc.y + S - s->skyRowSrc.y };
+    if (!upload_atlas(s, &s->spritesSrc) || !upload_atlas(s, &rows)) {
+        return fail("Could not update the atlas texture");
+    }
+    return true;
+}
+
+//
+// Integer scaling
+// ---------------
+//
+// SDL_RenderSetLogicalSize stretches the whole drawing by whatever factor fits
+// the window, so on a large display the pixels come out blurry or of uneven
+// sizes. Instead, screen_fit_output can draw the textures again at the largest
+// whole multiple of the layout that fits, and the renderer copies them one
+// texel per pixel. The renderer scale only maps the coordinates of the layout
+// to the output, and the viewport centers the layout in the window.
+//
+// The output size is in pixels, not in window coordinates, so this also gets
+// the scale right on HiDPI displays.
+
+// Must be called again when the output size changes
+bool screen_fit_output(Screen *s)
+{
+    SDL_Renderer *r = s->renderer;
+
+    int outW, outH;
+    if (0 != SDL_GetRendererOutputSize(r, &outW, &outH)) return fail("Could not get the output size");
+
+    int scale = outW / s->windowW;
+    if (outH / s->windowH < scale) scale = outH / s->windowH;
+
+    // All of the textures must fit in the GPU
+    SDL_RendererInfo info;
+    if (0 == SDL_GetRendererInfo(r, &info) && info.max_texture_width > 0 && info.max_texture_height > 0) {
+        int w, h;
+        max_texture_size(s, &w, &h);
+        while (scale > 1 && (scale*w > info.max_texture_width || scale*h > info.max_texture_height)) {
+            scale--;
+        }
+    }
+
+    int z = (scale < 1 ? 1 : scale);
+    if (z != s->scale) {
+        destroy_textures(s);
+        s->scale = z;
+        if (!create_textures(s)) {
+            if (z == 1) return false;
+            fprintf(stderr, "Drawing at scale 1 instead\n");
+            destroy_textures(s);
+            s->scale = z = scale = 1;
+            if (!create_textures(s)) return false;
+        }
+    }
+
+    // If the window is smaller than the layout, stretching is all we can do
+    if (scale < 1) {
+        SDL_RenderSetLogicalSize(r, s->windowW, s->windowH);
+        return true;
+    }
+
+    // The viewport is in output pixels as long as the scale is 1
+    SDL_RenderSetLogicalSize(r, 0, 0);
+    const SDL_Rect view = {
+        (outW - z*s->windowW)/2, (outH - z*s->windowH)/2,
+        z*s->windowW, z*s->windowH,
+    };
+    SDL_RenderSetViewport(r, &view);
+    SDL_RenderSetScale(r, z, z);
+    return true;
+}
+
+static void soft_draw_frame(Screen *s, const int64_t *scores);
+static void soft_draw_highscores(Screen *s, int64_t bestEver, int64_t bestToday);
+static void soft_draw_games(Screen *s, const FieldView *views);
+static void soft_draw_overlay(Screen *s, const char *const *lines, int n);
+
+//
+// Drawing
+// -------
+
+// The parts of the window that are always visible. There is one score per
+// field.
+void screen_draw_frame(Screen *s, const int64_t *scores)
+{
+    if (s->soft) { soft_draw_frame(s, scores); return; }
+    SDL_Renderer *r = s->renderer;
+
+    SDL_SetRenderDrawColor(r, backgroundColor.r,  backgroundColor.g, backgroundColor.b, backgroundColor.a);
+    SDL_RenderClear(r);
+    SDL_RenderCopy(r, s->windowBackground, NULL, NULL);
+
+    int w, h;
+    SDL_QueryTexture(s->scoreTexture, NULL, NULL, &w, &h);
+    w /= s->scale;
+    h = uiFZ.h;
+
+    // If any of the scores changed we redraw all of them, which costs the same
+    // as redrawing one: a single render target switch and a single flush.
+    bool isValid = true;
+    for (int i = 0; i < s->nfields; i++) {
+        const Field *f = &s->fields[i];
+        if (!f->isScoreValid || scores[i] != f->scoreCached) isValid = false;
+    }
+
+    if (!isValid) {
+        SDL_Texture *target = SDL_GetRenderTarget(r);
+        set_texture_target(s, s->scoreTexture);
+        SDL_SetRenderDrawColor(r, 0, 0, 0, 0);
+        SDL_RenderClear(r);
+
+        for (int i = 0; i < s->nfields; i++) {
+            Field *f = &s->fields[i];
+            char scoreDigits[32];
+            snprintf(scoreDigits, sizeof(scoreDigits), "%010ld", scores[i]);
+            const SDL_Rect where = { 0, f->scoreY, w, h };
+            text_batch_add(&s->uiText, scoreDigits, &where, textColor);
+            f->scoreCached = scores[i];
+            f->isScoreValid = true;
+        }
+        text_batch_flush(&s->uiText);
+
+        SDL_SetRenderTarget(r, target);
+    }
+
+    for (int i = 0; i < s->nfields; i++) {
+        const Field *f = &s->fields[i];
+        const SDL_Rect src = { 0, f->scoreY, w, h };
+        const SDL_Rect dst = { f->scoreDigitsDst.x, f->scoreDigitsDst.y, w, h };
+        const SDL_Rect srcTexels = texels(s, &src);
+        SDL_RenderCopy(r, s->scoreTexture, &srcTexels, &dst);
+    }
+}
+
+// Returns the number of lines
+static int highscore_layout(const Field *f, int64_t bestEver, int64_t bestToday, char lines[2][32], SDL_Rect dsts[2])
+{
+    const int gameX = f->gameX, gameY = f->gameY, gameW = f->gameW, gameH = f->gameH;
+
+    // Draw the high scores
+    // To avoid showing repeated high scores in the first day the
+    // person is playing, only show the best time today if it is
+    // different. This also gives a nice visual cue if you get an
+    // all time highscore :)
+    snprintf(lines[0], 32, "%s %6ld", highscoreMsg1, bestEver);
+    snprintf(lines[1], 32, "%s %6ld", highscoreMsg2, bestToday);
+
+    int N = (bestToday != bestEver ? 2 : 1);
+
+    int highscoreW = hsFZ.w * 17;
+    int highscoreH = hsFZ.h * N;
+    int highscoreX = gameX + (gameW - highscoreW)/2;
+    int highscoreY = gameY + (gameH - highscoreH)/2;
+
+    for (int i = 0; i < N; i ++) {
+        dsts[i] = (SDL_Rect){ highscoreX, highscoreY + i*hsFZ.h, highscoreW, hsFZ.h };
+    }
+    return N;
+}
+
+// The same high scores in every field
+void screen_draw_highscores(Screen *s, int64_t bestEver, int64_t bestToday)
+{
+    if (s->soft) { soft_draw_highscores(s, bestEver, bestToday); return; }
+    SDL_Renderer *r = s->renderer;
+
+    for (int k = 0; k < s->nfields; k++) {
+        const Field *f = &s->fields[k];
+        const int gameX = f->gameX, gameY = f->gameY, gameW = f->gameW, gameH = f->gameH;
+
+        // Clear background
+        SDL_SetRenderDrawColor(r, scoreBorderColor.r,  scoreBorderColor.g, scoreBorderColor.b, scoreBorderColor.a);
+        SDL_RenderFillRect(r, &f->gameDst);
+
+        const SDL_Rect innerRect = { gameX+1, gameY+1, gameW-2, gameH-2 };
+        SDL_SetRenderDrawColor(r, backgroundColor.r,  backgroundColor.g, backgroundColor.b, backgroundColor.a);
+        SDL_RenderFillRect(r, &innerRect);
+
+        char lines[2][32];
+        SDL_Rect dsts[2];
+        int N = highscore_layout(f, bestEver, bestToday, lines, dsts);
+        for (int i = 0; i < N; i ++) {
+            text_batch_add(&s->hsText, lines[i], &dsts[i], textColor);
+        }
+    }
+    text_batch_flush(&s->hsText);
+}
+
+static int mod(int64_t a, int b)
+{
+    int r = (int) (a % b);
+    return (r < 0 ? r + b : r);
+}
+
+// Redraws the playfield rows that don't match the floors that are currently
+// on screen. Usually that is either none of them or the one that the last
+// scroll exposed. The render target is switched at most once for all of the
+// fields.
+static void update_playfields(Screen *s, const FieldView *views)
+{
+    SDL_Renderer *r = s->renderer;
+    SDL_Texture *target = NULL;
+    bool isTargetSet = false;
+
+    for (int i = 0; i < s->nfields; i++) {
+        Field *f = &s->fields[i];
+        const Game *g = views[i].game;
+
+        for (int y = -FIELD_EXTRA; y < FIELD_H; y++) {
+            int64_t n = g->floorOffset - y;
+            int row = mod(-n, PLAYFIELD_ROWS);
+            const Floor *floor = get_floor(g, n);
+            if (f->isRowValid[row] &&
+                f->rowFloor[row] == n &&
+                f->rowContents[row].left  == floor->left &&
+                f->rowContents[row].right == floor->right) {
+                continue;
+            }
+
+            if (!isTargetSet) {
+                target = SDL_GetRenderTarget(r);
+                set_texture_target(s, s->playfield);
+                isTargetSet = true;
+            }
+
+            // Overwrite the old row, including the alpha channel
+            const SDL_Rect rowDst = { 0, f->ringY + row*S, backgroundW, S };
+            SDL_SetTextureBlendMode(s->atlas, SDL_BLENDMODE_NONE);
+            const SDL_Rect skySrc = texels(s, &s->skyRowSrc);
+            SDL_RenderCopy(r, s->atlas, &skySrc, &rowDst);
+            SDL_SetTextureBlendMode(s->atlas, SDL_BLENDMODE_BLEND);
+
+            int xl = floor->left;
+            int xr = floor->right;
+            if (xl <= xr) {
+                int w = xr - xl + 1;
+                const SDL_Rect src = { s->floorRowSrc.x, s->floorRowSrc.y, w*S, S };
+                const SDL_Rect dst = { xl*S, f->ringY + row*S, w*S, S };
+                const SDL_Rect srcTexels = texels(s, &src);
+                SDL_RenderCopy(r, s->atlas, &srcTexels, &dst);
+            }
+
+            f->isRowValid[row] = true;
+            f->rowFloor[row] = n;
+            f->rowContents[row] = *floor;
+        }
+    }
+
+    if (isTargetSet) {
+        SDL_SetRenderTarget(r, target);
+    }
+}
+
+// Draws part of one of our textures at a position that might not be a whole
+// pixel, which matters when the window is scaled up. The source is in the
+// coordinates of the layout.
+static void copy_at(const Screen *s, SDL_Texture *texture, const SDL_Rect *src, float x, float y)
+{
+    SDL_Renderer *r = s->renderer;
+    const SDL_Rect srcTexels = texels(s, src);
+#if SDL_VERSION_ATLEAST(2, 0, 10)
+    const SDL_FRect dst = { x, y, src->w, src->h };
+    SDL_RenderCopyF(r, texture, &srcTexels, &dst);
+#else
+    int ix = (int) (x < 0 ? x - 0.5f : x + 0.5f);
+    int iy = (int) (y < 0 ? y - 0.5f : y + 0.5f);
+    const SDL_Rect dst = { ix, iy, src->w, src->h };
+    SDL_RenderCopy(r, texture, &srcTexels, &dst);
+#endif
+}
+
+// Draws all of the fields, one view per field. The fields share the atlas,
+// the playfield texture and the font, so every copy comes from the same two
+// textures and the banner text of all the fields goes out in one flush.
+void screen_draw_games(Screen *s, const FieldView *views)
+{
+    if (s->soft) { soft_draw_games(s, views); return; }
+    SDL_Renderer *r = s->renderer;
+
+    // Must come before the clip rect, because it changes the render target
+    update_playfields(s, views);
+
+    for (int i = 0; i < s->nfields; i++) {
+        const Field *f = &s->fields[i];
+        const FieldView *v = &views[i];
+        const Game *g = v->game;
+        const int gameX = f->gameX, gameY = f->gameY;
+
+        SDL_RenderSetClipRect(r, &f->gameDst);
+
+        // The row at the top of the screen is usually in the middle of the ring
+        // buffer, so we need two copies to account for the wrap-around.
+        int top = mod(-(g->floorOffset + FIELD_EXTRA), PLAYFIELD_ROWS);
+        float y0 = gameY - S*FIELD_EXTRA + (float) v->interpScroll / INTERP_ONE;
+
+        const SDL_Rect src1 = { 0, f->ringY + top*S, backgroundW, (PLAYFIELD_ROWS - top)*S };
+        copy_at(s, s->playfield, &src1, gameX, y0);
+
+        if (top > 0) {
+            const SDL_Rect src2 = { 0, f->ringY, backgroundW, top*S };
+            copy_at(s, s->playfield, &src2, gameX, y0 + src1.h);
+        }
+
+        // Ghosts, under the hero. They are all copies from the atlas with
+        // the same alpha, so the renderer can batch them.
+        if (v->nghosts > 0) {
+            SDL_SetTextureAlphaMod(s->atlas, ghostAlpha);
+            for (int k = 0; k < v->nghosts; k++) {
+                const GhostView *gv = &v->ghosts[k];
+                copy_at(s, s->atlas, &s->heroSrc[hero_sprite(gv->game)],
+                        gameX + (float) gv->sx / INTERP_ONE,
+                        gameY + (float) gv->sy / INTERP_ONE);
+            }
+            SDL_SetTextureAlphaMod(s->atlas, 255);
+        }
+
+        // Hero sprite
+        copy_at(s, s->atlas, &s->heroSrc[hero_sprite(g)],
+                gameX + (float) v->sx / INTERP_ONE,
+                gameY + (float) v->sy / INTERP_ONE);
+    }
+    SDL_RenderSetClipRect(r, NULL);
+
+    // Text boxes. They are inside the game areas, so they need no clipping.
+    for (int i = 0; i < s->nfields; i++) {
+        const Field *f = &s->fields[i];
+        if (views[i].banner == BANNER_GAMEOVER) {
+            text_draw_box(r, &f->gameOverDst);
+            text_batch_add(&s->uiText, gameOverMsg, &f->gameOverDst, textColor);
+        }
+        if (views[i].banner == BANNER_PAUSE) {
+            text_draw_box(r, &f->pauseDst);
+            text_batch_add(&s->uiText, pauseMsg, &f->pauseDst, textColor);
+        }
+    }
+    text_batch_flush(&s->uiText);
+}
+
+// Debugging text, at the top-left corner of the first playing field
+void screen_draw_overlay(Screen *s, const char *const *lines, int n)
+{
+    if (s->soft) { soft_draw_overlay(s, lines, n); return; }
+    SDL_Renderer *r = s->renderer;
+    const Field *f = &s->fields[0];
+
+    int w = 0;
+    for (int i = 0; i < n; i++) {
+        int lw = hsFZ.w * strlen(lines[i]);
+        if (lw > w) w = lw;
+    }
+
+    const SDL_Rect box = { f->gameX + S, f->gameY, w + 2*boxPadding, n*hsFZ.h + 2*boxPadding };
+    SDL_SetRenderDrawBlendMode(r, SDL_BLENDMODE_BLEND);
+    SDL_SetRenderDrawColor(r, backgroundColor.r, backgroundColor.g, backgroundColor.b, 192);
+    SDL_RenderFillRect(r, &box);
+    SDL_SetRenderDrawBlendMode(r, SDL_BLENDMODE_NONE);
+
+    for (int i = 0; i < n; i++) {
+        const SDL_Rect dst = { box.x + boxPadding, box.y + boxPadding + i*hsFZ.h, w, hsFZ.h };
+        text_batch_add(&s->hsText, lines[i], &dst, textColor);
+    }
+    text_batch_flush(&s->hsText);
+}
+
+//
+// Drawing with the CPU
+// --------------------
+//
+// The coordinates are the same as in the rest of the file. The origin is only
+// added when we touch the window surface, which can be larger than the window
+// layout if the window was resized.
+
+static Uint32 map_color(const SDL_Surface *surface, SDL_Color c)
+{
+    return SDL_MapRGBA(surface->format, c.r, c.g, c.b, c.a);
+}
+
+static SDL_Rect rect_offset(const SDL_Rect *r, int dx, int dy)
+{
+    return (SDL_Rect){ r->x + dx, r->y + dy, r->w, r->h };
+}
+
+// The intersection, or an empty rect
+static SDL_Rect rect_clip(const SDL_Rect *a, const SDL_Rect *b)
+{
+    int x0 = (a->x > b->x ? a->x : b->x);
+    int y0 = (a->y > b->y ? a->y : b->y);
+    int x1 = (a->x + a->w < b->x + b->w ? a->x + a->w : b->x + b->w);
+    int y1 = (a->y + a->h < b->y + b->h ? a->y + a->h : b->y + b->h);
+    if (x1 <= x0 || y1 <= y0) return (SDL_Rect){ 0, 0, 0, 0 };
+    return (SDL_Rect){ x0, y0, x1 - x0, y1 - y0 };
+}
+
+static bool rect_contains(const SDL_Rect *outer, const SDL_Rect *inner)
+{
+    return inner->x >= outer->x && inner->x + inner->w <= outer->x + outer->w &&
+           inner->y >= outer->y && inner->y + inner->h <= outer->y + outer->h;
+}
+
+// Rounds a fixed-point coordinate to the nearest pixel
+static int fixed_round(int v)
+{
+    int q = v + INTERP_ONE/2;
+    return (q >= 0 ? q / INTERP_ONE : -((-q + INTERP_ONE - 1) / INTERP_ONE));
+}
+
+static void soft_damage(SoftScreen *ss, const SDL_Rect *rect)
+{
+    if (ss->isDamagedAll || rect->w <= 0 || rect->h <= 0) return;
+    if (ss->ndamage == SOFT_MAX_DAMAGE) {
+        ss->isDamagedAll = true;
+        return;
+    }
+    ss->damage[ss->ndamage++] = *rect;
+}
+
+static void soft_blit(SoftScreen *ss, SDL_Surface *src, const SDL_Rect *srcRect, int x, int y)
+{
+    SDL_Rect dst = { ss->originX + x, ss->originY + y, 0, 0 };
+    SDL_BlitSurface(src, srcRect, ss->surface, &dst);
+}
+
+static void soft_fill(SDL_Surface *dst, int ox, int oy, const SDL_Rect *rect, SDL_Color color)
+{
+    SDL_Rect r = rect_offset(rect, ox, oy);
+    SDL_FillRect(dst, &r, map_color(dst, color));
+}
+
+// Same as text_draw_box
+static void soft_box(SDL_Surface *dst, int ox, int oy, const SDL_Rect *content)
+{
+    SDL_Rect border, padding;
+    box_rects(content, &border, &padding);
+    soft_fill(dst, ox, oy, &border, boxBorderColor);
+    soft_fill(dst, ox, oy, &padding, boxColor);
+}
+
+// Same as text_batch_add, but the glyphs are drawn right away. The glyph
+// table of the batch tells where they are in the atlas.
+static void soft_text(const Screen *s, SDL_Surface *dst, int ox, int oy,
+        const TextBatch *font, const char *message, const SDL_Rect *where, SDL_Color color)
+{
+    SDL_Surface *atlas = s->atlasSurface;
+    SDL_SetSurfaceBlendMode(atlas, SDL_BLENDMODE_BLEND);
+    SDL_SetSurfaceColorMod(atlas, color.r, color.g, color.b);
+    for (int i = 0; message[i] != '\0'; i++) {
+        char c = message[i];
+        if (c < ' ' || '~' < c) { c = 127; } // Default glyph
+        SDL_Rect dstRect = { ox + where->x + i*font->fz->w, oy + where->y, 0, 0 };
+        SDL_BlitSurface(atlas, &font->glyphs[c - ' '], dst, &dstRect);
+    }
+    SDL_SetSurfaceColorMod(atlas, 255, 255, 255);
+}
+
+// Same as update_playfields, for one field. The rows are drawn over the
+// background color, so that they can be copied to the window without blending.
+static void soft_update_playfield(Screen *s, Field *f, const Game *g, bool changed[PLAYFIELD_ROWS])
+{
+    SoftScreen *ss = s->soft;
+    SDL_Surface *atlas = s->atlasSurface;
+    SDL_SetSurfaceBlendMode(atlas, SDL_BLENDMODE_BLEND);
+
+    for (int y = -FIELD_EXTRA; y < FIELD_H; y++) {
+        int64_t n = g->floorOffset - y;
+        int row = mod(-n, PLAYFIELD_ROWS);
+        const Floor *floor = get_floor(g, n);
+        if (f->isRowValid[row] &&
+            f->rowFloor[row] == n &&
+            f->rowContents[row].left  == floor->left &&
+            f->rowContents[row].right == floor->right) {
+            continue;
+        }
+
+        SDL_Rect rowDst = { 0, f->ringY + row*S, backgroundW, S };
+        SDL_FillRect(ss->playfield, &rowDst, map_color(ss->playfield, backgroundColor));
+        SDL_BlitSurface(atlas, &s->skyRowSrc, ss->playfield, &rowDst);
+
+        int xl = floor->left;
+        int xr = floor->right;
+        if (xl <= xr) {
+            int w = xr - xl + 1;
+            const SDL_Rect src = { s->floorRowSrc.x, s->floorRowSrc.y, w*S, S };
+            SDL_Rect dst = { xl*S, f->ringY + row*S, w*S, S };
+            SDL_BlitSurface(atlas, &src, ss->playfield, &dst);
+        }
+
+        changed[row] = true;
+        f->isRowValid[row] = true;
+        f->rowFloor[row] = n;
+        f->rowContents[row] = *floor;
+    }
+}
+
+// Redraws part of the window from the background and the playfields, as they
+// are now. The heroes, banners and overlay are drawn on top afterwards.
+static void soft_repaint(Screen *s, const SDL_Rect *rect)
+{
+    SoftScreen *ss = s->soft;
+    if (rect->w <= 0 || rect->h <= 0) return;
+
+    bool isInsideField = false;
+    for (int i = 0; i < s->nfields; i++) {
+        if (rect_contains(&s->fields[i].gameDst, rect)) isInsideField = true;
+    }
+    if (!isInsideField) {
+        soft_blit(ss, ss->background, rect, rect->x, rect->y);
+    }
+
+    // The ring buffer may wrap around in the middle of the rect
+    const int ringH = PLAYFIELD_ROWS * S;
+    for (int i = 0; i < s->nfields; i++) {
+        const Field *f = &s->fields[i];
+        const SoftField *sf = &ss->fields[i];
+        SDL_Rect r = rect_clip(rect, &f->gameDst);
+        int y = r.y;
+        int end = r.y + r.h;
+        while (y < end) {
+            int ry = mod(sf->ringTop + (y - f->gameY), ringH);
+            int h = end - y;
+            if (h > ringH - ry) h = ringH - ry;
+            const SDL_Rect src = { r.x - f->gameX, f->ringY + ry, r.w, h };
+            soft_blit(ss, ss->playfield, &src, r.x, y);
+            y += h;
+        }
+    }
+    soft_damage(ss, rect);
+}
+
+// Moves what is in the game area of a field down by d pixels, or up if d is
+// negative
+static void soft_scroll(Screen *s, const Field *f, int d)
+{
+    SoftScreen *ss = s->soft;
+    SDL_Surface *ws = ss->surface;
+    if (SDL_MUSTLOCK(ws)) SDL_LockSurface(ws);
+
+    const int pitch = ws->pitch;
+    const int bpp = ws->format->BytesPerPixel;
+    Uint8 *base = (Uint8 *) ws->pixels + (ss->originY + f->gameY) * pitch + (ss->originX + f->gameX) * bpp;
+    const size_t n = (size_t) f->gameW * bpp;
+    if (d > 0) {
+        for (int y = f->gameH - 1; y >= d; y--) {
+            memmove(base + y*pitch, base + (y - d)*pitch, n);
+        }
+    } else {
+        for (int y = 0; y < f->gameH + d; y++) {
+            memmove(base + y*pitch, base + (y - d)*pitch, n);
+        }
+    }
+
+    if (SDL_MUSTLOCK(ws)) SDL_UnlockSurface(ws);
+    soft_damage(ss, &f->gameDst);
+}
+
+static void soft_draw_frame(Screen *s, const int64_t *scores)
+{
+    SoftScreen *ss = s->soft;
+
+    // The window surface is replaced when the window is resized
+    SDL_Surface *ws = SDL_GetWindowSurface(ss->window);
+    if (ws != ss->surface) ss->isValid = false;
+    ss->surface = ws;
+    if (!ws) return;
+
+    if (!ss->isValid) {
+        ss->originX = (ws->w > s->windowW ? (ws->w - s->windowW)/2 : 0);
+        ss->originY = (ws->h > s->windowH ? (ws->h - s->windowH)/2 : 0);
+        SDL_FillRect(ws, NULL, map_color(ws, backgroundColor));
+        soft_blit(ss, ss->background, NULL, 0, 0);
+        ss->isValid = true;
+        ss->isDamagedAll = true;
+        for (int i = 0; i < s->nfields; i++) {
+            ss->fields[i].isGameValid = false;
+            s->fields[i].isScoreValid = false;
+        }
+    }
+
+    for (int i = 0; i < s->nfields; i++) {
+        Field *f = &s->fields[i];
+        if (f->isScoreValid && scores[i] == f->scoreCached) continue;
+
+        // The last glyph reaches a bit further to the right
+        const SDL_Rect where = {
+            f->scoreDigitsDst.x, f->scoreDigitsDst.y,
+            f->scoreDigitsDst.w + uiFZ.ow - uiFZ.w, f->scoreDigitsDst.h };
+        soft_blit(ss, ss->background, &where, where.x, where.y);
+
+        char scoreDigits[32];
+        snprintf(scoreDigits, sizeof(scoreDigits), "%010ld", scores[i]);
+        const SDL_Rect clip = rect_offset(&where, ss->originX, ss->originY);
+        SDL_SetClipRect(ws, &clip);
+        soft_text(s, ws, ss->originX, ss->originY, &s->uiText, scoreDigits, &where, textColor);
+        SDL_SetClipRect(ws, NULL);
+
+        soft_damage(ss, &where);
+        f->scoreCached = scores[i];
+        f->isScoreValid = true;
+    }
+}
+
+static void soft_draw_highscores(Screen *s, int64_t bestEver, int64_t bestToday)
+{
+    SoftScreen *ss = s->soft;
+    SDL_Surface *ws = ss->surface;
+    if (!ws) return;
+    const int ox = ss->originX, oy = ss->originY;
+
+    for (int k = 0; k < s->nfields; k++) {
+        const Field *f = &s->fields[k];
+        const SDL_Rect innerRect = { f->gameX+1, f->gameY+1, f->gameW-2, f->gameH-2 };
+        soft_fill(ws, ox, oy, &f->gameDst, scoreBorderColor);
+        soft_fill(ws, ox, oy, &innerRect, backgroundColor);
+
+        char lines[2][32];
+        SDL_Rect dsts[2];
+        int N = highscore_layout(f, bestEver, bestToday, lines, dsts);
+        for (int i = 0; i < N; i++) {
+            soft_text(s, ws, ox, oy, &s->hsText, lines[i], &dsts[i], textColor);
+        }
+
+        soft_damage(ss, &f->gameDst);
+        ss->fields[k].isGameValid = false;
+    }
+    ss->overlayRect = (SDL_Rect){ 0, 0, 0, 0 };
+}
+
+static void soft_draw_field(Screen *s, int k, const FieldView *v)
+{
+    SoftScreen *ss = s->soft;
+    SDL_Surface *ws = ss->surface;
+    Field *f = &s->fields[k];
+    SoftField *sf = &ss->fields[k];
+    const Game *g = v->game;
+    const int ox = ss->originX, oy = ss->originY;
+    const int ringH = PLAYFIELD_ROWS * S;
+
+    bool changed[PLAYFIELD_ROWS] = { false };
+    soft_update_playfield(s, f, g, changed);
+
+    // Same position as the two copies in screen_draw_games, rounded to a pixel
+    int top = mod(-(g->floorOffset + FIELD_EXTRA), PLAYFIELD_ROWS);
+    int ringTop = mod(top*S + S*FIELD_EXTRA - fixed_round(v->interpScroll), ringH);
+
+    // We can only move the pixels around if all of the game area is there
+    const SDL_Rect surfaceBounds = { -ox, -oy, ws->w, ws->h };
+    bool isFull = !sf->isGameValid || v->banner != BANNER_NONE || !rect_contains(&surfaceBounds, &f->gameDst);
+
+    int d = 0;  // How far down the tower moved since the last frame
+    if (!isFull) {
+        d = mod(sf->ringTop - ringTop, ringH);
+        if (d > ringH/2) d -= ringH;
+        if (d >= f->gameH || -d >= f->gameH) isFull = true;
+    }
+    sf->ringTop = ringTop;
+
+    if (isFull) {
+        soft_repaint(s, &f->gameDst);
+    } else {
+        // Erase the hero, the ghosts and the overlay, wherever the scroll put them
+        const SDL_Rect oldHero = sf->heroRect;
+        const SDL_Rect oldOverlay = (k == 0 ? ss->overlayRect : (SDL_Rect){ 0, 0, 0, 0 });
+        if (d != 0) {
+            soft_scroll(s, f, d);
+            const SDL_Rect strip = (d > 0 ?
+                    (SDL_Rect){ f->gameX, f->gameY, f->gameW, d } :
+                    (SDL_Rect){ f->gameX, f->gameY + f->gameH + d, f->gameW, -d });
+            const SDL_Rect movedHero = rect_offset(&oldHero, 0, d);
+            const SDL_Rect movedOverlay = rect_offset(&oldOverlay, 0, d);
+            soft_repaint(s, &strip);
+            soft_repaint(s, &movedHero);
+            soft_repaint(s, &movedOverlay);
+            for (int i = 0; i < sf->nghosts; i++) {
+                const SDL_Rect movedGhost = rect_offset(&sf->ghostRects[i], 0, d);
+                const SDL_Rect visible = rect_clip(&movedGhost, &f->gameDst);
+                soft_repaint(s, &visible);
+            }
+        }
+        soft_repaint(s, &oldHero);
+        soft_repaint(s, &oldOverlay);
+        for (int i = 0; i < sf->nghosts; i++) {
+            soft_repaint(s, &sf->ghostRects[i]);
+        }
+
+        // Rows that were redrawn while they were on screen
+        for (int row = 0; row < PLAYFIELD_ROWS; row++) {
+            if (!changed[row]) continue;
+            int wy = mod(row*S - ringTop, ringH);
+            if (wy > ringH - S) wy -= ringH;
+            const SDL_Rect rowRect = { f->gameX, f->gameY + wy, f->gameW, S };
+            const SDL_Rect visible = rect_clip(&rowRect, &f->gameDst);
+            soft_repaint(s, &visible);
+        }
+    }
+
+    const SDL_Rect clip = rect_offset(&f->gameDst, ox, oy);
+    SDL_SetClipRect(ws, &clip);
+    SDL_SetSurfaceBlendMode(s->atlasSurface, SDL_BLENDMODE_BLEND);
+
+    // Ghosts, under the hero. Those that are off screen cost nothing.
+    sf->nghosts = 0;
+    if (v->nghosts > 0) {
+        SDL_SetSurfaceAlphaMod(s->atlasSurface, ghostAlpha);
+        for (int i = 0; i < v->nghosts; i++) {
+            const GhostView *gv = &v->ghosts[i];
+            const SDL_Rect ghost = { f->gameX + fixed_round(gv->sx), f->gameY + fixed_round(gv->sy), R, R };
+            const SDL_Rect visible = rect_clip(&ghost, &f->gameDst);
+            if (visible.w <= 0 || visible.h <= 0) continue;
+            soft_blit(ss, s->atlasSurface, &s->heroSrc[hero_sprite(gv->game)], ghost.x, ghost.y);
+            sf->ghostRects[sf->nghosts++] = visible;
+            soft_damage(ss, &visible);
+        }
+        SDL_SetSurfaceAlphaMod(s->atlasSurface, 255);
+    }
+
+    // Hero sprite
+    const SDL_Rect hero = { f->gameX + fixed_round(v->sx), f->gameY + fixed_round(v->sy), R, R };
+    soft_blit(ss, s->atlasSurface, &s->heroSrc[hero_sprite(g)], hero.x, hero.y);
+    SDL_SetClipRect(ws, NULL);
+    sf->heroRect = rect_clip(&hero, &f->gameDst);
+    soft_damage(ss, &sf->heroRect);
+
+    // Text box
+    const SDL_Rect *bannerDst = (v->banner == BANNER_GAMEOVER ? &f->gameOverDst :
+                                 v->banner == BANNER_PAUSE    ? &f->pauseDst : NULL);
+    if (bannerDst) {
+        SDL_Rect border, padding;
+        box_rects(bannerDst, &border, &padding);
+        soft_box(ws, ox, oy, bannerDst);
+        soft_text(s, ws, ox, oy, &s->uiText, (v->banner == BANNER_GAMEOVER ? gameOverMsg : pauseMsg),
+                  bannerDst, textColor);
+        soft_damage(ss, &border);
+    }
+
+    sf->isGameValid = (v->banner == BANNER_NONE);
+}
+
+static void soft_draw_games(Screen *s, const FieldView *views)
+{
+    SoftScreen *ss = s->soft;
+    if (!ss->surface) return;
+    for (int i = 0; i < s->nfields; i++) {
+        soft_draw_field(s, i, &views[i]);
+    }
+    ss->overlayRect = (SDL_Rect){ 0, 0, 0, 0 };
+}
+
+// The box is opaque here, because SDL_FillRect doesn't blend
+static void soft_draw_overlay(Screen *s, const char *const *lines, int n)
+{
+    SoftScreen *ss = s->soft;
+    SDL_Surface *ws = ss->surface;
+    if (!ws) return;
+    const int ox = ss->originX, oy = ss->originY;
+    const Field *f = &s->fields[0];
+
+    int w = 0;
+    for (int i = 0; i < n; i++) {
+        int lw = hsFZ.w * strlen(lines[i]);
+        if (lw > w) w = lw;
+    }
+
+    const SDL_Rect box = { f->gameX + S, f->gameY, w + 2*boxPadding, n*hsFZ.h + 2*boxPadding };
+    soft_fill(ws, ox, oy, &box, backgroundColor);
+    for (int i = 0; i < n; i++) {
+        const SDL_Rect dst = { box.x + boxPadding, box.y + boxPadding + i*hsFZ.h, w, hsFZ.h };
+        soft_text(s, ws, ox, oy, &s->hsText, lines[i], &dst, textColor);
+    }
+    soft_damage(ss, &box);
+    ss->overlayRect = box;
+}
+
+// Sets up the CPU path, for when there is no renderer. The window must not
+// have a renderer either. The surfaces are not freed.
+bool screen_init_cpu(Screen *s, SDL_Window *window,
+        SDL_Surface *spritesSurface, SDL_Surface *uiFontSurface, SDL_Surface *hsFontSurface)
+{
+    s->renderer = NULL;
+    s->scale = 1;
+    s->atlas = NULL;
+    s->windowBackground = NULL;
+    s->playfield = NULL;
+    s->scoreTexture = NULL;
+
+    SoftScreen *ss = calloc(1, sizeof(SoftScreen));
+    if (!ss) {
+        fprintf(stderr, "Out of memory\n");
+        return false;
+    }
+    s->soft = ss;
+    ss->window = window;
+
+    if (!create_atlas(s, spritesSurface, uiFontSurface, hsFontSurface)) return false;
+
+    ss->background = SDL_CreateRGBSurfaceWithFormat(0, s->windowW, s->windowH, 32, SDL_PIXELFORMAT_ARGB8888);
+    if (!ss->background) return fail("Could not create window background surface");
+    SDL_SetSurfaceBlendMode(ss->background, SDL_BLENDMODE_NONE);
+
+    ss->playfield = SDL_CreateRGBSurfaceWithFormat(0, backgroundW, s->nfields * PLAYFIELD_ROWS * S, 32, SDL_PIXELFORMAT_ARGB8888);
+    if (!ss->playfield) return fail("Could not create playfield surface");
+    SDL_SetSurfaceBlendMode(ss->playfield, SDL_BLENDMODE_NONE);
+    invalidate_fields(s);
+
+    // Same as draw_backgrounds
+    SDL_Rect titleDst, scoreLabelDst[MAX_FIELDS], copyrightDst;
+    background_layout(s, &titleDst, scoreLabelDst, &copyrightDst);
+
+    SDL_Surface *bg = ss->background;
+    SDL_FillRect(bg, NULL, map_color(bg, backgroundColor));
+    soft_box(bg, 0, 0, &titleDst);
+    soft_text(s, bg, 0, 0, &s->uiText, titleMsg, &titleDst, textColor);
+    for (int i = 0; i < s->nfields; i++) {
+        soft_text(s, bg, 0, 0, &s->uiText, scoreLabelMsg, &scoreLabelDst[i], textColor);
+    }
+    soft_text(s, bg, 0, 0, &s->uiText, copyrightMsg, &copyrightDst, copyrightColor);
+
+    return true;
+}
+
+// Forgets what is on the window surface, so that the next frame redraws all of
+// it. Only the CPU path needs this.
+void screen_damage_all(Screen *s)
+{
+    if (s->soft) s->soft->isValid = false;
+}
+
+void screen_present(Screen *s)
+{
+    if (!s->soft) {
+        SDL_RenderPresent(s->renderer);
+        return;
+    }
+
+    SoftScreen *ss = s->soft;
+    if (ss->surface && ss->isDamagedAll) {
+        SDL_UpdateWindowSurface(ss->window);
+    } else if (ss->surface && ss->ndamage > 0) {
+        const SDL_Rect bounds = { 0, 0, ss->surface->w, ss->surface->h };
+        SDL_Rect rects[SOFT_MAX_DAMAGE];
+        int n = 0;
+        for (int i = 0; i < ss->ndamage; i++) {
+            SDL_Rect r = rect_offset(&ss->damage[i], ss->originX, ss->originY);
+            r = rect_clip(&r, &bounds);
+            if (r.w > 0) rects[n++] = r;
+        }
+        if (n > 0) SDL_UpdateWindowSurfaceRects(ss->window, rects, n);
+    }
+    ss->isDamagedAll = false;
+    ss->ndamage = 0;
+}
@@ -0,0 +1,224 @@
+// Copyright 1997-1999 Tatsuya Kudoh
+// Copyright 1997-1999 Masato Taruishi
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef XJUMP_RENDER_H
+#define XJUMP_RENDER_H
+
+#include <SDL.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "game.h"
+
+// The drawing code, separated from the main loop so that it can also be used
+// by the benchmarks. It only reads the Game; the caller is responsible for
+// interpolating the hero position and for applying the forced scroll.
+
+//
+// Text rendering
+// --------------
+
+typedef struct {
+    int w, h;   // Dimensions in the text
+    int ow, oh; // Dimentions in the sprite file
+} FontSize;
+
+extern const FontSize uiFZ;
+extern const FontSize hsFZ;
+
+// Glyphs are queued in a batch and then submitted all at once, with a single
+// SDL_RenderGeometry call per font texture. The batch is flushed automatically
+// if it gets full. The font doesn't need to be the whole texture: (fontX,
+// fontY) says where its glyph grid starts. If the texture was drawn at a
+// larger scale than the font file, the glyph table stays in the coordinates
+// of the file.
+
+#define TEXT_BATCH_SIZE 256 /* Glyphs */
+#define TEXT_NGLYPHS 96     /* ASCII from ' ' to DEL */
+
+typedef struct {
+    SDL_Renderer *renderer;
+    SDL_Texture *font;
+    const FontSize *fz;
+    int texW, texH;
+    int scale;                      // Texels per pixel of the font file
+    SDL_Rect glyphs[TEXT_NGLYPHS];  // Where each glyph is in the texture
+    int nglyphs;
+    SDL_Rect src[TEXT_BATCH_SIZE];
+    SDL_Rect dst[TEXT_BATCH_SIZE];
+    SDL_Color color[TEXT_BATCH_SIZE];
+} TextBatch;
+
+void text_batch_init(TextBatch *b, SDL_Renderer *renderer, SDL_Texture *font, const FontSize *fz, int fontX, int fontY);
+void text_batch_set_texture(TextBatch *b, SDL_Texture *font, int scale);
+void text_batch_add(TextBatch *b, const char *message, const SDL_Rect *where, SDL_Color color);
+void text_batch_flush(TextBatch *b);
+
+void text_draw_line(
+        SDL_Renderer *renderer,
+        SDL_Texture *font,
+        const FontSize *fz,
+        const char *message,
+        const SDL_Rect *where);
+void text_set_color(SDL_Texture *font, SDL_Color color);
+void text_draw_box(SDL_Renderer *renderer, const SDL_Rect *content);
+
+//
+// Screen
+// ------
+
+typedef enum {
+    BANNER_NONE,
+    BANNER_GAMEOVER,
+    BANNER_PAUSE,
+} Banner;
+
+#define PLAYFIELD_ROWS (FIELD_H + FIELD_EXTRA)
+
+// In split-screen mode each player has a playing field of their own, side by
+// side in the same window.
+#define MAX_FIELDS 4
+#define MAX_GHOSTS 16
+
+// Without a GPU, SDL's software renderer redraws and stretches the whole
+// window every frame. Instead, the CPU path draws into the window surface
+// directly, at one pixel per pixel, and keeps track of what changed: the
+// hero, the score and, when the screen scrolls, the game area. Scrolling
+// moves the rows that are already on the surface and only draws the strip
+// that came into view. Only the damaged rectangles are sent to the window.
+
+#define SOFT_MAX_DAMAGE (16 * MAX_FIELDS)
+
+// What the game area of one field shows
+typedef struct {
+    bool isGameValid;           // The game area has the playfield and the hero only
+    int ringTop;                // The playfield pixel row at the top of the game area
+    SDL_Rect heroRect;
+    SDL_Rect ghostRects[MAX_GHOSTS];
+    int nghosts;
+} SoftField;
+
+typedef struct {
+    SDL_Window *window;
+    SDL_Surface *surface;       // The window surface, as of the last frame
+    SDL_Surface *background;    // Same as windowBackground
+    SDL_Surface *playfield;     // Same ring buffers as the texture, but opaque
+    int originX, originY;       // Where the layout goes in the window surface
+
+    // What the window surface shows
+    bool isValid;
+    SoftField fields[MAX_FIELDS];
+    SDL_Rect overlayRect;       // Always in the first field
+
+    bool isDamagedAll;
+    int ndamage;
+    SDL_Rect damage[SOFT_MAX_DAMAGE];
+} SoftScreen;
+
+// The parts of the screen that belong to one player
+typedef struct {
+    int ringY;  // Where the ring buffer of this field starts, in the playfield texture
+    bool isRowValid[PLAYFIELD_ROWS];
+    int64_t rowFloor[PLAYFIELD_ROWS];   // Floor number drawn in each row
+    Floor rowContents[PLAYFIELD_ROWS];  // And what it looked like
+
+    int scoreY; // Where the digits of this field are, in the score texture
+    int64_t scoreCached;
+    bool isScoreValid;
+
+    // Layout
+    int gameX, gameY, gameW, gameH;
+    SDL_Rect scoreDigitsDst;
+    SDL_Rect gameOverDst;
+    SDL_Rect pauseDst;
+    SDL_Rect gameDst;
+} Field;
+
+typedef struct {
+    SDL_Renderer *renderer;     // NULL when drawing with the CPU
+    SoftScreen *soft;           // Only when drawing with the CPU
+
+    // The theme sprites, both fonts and the two kinds of playfield rows are
+    // packed into a single texture at load time, so that drawing the hero,
+    // the text and the playfield rows doesn't switch between textures.
+    SDL_Texture *atlas;
+    SDL_Surface *atlasSurface; // The same pixels, in memory
+    SDL_Rect spritesSrc;    // The whole theme spritesheet
+    SDL_Rect heroSrc[8];    // Hero sprites, in the atlas
+    SDL_Rect skyRowSrc;     // A row of sky between the two walls
+    SDL_Rect floorRowSrc;   // A wide floor, to copy parts of
+
+    // Things that don't change from frame to frame. This reduces the number
+    // of draw calls in the inner loop.
+    SDL_Texture *windowBackground;
+
+    // The visible part of the tower, including the walls and the sky. It is a
+    // ring buffer of rows: floor n lives at row mod(-n, PLAYFIELD_ROWS), so
+    // when the screen scrolls only the newly exposed row has to be drawn. The
+    // rings of all the fields are stacked in the same texture.
+    SDL_Texture *playfield;
+
+    // The score digits only change a few times per second. One line per field.
+    SDL_Texture *scoreTexture;
+
+    TextBatch uiText;
+    TextBatch hsText;
+
+    // Layout
+    int windowW, windowH;
+    int nfields;
+    int scale;  // The textures are drawn at this multiple of the layout size
+    Field fields[MAX_FIELDS];
+} Screen;
+
+// A translucent hero from another game, drawn on top of the playfield
+typedef struct {
+    const Game *game;   // For the sprite
+    int sx, sy;         // In the coordinates of the field
+} GhostView;
+
+// What to draw in one field
+typedef struct {
+    const Game *game;
+    int sx, sy, interpScroll;   // As computed by interpolateHeroFine
+    Banner banner;
+    const GhostView *ghosts;
+    int nghosts;
+} FieldView;
+
+void screen_layout(Screen *s, int nfields);
+SDL_Surface *loadDataFile(const char *filename);
+SDL_Surface *checkThemeSurface(SDL_Surface *surface);
+SDL_Surface *loadThemeFile(const char *filename);
+bool screen_init(Screen *s, SDL_Renderer *renderer,
+        SDL_Surface *sprites, SDL_Surface *uiFont, SDL_Surface *hsFont);
+bool screen_init_cpu(Screen *s, SDL_Window *window,
+        SDL_Surface *sprites, SDL_Surface *uiFont, SDL_Surface *hsFont);
+void screen_destroy(Screen *s);
+void screen_invalidate(Screen *s);
+bool screen_fit_output(Screen *s);
+bool screen_set_theme(Screen *s, SDL_Surface *sprites);
+
+void screen_draw_frame(Screen *s, const int64_t *scores);
+void screen_draw_highscores(Screen *s, int64_t bestEver, int64_t bestToday);
+void screen_draw_games(Screen *s, const FieldView *views);
+void screen_draw_overlay(Screen *s, const char *const *lines, int n);
+void screen_damage_all(Screen *s);
+void screen_present(Screen *s);
+
+#endif
@@ -0,0 +1,517 @@
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "replay.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SYM_SCROLL     6
+#define SYM_END        7
+#define SYM_CHECKPOINT (1 << 3 | 7)
+
+#define INDEX_ENTRY_SIZE 16
+
+static const char magic[4] = { 'X', 'J', 'R', 'P' };
+
+//
+// Little-endian encoding
+// ----------------------
+
+static void put_u64(uint8_t *buf, uint64_t x)
+{
+    for (int i = 0; i < 8; i++) {
+        buf[i] = (x >> (8*i)) & 0xff;
+    }
+}
+
+static uint64_t get_u64(const uint8_t *buf)
+{
+    uint64_t x = 0;
+    for (int i = 0; i < 8; i++) {
+        x |= ((uint64_t) buf[i]) << (8*i);
+    }
+    return x;
+}
+
+// Reads a LEB128 varint. Returns the number of bytes consumed, or 0 if the
+// varint is malformed or runs past the end of the buffer.
+static size_t get_varint(const uint8_t *buf, size_t len, uint32_t *out)
+{
+    uint32_t x = 0;
+    for (size_t i = 0; i < len && i < 5; i++) {
+        x |= ((uint32_t) (buf[i] & 0x7f)) << (7*i);
+        if (!(buf[i] & 0x80)) {
+            *out = x;
+            return i+1;
+        }
+    }
+    return 0;
+}
+
+//
+// Writer
+// ------
+
+static void emit(ReplayWriter *w, const void *buf, size_t n)
+{
+    fwrite(buf, 1, n, w->file);
+    w->offset += n;
+}
+
+static void emit_byte(ReplayWriter *w, uint8_t b)
+{
+    putc(b, w->file);
+    w->offset += 1;
+}
+
+static void flush_run(ReplayWriter *w)
+{
+    if (w->run > 0) {
+        emit_byte(w, (w->run - 1) << 3 | w->sym);
+        w->run = 0;
+    }
+}
+
+static void write_checkpoint(ReplayWriter *w, const Game *g)
+{
+    flush_run(w);
+
+    if (w->hasIndex && w->nindex == w->capacity) {
+        size_t capacity = (w->capacity ? 2*w->capacity : 64);
+        uint64_t *index = realloc(w->index, capacity * 2 * sizeof(uint64_t));
+        if (index) {
+            w->index = index;
+            w->capacity = capacity;
+        } else {
+            // Not fatal; the replay just won't have an index
+            free(w->index);
+            w->index = NULL;
+            w->nindex = 0;
+            w->capacity = 0;
+            w->hasIndex = false;
+        }
+    }
+    if (w->hasIndex) {
+        w->index[2*w->nindex + 0] = w->ticks;
+        w->index[2*w->nindex + 1] = w->offset;
+        w->nindex++;
+    }
+
+    uint8_t buf[GAME_SNAPSHOT_SIZE];
+    game_save(g, buf);
+    emit_byte(w, SYM_CHECKPOINT);
+    emit(w, buf, sizeof(buf));
+}
+
+bool replay_writer_open(ReplayWriter *w, const char *path, const ReplayHeader *header)
+{
+    w->file = fopen(path, "wb");
+    if (!w->file) {
+        fprintf(stderr, "Could not create replay file %s. %s\n", path, strerror(errno));
+        return false;
+    }
+    w->sym = -1;
+    w->run = 0;
+    w->ticks = 0;
+    w->offset = 0;
+    w->index = NULL;
+    w->nindex = 0;
+    w->capacity = 0;
+    w->hasIndex = true;
+
+    uint8_t buf[REPLAY_HEADER_SIZE] = {0};
+    memcpy(buf, magic, 4);
+    buf[4] = REPLAY_VERSION;
+    buf[5] = header->flags;
+    put_u64(buf +  8, header->seed[0]);
+    put_u64(buf + 16, header->seed[1]);
+    emit(w, buf, sizeof(buf));
+    return true;
+}
+
+// Must be called right before each simulation frame, after the input is set
+void replay_write_tick(ReplayWriter *w, const Game *g)
+{
+    if (w->ticks > 0 && w->ticks % REPLAY_CHECKPOINT_INTERVAL == 0) {
+        write_checkpoint(w, g);
+    }
+
+    int sym = input_encode(&g->input);
+    if (sym != w->sym || w->run == REPLAY_MAX_RUN) {
+        flush_run(w);
+        w->sym = sym;
+    }
+    w->run++;
+    w->ticks++;
+}
+
+void replay_write_scroll(ReplayWriter *w, int distance)
+{
+    flush_run(w);
+    emit_byte(w, SYM_SCROLL);
+    uint32_t x = distance;
+    do {
+        uint8_t b = x & 0x7f;
+        x >>= 7;
+        emit_byte(w, b | (x ? 0x80 : 0));
+    } while (x);
+}
+
+bool replay_writer_close(ReplayWriter *w, int64_t score, uint64_t checksum)
+{
+    flush_run(w);
+    emit_byte(w, SYM_END);
+
+    uint8_t buf[REPLAY_FOOTER_SIZE];
+    put_u64(buf +  0, w->ticks);
+    put_u64(buf +  8, score);
+    put_u64(buf + 16, checksum);
+    emit(w, buf, sizeof(buf));
+
+    size_t nindex = (w->hasIndex ? w->nindex : 0);
+    put_u64(buf, nindex);
+    emit(w, buf, 8);
+    for (size_t i = 0; i < 2*nindex; i++) {
+        put_u64(buf, w->index[i]);
+        emit(w, buf, 8);
+    }
+    free(w->index);
+    w->index = NULL;
+
+    bool ok = !ferror(w->file);
+    if (0 != fclose(w->file)) ok = false;
+    w->file = NULL;
+    if (!ok) {
+        fprintf(stderr, "Could not write replay file. %s\n", strerror(errno));
+    }
+    return ok;
+}
+
+//
+// Reader
+// ------
+//
+// The whole file is memory mapped, so playback doesn't need to allocate or to
+// call read() once the replay is open. We validate the entire stream upfront,
+// which means that replay_next doesn't have to worry about corrupted files.
+
+// Every index entry must point at one of the checkpoints of the stream, in
+// order, with the tick that the stream has at that point. Otherwise seeking
+// could load a snapshot from the middle of some other code, or resume past the
+// end of the stream. The stream up to SYM_END (at position end) was already
+// validated, so we can walk it again without any checks.
+static bool validate_index(ReplayReader *r, size_t end, size_t pos)
+{
+    const uint8_t *d = r->data;
+    r->index = NULL;
+    r->nindex = 0;
+
+    if (d[4] == 1) {
+        return pos == r->size;
+    }
+
+    if (r->size - pos < 8) return false;
+    uint64_t n = get_u64(d + pos);
+    pos += 8;
+    if (n > (r->size - pos) / INDEX_ENTRY_SIZE) return false;
+    if (pos + n * INDEX_ENTRY_SIZE != r->size) return false;
+
+    size_t i = REPLAY_HEADER_SIZE;  // Next code of the stream
+    uint64_t streamTick = 0;        // Frames before position i
+    uint64_t prevTick = 0;
+    for (uint64_t k = 0; k < n; k++) {
+        uint64_t tick   = get_u64(d + pos + k*INDEX_ENTRY_SIZE);
+        uint64_t offset = get_u64(d + pos + k*INDEX_ENTRY_SIZE + 8);
+        if (offset < i || offset >= end) return false;
+
+        while (i < offset) {
+            int sym = d[i] & 7;
+            if (sym <= REPLAY_MAX_INPUT) {
+                streamTick += (d[i] >> 3) + 1;
+                i++;
+            } else if (sym == SYM_SCROLL) {
+                uint32_t distance;
+                i += 1 + get_varint(d + i + 1, r->size - i - 1, &distance);
+            } else {
+                i += 1 + r->snapshotSize;
+            }
+        }
+        if (i != offset || d[i] != SYM_CHECKPOINT) return false;
+        if (tick != streamTick || tick <= prevTick) return false;
+        i += 1 + r->snapshotSize;
+        prevTick = tick;
+    }
+
+    r->index = d + pos;
+    r->nindex = n;
+    return true;
+}
+
+static bool validate(ReplayReader *r)
+{
+    const uint8_t *d = r->data;
+    if (r->size < REPLAY_HEADER_SIZE + 1 + REPLAY_FOOTER_SIZE) return false;
+    if (0 != memcmp(d, magic, 4)) return false;
+    if (d[4] < 1 || d[4] > REPLAY_VERSION) return false;
+    r->snapshotSize = (d[4] == 2 ? GAME_SNAPSHOT_SIZE_V2 :
+                       d[4] == 3 ? GAME_SNAPSHOT_SIZE_V3 :
+                       GAME_SNAPSHOT_SIZE);
+
+    r->header.flags   = d[5];
+    r->header.seed[0] = get_u64(d +  8);
+    r->header.seed[1] = get_u64(d + 16);
+
+    size_t i = REPLAY_HEADER_SIZE;
+    while (i < r->size) {
+        int sym = d[i] & 7;
+        if (sym <= REPLAY_MAX_INPUT) {
+            i++;
+        } else if (sym == SYM_SCROLL) {
+            if (d[i] != SYM_SCROLL) return false;
+            uint32_t distance;
+            size_t n = get_varint(d + i + 1, r->size - i - 1, &distance);
+            if (n == 0) return false;
+            i += 1 + n;
+        } else if (d[i] == SYM_CHECKPOINT && d[4] >= 2) {
+            if (r->size - i - 1 < r->snapshotSize) return false;
+            i += 1 + r->snapshotSize;
+        } else {
+            if (d[i] != SYM_END) return false;
+            if (r->size - i - 1 < REPLAY_FOOTER_SIZE) return false;
+            r->footer.ticks    = get_u64(d + i + 1);
+            r->footer.score    = get_u64(d + i + 9);
+            r->footer.checksum = get_u64(d + i + 17);
+            return validate_index(r, i, i + 1 + REPLAY_FOOTER_SIZE);
+        }
+    }
+    return false;
+}
+
+bool replay_open(ReplayReader *r, const char *path)
+{
+    r->data = NULL;
+    r->size = 0;
+    r->index = NULL;
+    r->nindex = 0;
+    r->pos = REPLAY_HEADER_SIZE;
+    r->sym = 0;
+    r->run = 0;
+    r->tick = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open replay file %s. %s\n", path, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (0 != fstat(fd, &st)) {
+        fprintf(stderr, "Could not read replay file %s. %s\n", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    if (st.st_size > 0) {
+        void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            fprintf(stderr, "Could not map replay file %s. %s\n", path, strerror(errno));
+            close(fd);
+            return false;
+        }
+        r->data = p;
+        r->size = st.st_size;
+    }
+    close(fd);
+
+    if (!validate(r)) {
+        fprintf(stderr, "Replay file %s is corrupted or has an unsupported version.\n", path);
+        replay_close(r);
+        return false;
+    }
+    return true;
+}
+
+ReplayEvent replay_next(ReplayReader *r, int *arg)
+{
+    if (r->run > 0) {
+        r->run--;
+        r->tick++;
+        *arg = r->sym;
+        return REPLAY_TICK;
+    }
+
+    while (r->data[r->pos] == SYM_CHECKPOINT) {
+        r->pos += 1 + r->snapshotSize;
+    }
+
+    uint8_t code = r->data[r->pos];
+    int sym = code & 7;
+    if (sym <= REPLAY_MAX_INPUT) {
+        r->pos++;
+        r->sym = sym;
+        r->run = (code >> 3);
+        r->tick++;
+        *arg = sym;
+        return REPLAY_TICK;
+    } else if (sym == SYM_SCROLL) {
+        uint32_t distance = 0;
+        r->pos += 1 + get_varint(r->data + r->pos + 1, r->size - r->pos - 1, &distance);
+        *arg = distance;
+        return REPLAY_SCROLL;
+    } else {
+        // Don't advance, so that we keep returning END
+        return REPLAY_END;
+    }
+}
+
+void replay_close(ReplayReader *r)
+{
+    if (r->data) {
+        munmap((void *) r->data, r->size);
+    }
+    r->data = NULL;
+    r->size = 0;
+}
+
+//
+// Playback
+// --------
+
+// Configures the game with the seed and the settings from the replay
+void replay_start(const ReplayReader *r, Game *g)
+{
+    g->isSoftScroll = (r->header.flags & REPLAY_FLAG_SOFTSCROLL) != 0;
+    g->floorGenerator = ((r->header.flags & REPLAY_FLAG_COUNTERFLOORS) ? FLOORGEN_COUNTER : FLOORGEN_CLASSIC);
+    pcg32_init(&g->rng, r->header.seed);
+    init_game(g);
+}
+
+// Goes back to the start of the stream, to play the replay again
+void replay_rewind(ReplayReader *r)
+{
+    r->pos = REPLAY_HEADER_SIZE;
+    r->sym = 0;
+    r->run = 0;
+    r->tick = 0;
+}
+
+// Sets the input for the next simulation frame.
+// Returns false if the replay is over.
+bool replay_feed(ReplayReader *r, Game *g)
+{
+    while (1) {
+        int arg;
+        switch (replay_next(r, &arg)) {
+            case REPLAY_TICK:
+                input_decode(&g->input, arg);
+                return true;
+
+            case REPLAY_SCROLL:
+                applyForcedScroll(g, arg);
+                break;
+
+            case REPLAY_END:
+                return false;
+        }
+    }
+}
+
+// Checks the final state of the game against the replay footer
+bool replay_matches(const ReplayReader *r, const Game *g)
+{
+    return g->score == r->footer.score && game_checksum(g) == r->footer.checksum;
+}
+
+// Simulates the rest of the replay, until the end or until the hero dies.
+// Returns the number of simulation frames.
+uint64_t replay_simulate(ReplayReader *r, Game *g)
+{
+    uint64_t ticks = 0;
+    while (replay_feed(r, g)) {
+        ticks++;
+        if (updateGame(g)) break;
+    }
+    return ticks;
+}
+
+// Applies the forced scrolls that come right after the current frame. This way
+// the game state is the same as when the writer saved a checkpoint.
+static void apply_pending_scrolls(ReplayReader *r, Game *g)
+{
+    while (r->run == 0) {
+        while (r->data[r->pos] == SYM_CHECKPOINT) {
+            r->pos += 1 + r->snapshotSize;
+        }
+        if (r->data[r->pos] != SYM_SCROLL) break;
+        int arg;
+        replay_next(r, &arg);
+        applyForcedScroll(g, arg);
+    }
+}
+
+// Moves the playback to the state right after the given number of frames. The
+// game must be the one driven by this reader. We resume from the latest
+// checkpoint before the target (or from the current position, if that is
+// closer) and simulate forward. Returns the frame where we stopped, which is
+// earlier than requested if the replay ends or the hero dies before that.
+uint64_t replay_seek(ReplayReader *r, Game *g, uint64_t tick)
+{
+    // Binary search for the last checkpoint at or before the target
+    size_t lo = 0, hi = r->nindex;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo)/2;
+        if (get_u64(r->index + mid*INDEX_ENTRY_SIZE) <= tick) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    uint64_t cpTick = 0;
+    size_t cpOffset = 0;
+    if (lo > 0) {
+        cpTick   = get_u64(r->index + (lo-1)*INDEX_ENTRY_SIZE);
+        cpOffset = get_u64(r->index + (lo-1)*INDEX_ENTRY_SIZE + 8);
+    }
+
+    if (r->tick > tick || (cpOffset && cpTick > r->tick)) {
+        r->run = 0;
+        if (cpOffset) {
+            game_load(g, r->data + cpOffset + 1, r->snapshotSize);
+            r->pos  = cpOffset + 1 + r->snapshotSize;
+            r->tick = cpTick;
+        } else {
+            replay_start(r, g);
+            r->pos  = REPLAY_HEADER_SIZE;
+            r->tick = 0;
+        }
+    }
+
+    while (r->tick < tick) {
+        if (!replay_feed(r, g) || updateGame(g)) {
+            return r->tick;
+        }
+    }
+    apply_pending_scrolls(r, g);
+    return r->tick;
+}
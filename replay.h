@@ -0,0 +1,127 @@
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef XJUMP_REPLAY_H
+#define XJUMP_REPLAY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "game.h"
+
+//
+// Replay files
+// ------------
+//
+// A game is fully determined by the RNG seed, the scrolling mode and the
+// input that was active during each simulation frame. A replay file stores
+// exactly that, in little-endian byte order:
+//
+//   Header: "XJRP", version (u8), flags (u8), reserved (u16), seed (2 x i64)
+//   Stream: a sequence of one-byte codes, (run << 3 | sym)
+//   Footer: ticks (u64), score (i64), checksum (u64)
+//   Index:  count (u64), followed by count x (tick (u64), offset (u64))
+//
+// Symbols 0-5 encode the input (horizDirection*2 + jump) and the run field
+// says that the same input repeats for run+1 consecutive frames. Symbol 6 is
+// a forced scroll, which in soft scroll mode is applied by the renderer in
+// between simulation frames. It is followed by the scroll distance in pixels,
+// as a LEB128 varint. Symbol 7 with run=0 marks the end of the stream.
+//
+// Symbol 7 with run=1 is a checkpoint, followed by a GAME_SNAPSHOT_SIZE game
+// snapshot. The writer emits one every REPLAY_CHECKPOINT_INTERVAL frames, and
+// the index at the end of the file lists their stream offsets. To seek, we
+// restore the nearest earlier checkpoint and simulate forward from there.
+// Version 1 files have neither checkpoints nor an index, and version 2 and 3
+// files have the shorter GAME_SNAPSHOT_SIZE_V2 and GAME_SNAPSHOT_SIZE_V3
+// snapshots.
+//
+// The checksum is computed from the game state at the end of the replay and
+// is used to detect when a playback has diverged from the original game.
+
+#define REPLAY_VERSION 4
+#define REPLAY_HEADER_SIZE 24
+#define REPLAY_FOOTER_SIZE 24
+
+#define REPLAY_FLAG_SOFTSCROLL    0x01
+#define REPLAY_FLAG_COUNTERFLOORS 0x02
+
+#define REPLAY_MAX_INPUT 5   /* Largest input symbol */
+#define REPLAY_MAX_RUN   32  /* Longest run that fits in one byte */
+
+#define REPLAY_CHECKPOINT_INTERVAL 2400 /* One minute of game time */
+
+typedef enum {
+    REPLAY_TICK,    // next simulation frame (arg = input symbol)
+    REPLAY_SCROLL,  // forced scroll (arg = distance in pixels)
+    REPLAY_END,
+} ReplayEvent;
+
+typedef struct {
+    uint8_t flags;
+    int64_t seed[2];
+} ReplayHeader;
+
+typedef struct {
+    uint64_t ticks;
+    int64_t score;
+    uint64_t checksum;
+} ReplayFooter;
+
+typedef struct {
+    FILE *file;
+    int sym;        // Input of the current run (or -1 if there is none)
+    int run;        // Length of the current run
+    uint64_t ticks;
+    uint64_t offset;    // Bytes written so far
+    uint64_t *index;    // Checkpoint (tick, offset) pairs
+    size_t nindex;
+    size_t capacity;
+    bool hasIndex;      // False once an allocation for the index failed
+} ReplayWriter;
+
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    ReplayHeader header;
+    ReplayFooter footer;
+    const uint8_t *index;   // Checkpoint (tick, offset) pairs, in the mmap
+    size_t nindex;
+    size_t snapshotSize;
+    size_t pos;     // Position of the next code in the stream
+    int sym;        // Input of the current run
+    int run;        // Remaining frames of the current run
+    uint64_t tick;  // Frames played so far
+} ReplayReader;
+
+bool replay_writer_open(ReplayWriter *w, const char *path, const ReplayHeader *header);
+void replay_write_tick(ReplayWriter *w, const Game *g);
+void replay_write_scroll(ReplayWriter *w, int distance);
+bool replay_writer_close(ReplayWriter *w, int64_t score, uint64_t checksum);
+
+bool replay_open(ReplayReader *r, const char *path);
+ReplayEvent replay_next(ReplayReader *r, int *arg);
+void replay_close(ReplayReader *r);
+
+void replay_start(const ReplayReader *r, Game *g);
+void replay_rewind(ReplayReader *r);
+bool replay_feed(ReplayReader *r, Game *g);
+bool replay_matches(const ReplayReader *r, const Game *g);
+uint64_t replay_simulate(ReplayReader *r, Game *g);
+uint64_t replay_seek(ReplayReader *r, Game *g, uint64_t tick);
+
+#endif
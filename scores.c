@@ -0,0 +1,556 @@
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#define _POSIX_C_SOURCE 200112L
+#define _DEFAULT_SOURCE // flock
+
+#include "scores.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char magic[4] = { 'X', 'J', 'H', 'S' };
+
+//
+// Little-endian encoding
+// ----------------------
+
+static void put_u64(uint8_t *buf, uint64_t x)
+{
+    for (int i = 0; i < 8; i++) {
+        buf[i] = (x >> (8*i)) & 0xff;
+    }
+}
+
+static uint64_t get_u64(const uint8_t *buf)
+{
+    uint64_t x = 0;
+    for (int i = 0; i < 8; i++) {
+        x |= ((uint64_t) buf[i]) << (8*i);
+    }
+    return x;
+}
+
+static void put_u32(uint8_t *buf, uint32_t x)
+{
+    for (int i = 0; i < 4; i++) {
+        buf[i] = (x >> (8*i)) & 0xff;
+    }
+}
+
+static uint32_t get_u32(const uint8_t *buf)
+{
+    uint32_t x = 0;
+    for (int i = 0; i < 4; i++) {
+        x |= ((uint32_t) buf[i]) << (8*i);
+    }
+    return x;
+}
+
+// FNV-1a
+static uint32_t checksum(const uint8_t *buf, size_t n)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ buf[i]) * 16777619u;
+    }
+    return h;
+}
+
+//
+// Records
+// -------
+
+static void encode_record(uint8_t *buf, const ScoreRecord *rec)
+{
+    put_u64(buf +  0, rec->score);
+    put_u64(buf +  8, rec->time);
+    put_u64(buf + 16, rec->seed[0]);
+    put_u64(buf + 24, rec->seed[1]);
+    put_u64(buf + 32, rec->ticks);
+    put_u32(buf + 40, rec->flags);
+    memcpy(buf + 44, rec->theme, SCORES_THEME_SIZE);
+    put_u32(buf + 60, checksum(buf, 60));
+}
+
+static bool decode_record(const uint8_t *buf, ScoreRecord *rec)
+{
+    if (get_u32(buf + 60) != checksum(buf, 60)) return false;
+    rec->score   = get_u64(buf +  0);
+    rec->time    = get_u64(buf +  8);
+    rec->seed[0] = get_u64(buf + 16);
+    rec->seed[1] = get_u64(buf + 24);
+    rec->ticks   = get_u64(buf + 32);
+    rec->flags   = get_u32(buf + 40);
+    memcpy(rec->theme, buf + 44, SCORES_THEME_SIZE);
+    rec->theme[SCORES_THEME_SIZE-1] = '\0';
+    return true;
+}
+
+void scores_set_theme(ScoreRecord *rec, const char *path)
+{
+    const char *name = strrchr(path, '/');
+    name = (name ? name+1 : path);
+    memset(rec->theme, 0, SCORES_THEME_SIZE);
+    strncpy(rec->theme, name, SCORES_THEME_SIZE-1);
+}
+
+static time_t end_of_day(time_t now)
+{
+    struct tm date;
+    localtime_r(&now, &date);
+    date.tm_mday += 1;
+    date.tm_hour = 0;
+    date.tm_min = 0;
+    date.tm_sec = 0;
+    date.tm_isdst = -1;
+    return mktime(&date);
+}
+
+// Updates the best scores after the given run
+void scores_merge(ScoreSummary *s, const ScoreRecord *rec)
+{
+    if (rec->score > s->best) {
+        s->best = rec->score;
+    }
+    int64_t expiration = end_of_day(rec->time);
+    if (expiration > s->expiration) {
+        s->today = rec->score;
+        s->expiration = expiration;
+    } else if (expiration == s->expiration && rec->score > s->today) {
+        s->today = rec->score;
+    }
+}
+
+//
+// Summary
+// -------
+
+static uint64_t summary_count(const ScoreLog *log)
+{
+    return get_u64(log->summary + 8);
+}
+
+static void summary_get(const ScoreLog *log, ScoreSummary *s)
+{
+    s->best       = get_u64(log->summary + 16);
+    s->today      = get_u64(log->summary + 24);
+    s->expiration = get_u64(log->summary + 32);
+}
+
+static void encode_summary(uint8_t *buf, uint64_t count, const ScoreSummary *s)
+{
+    memcpy(buf, magic, 4);
+    buf[4] = SCORES_VERSION;
+    put_u64(buf + 16, s->best);
+    put_u64(buf + 24, s->today);
+    put_u64(buf + 32, s->expiration);
+    // The count goes last, because it is what says the summary is up to date
+    put_u64(buf +  8, count);
+}
+
+//
+// Locking
+// -------
+//
+// Compaction replaces the file with a new one, so after we get the lock we
+// have to check that the file we have open is still the one at the path. If
+// it isn't, someone else compacted the log while we were waiting.
+
+static void detach(ScoreLog *log)
+{
+    if (log->summary) {
+        munmap(log->summary, SCORES_SUMMARY_SIZE);
+        log->summary = NULL;
+    }
+    if (log->fd >= 0) {
+        close(log->fd);
+        log->fd = -1;
+    }
+}
+
+static bool is_current(const ScoreLog *log)
+{
+    struct stat a, b;
+    if (0 != fstat(log->fd, &a)) return false;
+    if (0 != stat(log->path, &b)) return false;
+    return a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
+static bool recover(ScoreLog *log);
+
+// Opens the file at the path and maps its summary, creating it if needed.
+// Returns with the file locked with the given operation.
+static bool attach(ScoreLog *log, int op)
+{
+    while (1) {
+        detach(log);
+
+        log->fd = open(log->path, O_RDWR | O_CREAT, 0666);
+        if (log->fd < 0) {
+            fprintf(stderr, "Could not open score log %s. %s\n", log->path, strerror(errno));
+            return false;
+        }
+
+        // We need the exclusive lock to initialize an empty file
+        if (0 != flock(log->fd, LOCK_EX)) {
+            fprintf(stderr, "Could not lock score log %s. %s\n", log->path, strerror(errno));
+            detach(log);
+            return false;
+        }
+        if (!is_current(log)) continue;
+
+        struct stat st;
+        if (0 != fstat(log->fd, &st)) {
+            fprintf(stderr, "Could not read score log %s. %s\n", log->path, strerror(errno));
+            detach(log);
+            return false;
+        }
+
+        // A new file, or one where we crashed while creating it
+        if (st.st_size < SCORES_SUMMARY_SIZE) {
+            uint8_t buf[SCORES_SUMMARY_SIZE] = { 0 };
+            ScoreSummary empty = { 0, 0, 0 };
+            encode_summary(buf, 0, &empty);
+            if (SCORES_SUMMARY_SIZE != pwrite(log->fd, buf, SCORES_SUMMARY_SIZE, 0)) {
+                fprintf(stderr, "Could not write score log %s. %s\n", log->path, strerror(errno));
+                detach(log);
+                return false;
+            }
+        }
+
+        void *p = mmap(NULL, SCORES_SUMMARY_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, log->fd, 0);
+        if (p == MAP_FAILED) {
+            fprintf(stderr, "Could not map score log %s. %s\n", log->path, strerror(errno));
+            detach(log);
+            return false;
+        }
+        log->summary = p;
+
+        if (0 != memcmp(log->summary, magic, 4) || log->summary[4] != SCORES_VERSION) {
+            fprintf(stderr, "%s is not a score log of a supported version\n", log->path);
+            detach(log);
+            return false;
+        }
+
+        if (!recover(log)) {
+            detach(log);
+            return false;
+        }
+
+        if (op == LOCK_SH && 0 != flock(log->fd, LOCK_SH)) {
+            fprintf(stderr, "Could not lock score log %s. %s\n", log->path, strerror(errno));
+            detach(log);
+            return false;
+        }
+        return true;
+    }
+}
+
+static bool lock(ScoreLog *log, int op)
+{
+    if (log->fd < 0) {
+        return attach(log, op);
+    }
+    if (0 != flock(log->fd, op)) {
+        fprintf(stderr, "Could not lock score log %s. %s\n", log->path, strerror(errno));
+        return false;
+    }
+    if (!is_current(log)) {
+        flock(log->fd, LOCK_UN);
+        return attach(log, op);
+    }
+    return true;
+}
+
+static void unlock(ScoreLog *log)
+{
+    if (log->fd >= 0) {
+        flock(log->fd, LOCK_UN);
+    }
+}
+
+//
+// Recovery
+// --------
+
+// Reads count records starting from the first one. Returns how many of them
+// were valid; we stop at the first bad one.
+static size_t read_records(ScoreLog *log, size_t count, ScoreRecord *recs)
+{
+    uint8_t buf[SCORES_RECORD_SIZE];
+    for (size_t i = 0; i < count; i++) {
+        off_t offset = SCORES_SUMMARY_SIZE + (off_t) i * SCORES_RECORD_SIZE;
+        if (SCORES_RECORD_SIZE != pread(log->fd, buf, SCORES_RECORD_SIZE, offset)) return i;
+        if (!decode_record(buf, &recs[i])) return i;
+    }
+    return count;
+}
+
+// Must be called with the exclusive lock. Checks that the summary agrees with
+// the size of the file and, if it doesn't, drops the incomplete records at the
+// end and recomputes the summary.
+static bool recover(ScoreLog *log)
+{
+    struct stat st;
+    if (0 != fstat(log->fd, &st)) {
+        fprintf(stderr, "Could not read score log %s. %s\n", log->path, strerror(errno));
+        return false;
+    }
+
+    uint64_t count = summary_count(log);
+    if ((uint64_t) st.st_size == SCORES_SUMMARY_SIZE + count * SCORES_RECORD_SIZE) {
+        return true;
+    }
+
+    size_t n = (st.st_size - SCORES_SUMMARY_SIZE) / SCORES_RECORD_SIZE;
+    ScoreRecord *recs = malloc((n ? n : 1) * sizeof(ScoreRecord));
+    if (!recs) {
+        fprintf(stderr, "Out of memory reading score log %s\n", log->path);
+        return false;
+    }
+    n = read_records(log, n, recs);
+
+    ScoreSummary s = { 0, 0, 0 };
+    for (size_t i = 0; i < n; i++) {
+        scores_merge(&s, &recs[i]);
+    }
+    free(recs);
+
+    if (0 != ftruncate(log->fd, SCORES_SUMMARY_SIZE + (off_t) n * SCORES_RECORD_SIZE)) {
+        fprintf(stderr, "Could not repair score log %s. %s\n", log->path, strerror(errno));
+        return false;
+    }
+    encode_summary(log->summary, n, &s);
+    return true;
+}
+
+//
+// Compaction
+// ----------
+
+// Must be called with the exclusive lock. Writes the records we keep to a new
+// file and renames it over the log, so that a crash in the middle leaves the
+// old log intact.
+static bool compact(ScoreLog *log)
+{
+    size_t count = summary_count(log);
+    ScoreRecord *recs = malloc(count * sizeof(ScoreRecord));
+    if (!recs) {
+        fprintf(stderr, "Out of memory compacting score log %s\n", log->path);
+        return false;
+    }
+    count = read_records(log, count, recs);
+
+    ScoreSummary s;
+    summary_get(log, &s);
+
+    size_t keepFrom = (count > SCORES_COMPACT_KEEP ? count - SCORES_COMPACT_KEEP : 0);
+
+    size_t len = strlen(log->path);
+    char *tmpPath = malloc(len + 5);
+    if (!tmpPath) {
+        free(recs);
+        return false;
+    }
+    memcpy(tmpPath, log->path, len);
+    memcpy(tmpPath + len, ".tmp", 5);
+
+    bool ok = false;
+    FILE *f = fopen(tmpPath, "wb");
+    if (!f) {
+        fprintf(stderr, "Could not compact score log %s. %s\n", log->path, strerror(errno));
+        goto done;
+    }
+
+    // The summary is written last, once we know what it is
+    uint8_t header[SCORES_SUMMARY_SIZE] = { 0 };
+    fwrite(header, 1, SCORES_SUMMARY_SIZE, f);
+
+    // Besides the recent records, we keep the older ones that hold the best
+    // scores, in their original order, so that the summary doesn't change.
+    uint8_t buf[SCORES_RECORD_SIZE];
+    bool hasBest = false, hasToday = false;
+    size_t nkept = 0;
+    for (size_t i = keepFrom; i < count; i++) {
+        if (recs[i].score == s.best) hasBest = true;
+        if (recs[i].score == s.today && end_of_day(recs[i].time) == s.expiration) hasToday = true;
+    }
+    ScoreSummary check = { 0, 0, 0 };
+    for (size_t i = 0; i < count; i++) {
+        bool keep = (i >= keepFrom);
+        if (!keep && !hasBest && recs[i].score == s.best) {
+            keep = hasBest = true;
+        }
+        if (!keep && !hasToday && recs[i].score == s.today && end_of_day(recs[i].time) == s.expiration) {
+            keep = hasToday = true;
+        }
+        if (keep) {
+            encode_record(buf, &recs[i]);
+            fwrite(buf, 1, SCORES_RECORD_SIZE, f);
+            scores_merge(&check, &recs[i]);
+            nkept++;
+        }
+    }
+
+    encode_summary(header, nkept, &check);
+    fseek(f, 0, SEEK_SET);
+    fwrite(header, 1, SCORES_SUMMARY_SIZE, f);
+
+    if (ferror(f) || 0 != fflush(f) || 0 != fsync(fileno(f))) {
+        fprintf(stderr, "Could not compact score log %s. %s\n", log->path, strerror(errno));
+        fclose(f);
+        remove(tmpPath);
+        goto done;
+    }
+    fclose(f);
+
+    if (0 != rename(tmpPath, log->path)) {
+        fprintf(stderr, "Could not compact score log %s. %s\n", log->path, strerror(errno));
+        remove(tmpPath);
+        goto done;
+    }
+    ok = true;
+
+done:
+    free(tmpPath);
+    free(recs);
+    return ok;
+}
+
+//
+// Public interface
+// ----------------
+
+bool scores_open(ScoreLog *log, const char *path)
+{
+    log->path = strdup(path);
+    log->fd = -1;
+    log->summary = NULL;
+    if (!log->path) return false;
+
+    // Opening now, instead of when the first game ends, reports errors early
+    if (!attach(log, LOCK_SH)) {
+        scores_close(log);
+        return false;
+    }
+    unlock(log);
+    return true;
+}
+
+void scores_close(ScoreLog *log)
+{
+    detach(log);
+    free(log->path);
+    log->path = NULL;
+}
+
+static bool append_locked(ScoreLog *log, const ScoreRecord *rec)
+{
+    uint64_t count = summary_count(log);
+    uint8_t buf[SCORES_RECORD_SIZE];
+    encode_record(buf, rec);
+    off_t offset = SCORES_SUMMARY_SIZE + (off_t) count * SCORES_RECORD_SIZE;
+    if (SCORES_RECORD_SIZE != pwrite(log->fd, buf, SCORES_RECORD_SIZE, offset) ||
+        0 != fdatasync(log->fd)) {
+        fprintf(stderr, "Could not write score log %s. %s\n", log->path, strerror(errno));
+        return false;
+    }
+
+    ScoreSummary s;
+    summary_get(log, &s);
+    scores_merge(&s, rec);
+    encode_summary(log->summary, count + 1, &s);
+    return true;
+}
+
+// Adds a finished game to the log. On success, also returns the updated summary.
+bool scores_append(ScoreLog *log, const ScoreRecord *rec, ScoreSummary *out)
+{
+    if (!lock(log, LOCK_EX)) return false;
+    bool ok = recover(log) && append_locked(log, rec);
+    if (ok) {
+        summary_get(log, out);
+        if (summary_count(log) >= SCORES_COMPACT_THRESHOLD && compact(log)) {
+            // Our file isn't the log anymore
+            detach(log);
+            return true;
+        }
+    }
+    unlock(log);
+    return ok;
+}
+
+bool scores_summary(ScoreLog *log, ScoreSummary *out)
+{
+    if (!lock(log, LOCK_SH)) return false;
+    summary_get(log, out);
+    unlock(log);
+    return true;
+}
+
+// Returns all the records in the log, oldest first. The caller frees them.
+bool scores_history(ScoreLog *log, ScoreRecord **recs, size_t *n)
+{
+    if (!lock(log, LOCK_SH)) return false;
+    size_t count = summary_count(log);
+    *recs = malloc((count ? count : 1) * sizeof(ScoreRecord));
+    if (!*recs) {
+        unlock(log);
+        return false;
+    }
+    *n = read_records(log, count, *recs);
+    unlock(log);
+    return true;
+}
+
+// Carries over the best scores from the text file used by older versions,
+// if the log is still empty.
+bool scores_import(ScoreLog *log, const char *oldPath)
+{
+    FILE *f = fopen(oldPath, "r");
+    if (!f) return false;
+
+    int64_t best = 0, today = 0, expiration = 0;
+    int nread = fscanf(f, "best %ld\ntoday %ld %ld\n", &best, &today, &expiration);
+    fclose(f);
+    if (nread < 1) return false;
+
+    if (!lock(log, LOCK_EX)) return false;
+    bool ok = true;
+    if (summary_count(log) == 0) {
+        ScoreRecord rec = { 0 };
+        rec.flags = SCORES_FLAG_IMPORTED;
+        if (best > 0) {
+            rec.score = best;
+            rec.time = 0; // Unknown
+            ok = ok && append_locked(log, &rec);
+        }
+        if (nread == 3 && today > 0) {
+            rec.score = today;
+            rec.time = expiration - 1; // Sometime during that day
+            ok = ok && append_locked(log, &rec);
+        }
+    }
+    unlock(log);
+    return ok;
+}
@@ -0,0 +1,94 @@
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef XJUMP_SCORES_H
+#define XJUMP_SCORES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+//
+// Score log
+// ---------
+//
+// Every finished game is appended to a binary log, so that we keep the full
+// history of runs instead of only the best scores. The file starts with a
+// summary that caches the best scores; it is mapped into memory, so looking
+// them up doesn't need to read the log. Everything is little-endian:
+//
+//   Summary: "XJHS", version (u8), reserved (3 bytes), count (u64),
+//            best (i64), today (i64), expiration (i64), reserved (24 bytes)
+//   Records: count x (score (i64), time (i64), seed (2 x i64), ticks (u64),
+//            flags (u32), theme (16 bytes), checksum (u32))
+//
+// The seed is the RNG state at the start of the game, in the format of the
+// --seed option, and the flags are the REPLAY_FLAG_* of the game, plus
+// SCORES_FLAG_IMPORTED for the scores carried over from the old text file,
+// which only had the best scores and their dates. The theme is the file name
+// of the sprite sheet, truncated and NUL-padded. The checksum covers the rest
+// of the record.
+//
+// A record is written before the summary is updated. If we crash in between,
+// or in the middle of the record, the count in the summary won't match the
+// size of the file; the next time the log is opened we drop the incomplete
+// record and recompute the summary from the log. When the log gets too big it
+// is compacted into a new file, keeping the most recent runs and the records
+// that hold the best scores. Concurrent games coordinate with flock.
+
+#define SCORES_VERSION 1
+#define SCORES_SUMMARY_SIZE 64
+#define SCORES_RECORD_SIZE  64
+#define SCORES_THEME_SIZE   16
+
+#define SCORES_FLAG_IMPORTED 0x80
+
+#define SCORES_COMPACT_THRESHOLD 65536 /* Records, about 4 MB */
+#define SCORES_COMPACT_KEEP      16384 /* Most recent records kept */
+
+typedef struct {
+    int64_t score;
+    int64_t time;
+    int64_t seed[2];
+    uint64_t ticks;
+    uint32_t flags;
+    char theme[SCORES_THEME_SIZE];
+} ScoreRecord;
+
+typedef struct {
+    int64_t best;
+    int64_t today;
+    int64_t expiration; // When "today" stops being today
+} ScoreSummary;
+
+typedef struct {
+    char *path;
+    int fd;
+    uint8_t *summary;   // Mapped summary of the file that is open
+} ScoreLog;
+
+bool scores_open(ScoreLog *log, const char *path);
+void scores_close(ScoreLog *log);
+
+bool scores_append(ScoreLog *log, const ScoreRecord *rec, ScoreSummary *out);
+bool scores_summary(ScoreLog *log, ScoreSummary *out);
+bool scores_history(ScoreLog *log, ScoreRecord **recs, size_t *n);
+bool scores_import(ScoreLog *log, const char *oldPath);
+
+void scores_merge(ScoreSummary *s, const ScoreRecord *rec);
+void scores_set_theme(ScoreRecord *rec, const char *path);
+
+#endif
@@ -0,0 +1,333 @@
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// xjump-seedsearch: looks for seeds whose towers satisfy some criteria.
+//
+// The candidate seeds are consecutive draws from a master PCG stream: the
+// i-th candidate is made of the outputs 4i to 4i+3. Each worker grabs a chunk
+// of candidates and uses pcg32_advance to jump straight to the start of its
+// chunk, so the index range can be split across any number of threads.
+//
+// Matching seeds are printed as soon as they are found. They can be passed to
+// xjump with --seed (and the same --floors mode).
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <dlfcn.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "game.h"
+
+#define CHUNK_SIZE 4096
+
+// Signature of the user-supplied predicate. The floors array holds the floors
+// number 0 to nfloors-1, as returned by get_floor. Floors that are not solid
+// have left > right. Should return nonzero to accept the seed.
+typedef int (*SeedFilter)(const Floor *floors, int nfloors);
+
+//
+// Configuration
+// -------------
+
+static FloorGenerator floorGenerator = FLOORGEN_CLASSIC;
+static uint64_t base = 0;
+static uint64_t first = 0;
+static uint64_t count = 1000000;
+static int depth = 500;
+static int minStreak = 0;
+static int minGap = 0;
+static int minWallJumps = 0;
+static SeedFilter plugin = NULL;
+
+//
+// Tower statistics
+// ----------------
+
+typedef struct {
+    int streak;     // Longest run of floors shifting towards the same side
+    int gap;        // Largest horizontal distance between consecutive floors
+    int wallJumps;  // Switches between floors touching the left and right walls
+} Stats;
+
+static bool isSolid(const Floor *f)
+{
+    return f->left <= f->right;
+}
+
+static void compute_stats(const Floor *floors, int n, Stats *st)
+{
+    st->streak = 0;
+    st->gap = 0;
+    st->wallJumps = 0;
+
+    const Floor *prev = NULL;
+    int dir = 0, run = 0;
+    int wall = 0;
+    for (int i = 0; i < n; i++) {
+        const Floor *f = &floors[i];
+        if (!isSolid(f)) continue;
+
+        bool isWide = (f->left == 1 && f->right == FIELD_W-2);
+        if (!isWide) {
+            int side = (f->left <= 2 ? -1 : f->right >= FIELD_W-3 ? +1 : 0);
+            if (side != 0) {
+                if (wall != 0 && side != wall) st->wallJumps++;
+                wall = side;
+            }
+        }
+
+        if (isWide || !prev) {
+            prev = (isWide ? NULL : f);
+            dir = 0;
+            run = 0;
+            continue;
+        }
+
+        int d = (f->left + f->right) - (prev->left + prev->right);
+        int newDir = (d > 0) - (d < 0);
+        run = (newDir != 0 && newDir == dir ? run + 1 : 1);
+        dir = newDir;
+        if (run > st->streak) st->streak = run;
+
+        int gapL = prev->left - f->right - 1;
+        int gapR = f->left - prev->right - 1;
+        int gap = (gapL > gapR ? gapL : gapR);
+        if (gap > st->gap) st->gap = gap;
+
+        prev = f;
+    }
+}
+
+static bool accept(const Floor *floors, const Stats *st)
+{
+    return st->streak >= minStreak
+        && st->gap >= minGap
+        && st->wallJumps >= minWallJumps
+        && (!plugin || plugin(floors, depth));
+}
+
+//
+// Search
+// ------
+
+static atomic_uint_fast64_t nextChunk = 0;
+static atomic_uint_fast64_t matches = 0;
+static pthread_mutex_t outputLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void master_init(Pcg32 *master)
+{
+    const int64_t seed[2] = { base, 0 };
+    pcg32_init(master, seed);
+}
+
+static uint64_t next_u64(Pcg32 *rng)
+{
+    uint64_t hi = pcg32_next(rng);
+    uint64_t lo = pcg32_next(rng);
+    return hi << 32 | lo;
+}
+
+static void *worker_main(void *arg)
+{
+    (void) arg;
+
+    Floor *floors = malloc(depth * sizeof(Floor));
+    if (!floors) { perror("malloc"); exit(1); }
+
+    Game g;
+    g.isSoftScroll = true;
+    g.floorGenerator = floorGenerator;
+
+    uint64_t nchunks = (count + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    uint64_t chunk;
+    while ((chunk = atomic_fetch_add(&nextChunk, 1)) < nchunks) {
+        uint64_t lo = first + chunk * CHUNK_SIZE;
+        uint64_t hi = lo + CHUNK_SIZE;
+        if (hi > first + count) hi = first + count;
+
+        Pcg32 master;
+        master_init(&master);
+        pcg32_advance(&master, 4*lo);
+
+        for (uint64_t i = lo; i < hi; i++) {
+            int64_t seed[2];
+            seed[0] = next_u64(&master);
+            seed[1] = next_u64(&master);
+
+            pcg32_init(&g.rng, seed);
+            init_game(&g);
+            for (int n = 0; n < depth; n++) {
+                while (g.next_floor <= n) generate_floor(&g);
+                floors[n] = *get_floor(&g, n);
+            }
+
+            Stats st;
+            compute_stats(floors, depth, &st);
+            if (accept(floors, &st)) {
+                atomic_fetch_add(&matches, 1);
+                pthread_mutex_lock(&outputLock);
+                printf("%" PRIu64 "\t0x%016" PRIx64 ":0x%016" PRIx64 "\t%d\t%d\t%d\n",
+                       i, (uint64_t) seed[0], (uint64_t) seed[1],
+                       st.streak, st.gap, st.wallJumps);
+                fflush(stdout);
+                pthread_mutex_unlock(&outputLock);
+            }
+        }
+    }
+
+    free(floors);
+    return NULL;
+}
+
+//
+// Main
+// ----
+
+static void print_usage(const char *progname)
+{
+    printf("Usage: %s [OPTIONS]\n"
+           "Searches for xjump seeds whose towers satisfy all the given criteria.\n"
+           "Prints one line per match: index, seed, streak, gap and wall jumps.\n"
+           "\n"
+           "  -h --help             show this help message and exit\n"
+           "  -j --threads N        number of worker threads (default: number of cores)\n"
+           "     --floors MODE      floor generator: classic (default) or counter\n"
+           "     --base N           seed of the master stream of candidates (default: 0)\n"
+           "     --first N          index of the first candidate (default: 0)\n"
+           "     --count N          number of candidates to check (default: 1000000)\n"
+           "     --depth K          check the floors below K (default: 500)\n"
+           "     --min-streak N     N floors in a row shifting towards the same side\n"
+           "     --min-gap N        consecutive floors at least N tiles apart\n"
+           "     --min-wall-jumps N go from one wall to the other at least N times\n"
+           "     --plugin LIB.so    also require xjump_seed_filter(floors, K) from LIB.so\n",
+           progname);
+}
+
+static uint64_t parse_number(const char *progname, const char *s)
+{
+    char *end;
+    uint64_t x = strtoull(s, &end, 0);
+    if (*s == '\0' || *end != '\0') {
+        fprintf(stderr, "%s: invalid number '%s'\n", progname, s);
+        exit(1);
+    }
+    return x;
+}
+
+static double monotonic_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+    static struct option long_options[] = {
+        {"help",           no_argument,       0, 'h'},
+        {"threads",        required_argument, 0, 'j'},
+        {"floors",         required_argument, 0, 'f'},
+        {"base",           required_argument, 0, 'b'},
+        {"first",          required_argument, 0, 'i'},
+        {"count",          required_argument, 0, 'n'},
+        {"depth",          required_argument, 0, 'k'},
+        {"min-streak",     required_argument, 0, 's'},
+        {"min-gap",        required_argument, 0, 'g'},
+        {"min-wall-jumps", required_argument, 0, 'w'},
+        {"plugin",         required_argument, 0, 'p'},
+        {0, 0, 0, 0}
+    };
+
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *pluginPath = NULL;
+
+    while (1) {
+        int c = getopt_long(argc, argv, "hj:", long_options, NULL);
+        if (c == -1) break;
+        switch (c) {
+            case 'h':
+                print_usage(argv[0]);
+                exit(0);
+
+            case 'j': nthreads     = parse_number(argv[0], optarg); break;
+            case 'b': base         = parse_number(argv[0], optarg); break;
+            case 'i': first        = parse_number(argv[0], optarg); break;
+            case 'n': count        = parse_number(argv[0], optarg); break;
+            case 'k': depth        = parse_number(argv[0], optarg); break;
+            case 's': minStreak    = parse_number(argv[0], optarg); break;
+            case 'g': minGap       = parse_number(argv[0], optarg); break;
+            case 'w': minWallJumps = parse_number(argv[0], optarg); break;
+            case 'p': pluginPath   = optarg; break;
+
+            case 'f':
+                if (0 == strcmp(optarg, "classic")) {
+                    floorGenerator = FLOORGEN_CLASSIC;
+                } else if (0 == strcmp(optarg, "counter")) {
+                    floorGenerator = FLOORGEN_COUNTER;
+                } else {
+                    fprintf(stderr, "%s: unknown floor generator '%s'\n", argv[0], optarg);
+                    exit(1);
+                }
+                break;
+
+            default:
+                exit(1);
+        }
+    }
+
+    if (depth < 1) depth = 1;
+    if (nthreads < 1) nthreads = 1;
+
+    if (pluginPath) {
+        void *lib = dlopen(pluginPath, RTLD_NOW);
+        if (!lib) {
+            fprintf(stderr, "%s: %s\n", argv[0], dlerror());
+            exit(1);
+        }
+        *(void **) &plugin = dlsym(lib, "xjump_seed_filter");
+        if (!plugin) {
+            fprintf(stderr, "%s: %s\n", argv[0], dlerror());
+            exit(1);
+        }
+    }
+
+    double startTime = monotonic_seconds();
+
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    for (long i = 0; i < nthreads; i++) {
+        if (0 != pthread_create(&threads[i], NULL, worker_main, NULL)) {
+            perror("Could not create thread");
+            exit(1);
+        }
+    }
+    for (long i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    double elapsed = monotonic_seconds() - startTime;
+    fprintf(stderr, "%" PRIu64 " seeds checked, %" PRIu64 " matches, %.0f seeds/s\n",
+            count, (uint64_t) atomic_load(&matches), (elapsed > 0 ? count / elapsed : 0.0));
+
+    return 0;
+}
@@ -0,0 +1,428 @@
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// xjump-soak: plays one very long game with a bot, checking the invariants of
+// the simulation after every frame. Run it with "make soak".
+//
+// The bot plans each jump by trying about ninety run-ups and jumps on copies
+// of the game, and takes the one that lands highest on the screen among those
+// that leave it room for LOOKAHEAD more jumps. That is enough to keep up with
+// the scroll at full speed, so a game can go on for as long as we want. If it
+// dies anyway, it starts a new game on the floor where it died, with the next
+// seed. With --start-floor, the tower starts that high up, for example just
+// below INT32_MAX, to test the 64-bit floor numbers.
+//
+// After each frame we check the physics state, the floor buffer and each new
+// floor, and once in a while that a snapshot loads back to the same game. The
+// first violation is printed and the program exits with status 1. The output
+// is one tab-separated line per --interval seconds:
+//
+//   seconds  ticks  ticks/s  steps/s  floor  score  deaths
+//
+// Ticks are frames of the real game, and steps are all the calls to xj_step,
+// including the ones made by the planner. Lines starting with # are comments.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "core.h"
+#include "game.h"
+
+#define MAX_PLAN 160          /* Longest move the planner considers, in frames */
+#define MAX_RUNUP 14          /* Longest run-up before a jump, in frames */
+#define LOOKAHEAD 3           /* Moves after the next one that must be possible */
+#define SNAPSHOT_INTERVAL 4096
+
+//
+// Configuration
+// -------------
+
+static bool isSoftScroll = true;
+static FloorGenerator floorGenerator = FLOORGEN_CLASSIC;
+static int64_t ticks = 10000000;
+static int64_t startFloor = 0;
+static int64_t seed = 0;
+static double interval = 1.0;
+
+// Counters for the report
+static int64_t nsteps = 0;
+static int64_t ndeaths = 0;
+
+static double monotonic_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+//
+// Bot
+// ---
+
+typedef struct {
+    int length;
+    int actions[MAX_PLAN];
+} Plan;
+
+// The moves that the planner considers: stand or run left or right for a few
+// frames, then jump and steer left, right or neither.
+typedef struct {
+    int runDir, runup, airDir;
+} Move;
+
+static int64_t landing_floor(const Game *g)
+{
+    return g->floorOffset - (g->y + R)/S;
+}
+
+// Plays a move on a copy of the game. Holds the jump button until the
+// hero starts to fall, so that it doesn't jump again as soon as it lands.
+// Returns false if the hero dies or doesn't land in time.
+static bool try_move(const XjCore *ctx, const Move *m, Plan *plan, XjCore *end)
+{
+    *end = *ctx;
+    bool isAirborne = false;
+    plan->length = 0;
+    while (plan->length < MAX_PLAN) {
+        int action;
+        if (plan->length < m->runup) {
+            action = m->runDir;
+        } else if (plan->length == m->runup || end->game.vy < 0) {
+            action = m->airDir | XJ_ACTION_JUMP;
+        } else {
+            action = m->airDir;
+        }
+        plan->actions[plan->length++] = action;
+        nsteps++;
+        if (xj_step(end, action)) return false;
+
+        if (!end->game.isStanding) {
+            isAirborne = true;
+        } else if (isAirborne) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#define NMOVES (3 + 2*3*(MAX_RUNUP + 1))
+
+static int list_moves(Move moves[NMOVES])
+{
+    static const int dirs[] = { 0, XJ_ACTION_LEFT, XJ_ACTION_RIGHT };
+    int n = 0;
+    for (int r = 0; r < 3; r++) {
+        for (int runup = 0; runup <= MAX_RUNUP; runup++) {
+            if (r == 0 && runup > 0) break;
+            for (int a = 0; a < 3; a++) {
+                moves[n++] = (Move) { dirs[r], runup, dirs[a] };
+            }
+        }
+    }
+    return n;
+}
+
+// Whether the hero can make depth more moves from here without dying
+static bool can_survive(const XjCore *ctx, const Move *moves, int nmoves, int depth)
+{
+    if (depth == 0) return true;
+    Plan plan;
+    XjCore end;
+    for (int i = 0; i < nmoves; i++) {
+        if (try_move(ctx, &moves[i], &plan, &end) &&
+                can_survive(&end, moves, nmoves, depth - 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Picks the move that lands highest on the screen, among the ones that leave
+// the hero somewhere it can jump again from. A greedy choice without that
+// check often lands on a floor that the scroll takes away before the hero
+// can reach the next one. If every move dies, the plan is to stand still.
+static void plan_move(const XjCore *ctx, Plan *best)
+{
+    static Move moves[NMOVES];
+    static Plan plans[NMOVES];
+    static XjCore ends[NMOVES];
+    static int heights[NMOVES];
+    int nmoves = list_moves(moves);
+
+    int n = 0;
+    for (int i = 0; i < nmoves; i++) {
+        if (try_move(ctx, &moves[i], &plans[n], &ends[n])) {
+            heights[n] = -(ends[n].game.y + ends[n].game.forcedScroll);
+            n++;
+        }
+    }
+
+    best->length = 1;
+    best->actions[0] = 0;
+
+    bool isChecked[NMOVES] = { false };
+    for (int k = 0; k < n; k++) {
+        int j = -1;
+        for (int i = 0; i < n; i++) {
+            if (isChecked[i]) continue;
+            if (j < 0 || heights[i] > heights[j] ||
+                    (heights[i] == heights[j] && plans[i].length < plans[j].length)) {
+                j = i;
+            }
+        }
+        isChecked[j] = true;
+        if (k == 0) *best = plans[j];  // In case none of them has a follow-up
+        if (can_survive(&ends[j], moves, nmoves, LOOKAHEAD)) {
+            *best = plans[j];
+            return;
+        }
+    }
+}
+
+//
+// Invariants
+// ----------
+
+static void fail(const XjCore *ctx, const char *what)
+{
+    const Game *g = &ctx->game;
+    fprintf(stderr,
+        "xjump-soak: %s, at tick %" PRId64 "\n"
+        "  floorOffset %" PRId64 ", next_floor %" PRId64 ", score %" PRId64 "\n"
+        "  x %d, y %d, vx %d, vy %d, jump %d, scroll %d/%d, forced %d\n",
+        what, ctx->ticks, g->floorOffset, g->next_floor, g->score,
+        g->x, g->y, g->vx, g->vy, g->jump, g->scrollCount, g->scrollSpeed, g->forcedScroll);
+    exit(1);
+}
+
+static void check_floor(const XjCore *ctx, int64_t n)
+{
+    const Game *g = &ctx->game;
+    const Floor *f = get_floor(g, n);
+    if (n % 250 == 0) {
+        if (f->left != 1 || f->right != FIELD_W - 2) fail(ctx, "floor multiple of 250 is not wide");
+    } else if (n % 5 == 0) {
+        if (f->left < 1 || f->right > FIELD_W - 2) fail(ctx, "floor goes into the walls");
+        int width = f->right - f->left + 1;
+        if (width < 5 || width > 9) fail(ctx, "floor is not 5 to 9 tiles wide");
+    } else {
+        if (f->left <= f->right) fail(ctx, "floor between the platform rows");
+    }
+
+    if (g->floorGenerator == FLOORGEN_COUNTER) {
+        Floor c = compute_floor(g, n);
+        if (c.left != f->left || c.right != f->right) fail(ctx, "compute_floor disagrees with generate_floor");
+    }
+}
+
+// The state before the step is in prev
+static void check_step(const XjCore *prev, const XjCore *ctx)
+{
+    const Game *g = &ctx->game;
+    const Game *p = &prev->game;
+
+    if (g->x < leftLimit || g->x > rightLimit) fail(ctx, "hero went through a wall");
+    if (g->vx < -32 || g->vx > 32) fail(ctx, "horizontal speed out of range");
+    if (g->vy < -(32/4 + 7)/2 - 12 || g->vy > 16) fail(ctx, "vertical speed out of range");
+    if (g->jump < 0 || g->jump > 32/4 + 7) fail(ctx, "jump out of range");
+    if (g->isStanding && g->y % S != 0) fail(ctx, "standing between rows");
+
+    if (g->scrollSpeed < 0 || g->scrollSpeed > MAX_SCROLL_SPEED) fail(ctx, "scroll speed out of range");
+    if (g->scrollCount < 0 || g->scrollCount > SCROLL_THRESHOLD) fail(ctx, "scroll count out of range");
+    if (g->forcedScroll < 0 || g->forcedScroll >= S) fail(ctx, "forced scroll out of range");
+
+    if (g->floorOffset < p->floorOffset) fail(ctx, "the screen scrolled down");
+    if (g->score < p->score) fail(ctx, "the score went down");
+    if (g->score > (g->floorOffset + FIELD_EXTRA)/5) fail(ctx, "score above the top of the screen");
+
+    // The buffer holds the floors from the bottom row of the screen up
+    if (g->next_floor - NFLOORS != g->floorOffset - (FIELD_H - 1)) fail(ctx, "floor buffer out of step with the screen");
+
+    for (int64_t n = p->next_floor; n < g->next_floor; n++) {
+        check_floor(ctx, n);
+    }
+}
+
+static void check_snapshot(const XjCore *ctx)
+{
+    static uint8_t buf[GAME_SNAPSHOT_SIZE];
+    Game copy;
+    memset(&copy, 0, sizeof(copy));
+    game_save(&ctx->game, buf);
+    game_load(&copy, buf, sizeof(buf));
+    if (game_checksum(&copy) != game_checksum(&ctx->game)) fail(ctx, "snapshot doesn't load back to the same game");
+}
+
+//
+// Main
+// ----
+
+// Starts the tower at floor base instead of 0, as if the hero had climbed
+// that far. The base must be a multiple of 250, so that the hero still
+// starts on a wide floor.
+static void start_game(XjCore *ctx, int64_t base)
+{
+    int64_t s[2] = { seed, ndeaths };
+    xj_reset(ctx, s);
+    if (base == 0) return;
+
+    Game *g = &ctx->game;
+    g->floorOffset += base;
+    g->next_floor = g->floorOffset - (FIELD_H - 1);
+    for (int i = 0; i < NFLOORS; i++) {
+        generate_floor(g);
+    }
+    for (int64_t n = g->next_floor - NFLOORS; n < g->next_floor; n++) {
+        check_floor(ctx, n);
+    }
+}
+
+static void print_usage(const char *progname)
+{
+    printf("Usage: %s [OPTIONS]\n"
+           "Plays a very long game of xjump with a bot and checks the simulation as it goes.\n"
+           "\n"
+           "  -h --help            show this help message and exit\n"
+           "  -n --ticks N         number of frames to play (default: 10000000)\n"
+           "     --start-floor N   start the tower at floor N, rounded down to a multiple of 250\n"
+           "     --seed N          seed of the first game (default: 0)\n"
+           "     --interval SEC    seconds between report lines (default: 1)\n"
+           "     --hard-scroll     use the hard scroll mode\n"
+           "     --floors MODE     floor generator: classic (default) or counter\n",
+           progname);
+}
+
+static int64_t parse_number(const char *progname, const char *s)
+{
+    char *end;
+    int64_t x = strtoll(s, &end, 0);
+    if (*s == '\0' || *end != '\0' || x < 0) {
+        fprintf(stderr, "%s: invalid number '%s'\n", progname, s);
+        exit(1);
+    }
+    return x;
+}
+
+int main(int argc, char **argv)
+{
+    static struct option long_options[] = {
+        {"help",        no_argument,       0, 'h'},
+        {"ticks",       required_argument, 0, 'n'},
+        {"start-floor", required_argument, 0, 'F'},
+        {"seed",        required_argument, 0, 's'},
+        {"interval",    required_argument, 0, 'i'},
+        {"hard-scroll", no_argument,       0, 'H'},
+        {"floors",      required_argument, 0, 'f'},
+        {0, 0, 0, 0}
+    };
+
+    while (1) {
+        int c = getopt_long(argc, argv, "hn:", long_options, NULL);
+        if (c == -1) break;
+        switch (c) {
+            case 'h':
+                print_usage(argv[0]);
+                exit(0);
+
+            case 'n': ticks      = parse_number(argv[0], optarg); break;
+            case 'F': startFloor = parse_number(argv[0], optarg); break;
+            case 's': seed       = parse_number(argv[0], optarg); break;
+            case 'H': isSoftScroll = false; break;
+
+            case 'i':
+                interval = atof(optarg);
+                if (!(interval > 0)) {
+                    fprintf(stderr, "%s: invalid interval '%s'\n", argv[0], optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'f':
+                if (0 == strcmp(optarg, "classic")) {
+                    floorGenerator = FLOORGEN_CLASSIC;
+                } else if (0 == strcmp(optarg, "counter")) {
+                    floorGenerator = FLOORGEN_COUNTER;
+                } else {
+                    fprintf(stderr, "%s: unknown floor generator '%s'\n", argv[0], optarg);
+                    exit(1);
+                }
+                break;
+
+            default:
+                exit(1);
+        }
+    }
+
+    XjCore ctx;
+    xj_init(&ctx, isSoftScroll, floorGenerator);
+    start_game(&ctx, startFloor - startFloor % 250);
+
+    printf("# %s scroll, %s floors, seed %" PRId64 ", from floor %" PRId64 "\n",
+        (isSoftScroll ? "soft" : "hard"),
+        (floorGenerator == FLOORGEN_COUNTER ? "counter" : "classic"),
+        seed, startFloor - startFloor % 250);
+    printf("# seconds\tticks\tticks/s\tsteps/s\tfloor\tscore\tdeaths\n");
+    fflush(stdout);
+
+    double startTime = monotonic_seconds();
+    double lastTime = startTime;
+    int64_t lastTicks = 0, lastSteps = 0;
+
+    Plan plan = { 0 };
+    int next = 0;
+    for (int64_t t = 1; t <= ticks; t++) {
+        if (next == plan.length) {
+            plan_move(&ctx, &plan);
+            next = 0;
+        }
+
+        XjCore prev = ctx;
+        nsteps++;
+        if (xj_step(&ctx, plan.actions[next++])) {
+            ndeaths++;
+            start_game(&ctx, landing_floor(&prev.game) / 250 * 250);
+            plan.length = next = 0;
+            continue;
+        }
+        check_step(&prev, &ctx);
+
+        if (t % SNAPSHOT_INTERVAL == 0) {
+            check_snapshot(&ctx);
+        }
+
+        if (t % 1024 == 0 || t == ticks) {
+            double now = monotonic_seconds();
+            if (now - lastTime >= interval || t == ticks) {
+                double dt = now - lastTime;
+                printf("%.1f\t%" PRId64 "\t%.0f\t%.0f\t%" PRId64 "\t%" PRId64 "\t%" PRId64 "\n",
+                    now - startTime, t, (t - lastTicks) / dt, (nsteps - lastSteps) / dt,
+                    ctx.game.floorOffset, ctx.game.score, ndeaths);
+                fflush(stdout);
+                lastTime = now;
+                lastTicks = t;
+                lastSteps = nsteps;
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,191 @@
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "themewatch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "render.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+static char *filePath;
+static char *fileName;  // The last component of filePath
+static void (*notifyFn)(void);
+
+static int inotifyFd = -1;
+static int quitPipe[2] = { -1, -1 };
+
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static bool isRunning;
+
+static SDL_Surface *pending; // Decoded, but not swapped in yet
+
+// Reads the queued events and tells whether any of them is about our file
+static bool read_events()
+{
+    _Alignas(struct inotify_event) char buf[4096];
+    bool found = false;
+    while (1) {
+        ssize_t n = read(inotifyFd, buf, sizeof(buf));
+        if (n <= 0) break;
+        for (char *p = buf; p < buf + n; ) {
+            const struct inotify_event *ev = (const struct inotify_event *) p;
+            if (ev->len > 0 && 0 == strcmp(ev->name, fileName)) found = true;
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    return found;
+}
+
+// Waits for the inotify descriptor. Returns false if we should quit.
+static bool wait_events(int timeout, bool *ready)
+{
+    struct pollfd fds[2] = {
+        { inotifyFd,   POLLIN, 0 },
+        { quitPipe[0], POLLIN, 0 },
+    };
+    int r = poll(fds, 2, timeout);
+    if (r < 0 && errno != EINTR) return false;
+    if (r > 0 && fds[1].revents) return false;
+    *ready = (r > 0 && fds[0].revents);
+    return true;
+}
+
+static void *worker(void *unused)
+{
+    (void) unused;
+    while (1) {
+        bool ready;
+        if (!wait_events(-1, &ready)) break;
+        if (!ready || !read_events()) continue;
+
+        // Wait until the file stops changing
+        bool quit = false;
+        while (1) {
+            if (!wait_events(THEMEWATCH_SETTLE_MS, &ready)) { quit = true; break; }
+            if (!ready) break;
+            read_events();
+        }
+        if (quit) break;
+
+        // Decoding doesn't touch the renderer, so it is safe to do it here.
+        // We read the file itself, even when the data is embedded.
+        SDL_Surface *surface = checkThemeSurface(SDL_LoadBMP(filePath));
+        if (!surface) continue;
+
+        pthread_mutex_lock(&lock);
+        if (pending) SDL_FreeSurface(pending);
+        pending = surface;
+        pthread_mutex_unlock(&lock);
+        if (notifyFn) notifyFn();
+    }
+    return NULL;
+}
+
+// The notify function is called from the worker thread when there is a new
+// theme for themewatch_poll.
+bool themewatch_start(const char *path, void (*notify)(void))
+{
+    filePath = strdup(path);
+    if (!filePath) return false;
+    char *slash = strrchr(filePath, '/');
+    fileName = (slash ? slash + 1 : filePath);
+
+    // The directory part, or "." if there isn't one
+    char *dir = (slash ? strndup(filePath, slash - filePath) : strdup("."));
+    if (dir && dir[0] == '\0') { free(dir); dir = strdup("/"); }
+
+    inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotifyFd < 0 || !dir ||
+            inotify_add_watch(inotifyFd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+        fprintf(stderr, "Could not watch the theme file %s: %s\n", path, strerror(errno));
+        goto fail;
+    }
+    if (0 != pipe(quitPipe)) {
+        perror("pipe");
+        goto fail;
+    }
+    notifyFn = notify;
+    if (0 != pthread_create(&thread, NULL, worker, NULL)) {
+        fprintf(stderr, "Could not start theme watcher thread\n");
+        goto fail;
+    }
+    free(dir);
+    isRunning = true;
+    return true;
+
+fail:
+    free(dir);
+    themewatch_stop();
+    return false;
+}
+
+// Returns the new theme, if the file changed since the last call. The caller
+// owns the surface.
+SDL_Surface *themewatch_poll()
+{
+    if (!isRunning) return NULL;
+    pthread_mutex_lock(&lock);
+    SDL_Surface *surface = pending;
+    pending = NULL;
+    pthread_mutex_unlock(&lock);
+    return surface;
+}
+
+void themewatch_stop()
+{
+    if (isRunning) {
+        if (1 != write(quitPipe[1], "q", 1)) perror("write");
+        pthread_join(thread, NULL);
+        isRunning = false;
+    }
+    if (pending) SDL_FreeSurface(pending);
+    pending = NULL;
+    for (int i = 0; i < 2; i++) {
+        if (quitPipe[i] >= 0) close(quitPipe[i]);
+        quitPipe[i] = -1;
+    }
+    if (inotifyFd >= 0) close(inotifyFd);
+    inotifyFd = -1;
+    free(filePath);
+    filePath = fileName = NULL;
+}
+
+#else
+
+// Without inotify, there is nothing to watch with
+bool themewatch_start(const char *path, void (*notify)(void))
+{
+    (void) notify;
+    fprintf(stderr, "Watching the theme file %s is only supported on Linux\n", path);
+    return false;
+}
+
+SDL_Surface *themewatch_poll() { return NULL; }
+void themewatch_stop() { }
+
+#endif
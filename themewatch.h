@@ -0,0 +1,43 @@
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef XJUMP_THEMEWATCH_H
+#define XJUMP_THEMEWATCH_H
+
+#include <stdbool.h>
+
+#include <SDL.h>
+
+//
+// Theme hot-reload
+// ----------------
+//
+// Watches the theme file with inotify, from a background thread, so that the
+// theme can be edited while the game is running. When the file changes, the
+// thread decodes and checks the new spritesheet, and the main thread swaps it
+// in between frames with themewatch_poll and screen_set_theme.
+//
+// We watch the directory instead of the file itself, because many editors
+// save by writing a new file and renaming it over the old one. Changes that
+// come close together are handled as one, so that we don't decode a file that
+// is still being written.
+
+#define THEMEWATCH_SETTLE_MS 100
+
+bool themewatch_start(const char *path, void (*notify)(void));
+SDL_Surface *themewatch_poll();
+void themewatch_stop();
+
+#endif
@@ -0,0 +1,261 @@
+// Copyright 2015-2021 Hugo Gualandi
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// xjump-verify: re-simulates a batch of replay files in parallel and checks
+// that each one reproduces the score and the checksum that it recorded.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "game.h"
+#include "replay.h"
+
+//
+// Task list
+// ---------
+
+typedef enum {
+    RESULT_PASS,
+    RESULT_FAIL,
+    RESULT_ERROR,
+} Result;
+
+static char **paths = NULL;
+static size_t npaths = 0;
+static size_t capacity = 0;
+
+static void add_path(char *path)
+{
+    if (npaths == capacity) {
+        capacity = (capacity ? 2*capacity : 256);
+        paths = realloc(paths, capacity * sizeof(char *));
+        if (!paths) { perror("realloc"); exit(1); }
+    }
+    paths[npaths++] = path;
+}
+
+static void add_argument(const char *arg)
+{
+    struct stat st;
+    if (0 != stat(arg, &st)) {
+        fprintf(stderr, "%s: %s\n", arg, strerror(errno));
+        exit(1);
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+        add_path(strdup(arg));
+        return;
+    }
+
+    DIR *dir = opendir(arg);
+    if (!dir) {
+        fprintf(stderr, "%s: %s\n", arg, strerror(errno));
+        exit(1);
+    }
+    struct dirent *ent;
+    while ((ent = readdir(dir))) {
+        if (ent->d_name[0] == '.') continue;
+        size_t len = strlen(arg) + 1 + strlen(ent->d_name) + 1;
+        char *path = malloc(len);
+        snprintf(path, len, "%s/%s", arg, ent->d_name);
+        if (0 == stat(path, &st) && S_ISREG(st.st_mode)) {
+            add_path(path);
+        } else {
+            free(path);
+        }
+    }
+    closedir(dir);
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+//
+// Work-stealing thread pool
+// -------------------------
+//
+// Since the tasks don't spawn other tasks, each deque is just a range of task
+// indices. The owner pops tasks from the bottom of its range and, when it runs
+// out, it steals the top half of the range of some other worker. Stealing half
+// of the work at a time means that the locks are rarely contended.
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t top, bottom; // Remaining tasks are [top, bottom)
+    pthread_t thread;
+    size_t id;
+} Worker;
+
+static Worker *workers;
+static size_t nworkers;
+
+static pthread_mutex_t outputLock = PTHREAD_MUTEX_INITIALIZER;
+static size_t counts[RESULT_ERROR+1];
+
+static bool pop_task(Worker *w, size_t *task)
+{
+    bool ok = false;
+    pthread_mutex_lock(&w->lock);
+    if (w->top < w->bottom) {
+        *task = --w->bottom;
+        ok = true;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return ok;
+}
+
+static bool steal_task(Worker *w, size_t *task)
+{
+    for (size_t i = 1; i < nworkers; i++) {
+        Worker *victim = &workers[(w->id + i) % nworkers];
+
+        pthread_mutex_lock(&victim->lock);
+        size_t n = victim->bottom - victim->top;
+        size_t lo = victim->top;
+        size_t hi = lo + (n+1)/2;
+        victim->top = hi;
+        pthread_mutex_unlock(&victim->lock);
+
+        if (lo < hi) {
+            pthread_mutex_lock(&w->lock);
+            w->top = lo + 1;
+            w->bottom = hi;
+            pthread_mutex_unlock(&w->lock);
+            *task = lo;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void run_task(size_t task)
+{
+    const char *path = paths[task];
+
+    Result result;
+    Game game;
+    uint64_t ticks = 0;
+    ReplayReader replay;
+    if (replay_open(&replay, path)) {
+        replay_start(&replay, &game);
+        ticks = replay_simulate(&replay, &game);
+        result = (replay_matches(&replay, &game) ? RESULT_PASS : RESULT_FAIL);
+        replay_close(&replay);
+    } else {
+        result = RESULT_ERROR;
+        game.score = -1;
+    }
+
+    static const char *names[] = { "pass", "fail", "error" };
+    pthread_mutex_lock(&outputLock);
+    printf("%s\t%ld\t%lu\t%s\n", names[result], game.score, ticks, path);
+    counts[result]++;
+    pthread_mutex_unlock(&outputLock);
+}
+
+static void *worker_main(void *arg)
+{
+    Worker *w = arg;
+    size_t task;
+    while (pop_task(w, &task) || steal_task(w, &task)) {
+        run_task(task);
+    }
+    return NULL;
+}
+
+//
+// Main
+// ----
+
+static void print_usage(const char *progname)
+{
+    printf("Usage: %s [OPTIONS] REPLAY|DIRECTORY...\n"
+           "Re-simulates xjump replays and checks that they match the recorded result.\n"
+           "Prints one line per replay: pass/fail/error, score, ticks and path.\n"
+           "\n"
+           "  -h            show this help message and exit\n"
+           "  -j THREADS    number of worker threads (default: number of cores)\n",
+           progname);
+}
+
+int main(int argc, char **argv)
+{
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int c;
+    while ((c = getopt(argc, argv, "hj:")) != -1) {
+        switch (c) {
+            case 'h':
+                print_usage(argv[0]);
+                exit(0);
+
+            case 'j':
+                nthreads = atol(optarg);
+                break;
+
+            default:
+                exit(1);
+        }
+    }
+
+    if (optind == argc) {
+        print_usage(argv[0]);
+        exit(1);
+    }
+    for (int i = optind; i < argc; i++) {
+        add_argument(argv[i]);
+    }
+    qsort(paths, npaths, sizeof(char *), compare_paths);
+
+    if (nthreads < 1) nthreads = 1;
+    if ((size_t) nthreads > npaths && npaths > 0) nthreads = npaths;
+    nworkers = nthreads;
+
+    workers = calloc(nworkers, sizeof(Worker));
+    for (size_t i = 0; i < nworkers; i++) {
+        Worker *w = &workers[i];
+        pthread_mutex_init(&w->lock, NULL);
+        w->id = i;
+        w->top    = npaths * i / nworkers;
+        w->bottom = npaths * (i+1) / nworkers;
+    }
+
+    for (size_t i = 0; i < nworkers; i++) {
+        if (0 != pthread_create(&workers[i].thread, NULL, worker_main, &workers[i])) {
+            perror("Could not create thread");
+            exit(1);
+        }
+    }
+    for (size_t i = 0; i < nworkers; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    fprintf(stderr, "%zu passed, %zu failed, %zu errors\n",
+            counts[RESULT_PASS], counts[RESULT_FAIL], counts[RESULT_ERROR]);
+
+    return (counts[RESULT_PASS] == npaths ? 0 : 1);
+}
@@ -21,7 +21,6 @@
 
 #include <assert.h>
 #include <errno.h>
-#include <fcntl.h>
 #include <getopt.h>
 #include <inttypes.h>
 #include <limits.h>
@@ -31,12 +30,22 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
-#include <sys/file.h>
 #include <sys/random.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include "broadcast.h"
 #include "config.h"
+#include "core.h"
+#include "export.h"
+#include "ghost.h"
+#include "leaderboard.h"
+#include "profile.h"
+#include "render.h"
+#include "replay.h"
+#include "scores.h"
+#include "themewatch.h"
+
 #define XJUMP_FONTDIR   XJUMP_DATADIR "/xjump"
 #define XJUMP_THEMEDIR  XJUMP_DATADIR "/xjump/themes"
 
@@ -44,23 +53,6 @@
 // Helper functions
 // ----------------
 
-static int min(int x, int y)
-{
-    return (x < y ? x : y);
-}
-
-static int max(int x, int y)
-{
-    return (x > y ? x : y);
-}
-
-static int mod(int n, int m)
-{
-    assert(m > 0);
-    int r = n % m;
-    return (r >= 0 ? r : r + m);
-}
-
 static bool isNullOrEmpty(const char *s)
 {
     return (s == NULL) || (*s == '\0');
@@ -95,8 +87,41 @@ static void panic(const char *what, const char *fullError)
 // Command-line arguments & config
 // -------------------------------
 
+// What to do when the main loop falls behind the clock. See handle_stall.
+typedef enum {
+    STALL_DILATE,
+    STALL_PAUSE,
+    STALL_CATCHUP,
+} StallPolicy;
+
+#define STALL_TICKS 8   /* 200 ms behind the clock */
+
 int isSoftScroll = 1;
+FloorGenerator floorGenerator = FLOORGEN_CLASSIC;
+int isHeadless = 0;
 char *themePath = XJUMP_THEMEDIR "/jumpnbump.bmp";
+char *inputPath = "-";
+char *recordPath = NULL;
+char *replayPath = NULL;
+long seekTick = 0;
+char *profilePath = NULL;
+int hasFixedSeed = 0;
+int64_t fixedSeed[2];
+int maxFps = 0;
+int isVsync = 1;
+char *leaderboardUrl = NULL;
+int isWatchTheme = 0;
+int isCpuRender = 0;
+int isIntegerScale = 0;
+StallPolicy stallPolicy = STALL_DILATE;
+int numPlayers = 1;
+char *broadcastPort = NULL;
+char *spectateAddress = NULL;
+char *exportPath = NULL;
+char *ghostPaths[MAX_GHOSTS];
+int numGhosts = 0;
+
+#define MAX_PLAYERS MAX_FIELDS
 
 static void print_usage(const char * progname)
 {
@@ -107,11 +132,31 @@ static void print_usage(const char * progname)
            "  -v --version     show version information and exit\n"
            "  --soft-scroll    use Xjump 3.0 scrolling behavior (default)\n"
            "  --hard-scroll    use Xjump 1.0 scrolling behavior\n"
+           "  --floors MODE    floor generator: classic (default) or counter\n"
+           "  --seed A[:B]     use a fixed RNG seed instead of a random one\n"
            "  --theme NAME     use a pre-installed sprite theme (eg. --theme=classic)\n"
            "  --graphic FILE   use a custom sprite theme (path to a bitmap file)\n"
+           "  --headless       run the simulation without a window, as fast as possible\n"
+           "  --input FILE     read the headless input from FILE instead of stdin\n"
+           "  --record FILE    save a replay of the first game to FILE\n"
+           "  --replay FILE    play back a replay file\n"
+           "  --seek TICK      start the replay playback at the given simulation frame\n"
+           "  --profile FILE   save the duration of each phase of each frame to FILE\n"
+           "  --max-fps N      draw at most N frames per second\n"
+           "  --no-vsync       do not wait for the vertical retrace when presenting\n"
+           "  --cpu-render     draw with the CPU, for machines without a usable GPU\n"
+           "  --integer-scale  scale the window contents by whole numbers only\n"
+           "  --on-stall MODE  after a long stall: dilate (default), pause or catch-up\n"
+           "  --leaderboard URL  send the scores to a leaderboard server\n"
+           "  --watch-theme    reload the theme file when it changes on disk\n"
+           "  --players N      split the screen between N players, from 1 to %d\n"
+           "  --broadcast PORT  stream the game to spectators connecting to PORT\n"
+           "  --spectate HOST[:PORT]  watch a game broadcast by another xjump\n"
+           "  --export-frames FILE  write the frames of the replay to FILE, as raw RGB24\n"
+           "  --ghost FILE     race against the replay in FILE (can be repeated)\n"
            "\n"
            "Alternate themes can be found under %s.\n",
-           progname, XJUMP_THEMEDIR);
+           progname, MAX_PLAYERS, XJUMP_THEMEDIR);
 }
 
 static void print_version()
@@ -125,11 +170,31 @@ static void parseCommandLine(int argc, char **argv)
         /* These options set a flag. */
         {"soft-scroll", no_argument, &isSoftScroll, 1},
         {"hard-scroll", no_argument, &isSoftScroll, 0},
+        {"headless",    no_argument, &isHeadless, 1},
+        {"no-vsync",    no_argument, &isVsync, 0},
+        {"watch-theme", no_argument, &isWatchTheme, 1},
+        {"cpu-render",  no_argument, &isCpuRender, 1},
+        {"integer-scale", no_argument, &isIntegerScale, 1},
         /* These options don’t set a flag */
         {"help",    no_argument,        0, 'h'},
         {"version", no_argument,        0, 'v'},
         {"theme",   required_argument,  0, 't'},
         {"graphic", required_argument,  0, 'g'},
+        {"input",   required_argument,  0, 'i'},
+        {"record",  required_argument,  0, 'r'},
+        {"replay",  required_argument,  0, 'p'},
+        {"seek",    required_argument,  0, 's'},
+        {"floors",  required_argument,  0, 'f'},
+        {"seed",    required_argument,  0, 'S'},
+        {"profile", required_argument,  0, 'P'},
+        {"max-fps", required_argument,  0, 'F'},
+        {"leaderboard", required_argument,  0, 'L'},
+        {"players", required_argument,  0, 'n'},
+        {"broadcast", required_argument,  0, 'B'},
+        {"spectate",  required_argument,  0, 'W'},
+        {"export-frames", required_argument,  0, 'E'},
+        {"ghost",   required_argument,  0, 'G'},
+        {"on-stall", required_argument,  0, 'O'},
         {0, 0, 0, 0}
     };
 
@@ -160,6 +225,108 @@ static void parseCommandLine(int argc, char **argv)
                 themePath = optarg;
                 break;
 
+            case 'i':
+                inputPath = optarg;
+                break;
+
+            case 'r':
+                recordPath = optarg;
+                break;
+
+            case 'p':
+                replayPath = optarg;
+                break;
+
+            case 's':
+                seekTick = atol(optarg);
+                break;
+
+            case 'f':
+                if (0 == strcmp(optarg, "classic")) {
+                    floorGenerator = FLOORGEN_CLASSIC;
+                } else if (0 == strcmp(optarg, "counter")) {
+                    floorGenerator = FLOORGEN_COUNTER;
+                } else {
+                    fprintf(stderr, "%s: unknown floor generator '%s'\n", argv[0], optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'O':
+                if (0 == strcmp(optarg, "dilate")) {
+                    stallPolicy = STALL_DILATE;
+                } else if (0 == strcmp(optarg, "pause")) {
+                    stallPolicy = STALL_PAUSE;
+                } else if (0 == strcmp(optarg, "catch-up")) {
+                    stallPolicy = STALL_CATCHUP;
+                } else {
+                    fprintf(stderr, "%s: unknown stall policy '%s'\n", argv[0], optarg);
+                    exit(1);
+                }
+                break;
+
+            case 'P':
+                profilePath = optarg;
+                break;
+
+            case 'L':
+                leaderboardUrl = optarg;
+                break;
+
+            case 'B':
+                broadcastPort = optarg;
+                break;
+
+            case 'W':
+                spectateAddress = optarg;
+                break;
+
+            case 'E':
+                exportPath = optarg;
+                break;
+
+            case 'G':
+                if (numGhosts == MAX_GHOSTS) {
+                    fprintf(stderr, "%s: too many ghosts, the limit is %d\n", argv[0], MAX_GHOSTS);
+                    exit(1);
+                }
+                ghostPaths[numGhosts++] = optarg;
+                break;
+
+            case 'F': {
+                char *end;
+                long n = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || n < 0 || n > 1000) {
+                    fprintf(stderr, "%s: invalid frame rate '%s'\n", argv[0], optarg);
+                    exit(1);
+                }
+                maxFps = n;
+                break;
+            }
+
+            case 'n': {
+                char *end;
+                long n = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || n < 1 || n > MAX_PLAYERS) {
+                    fprintf(stderr, "%s: invalid number of players '%s'\n", argv[0], optarg);
+                    exit(1);
+                }
+                numPlayers = n;
+                break;
+            }
+
+            case 'S': {
+                char *end;
+                fixedSeed[0] = strtoull(optarg, &end, 0);
+                fixedSeed[1] = (*end == ':' ? strtoull(end+1, &end, 0) : 0);
+                if (*optarg == '\0' || *end != '\0') {
+                    fprintf(stderr, "%s: invalid seed '%s'\n", argv[0], optarg);
+                    exit(1);
+                }
+                hasFixedSeed = 1;
+                break;
+            }
+
             case '?':
                 // getopt_long already printed an error message
                 exit(1);
@@ -168,701 +335,566 @@ static void parseCommandLine(int argc, char **argv)
                 abort(); // Shoulr never happen
         }
     }
-}
 
-//
-// Random Number Generator
-// -----------------------
-//
-// References:
-// https://www.pcg-random.org
-// https://www.pcg-random.org/posts/bounded-rands.html
+    if (seekTick && !replayPath) {
+        fprintf(stderr, "%s: --seek can only be used with --replay\n", argv[0]);
+        exit(1);
+    }
 
-static uint64_t pcgState = 0x853c49e6748fea9bULL; // Mutable state of the RNG
-static uint64_t pcgSeq   = 0xda3e39cb94b95bdbULL; // PCG "sequence" parameter
+    if (recordPath && replayPath) {
+        fprintf(stderr, "%s: --record and --replay can't be used together\n", argv[0]);
+        exit(1);
+    }
 
-static void pcg32_init(int64_t seed[2])
-{
-    pcgState = seed[0];
-    pcgSeq = (seed[1] << 1) | 1;
-}
+    // Replays only have room for one hero
+    if (numPlayers > 1 && (isHeadless || recordPath || replayPath)) {
+        fprintf(stderr, "%s: --players can't be used with --headless, --record or --replay\n", argv[0]);
+        exit(1);
+    }
 
-static uint32_t pcg32_next()
-{
-    pcgState = pcgState * 6364136223846793005ULL + pcgSeq;
-    uint32_t xorshifted = ((pcgState >> 18u) ^ pcgState) >> 27u;
-    uint32_t rot = pcgState >> 59u;
-    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
-}
+    // The broadcast only has room for one hero too
+    if (broadcastPort && (isHeadless || replayPath || numPlayers > 1)) {
+        fprintf(stderr, "%s: --broadcast can't be used with --headless, --replay or --players\n", argv[0]);
+        exit(1);
+    }
 
-// Returns an uniformly distributed integer in the range [0,a)
-static uint32_t pcg32_bounded(uint32_t n)
-{
-    uint32_t x, r;
-    do {
-        x = pcg32_next();
-        r = x % n;
-    } while (x - r > (-n));
-    return r;
-}
+    // The export draws offscreen, with the GPU renderer
+    if (exportPath && (!replayPath || isHeadless || isCpuRender)) {
+        fprintf(stderr, "%s: --export-frames needs --replay, and can't be used with --headless or --cpu-render\n", argv[0]);
+        exit(1);
+    }
 
-// Returns an uniformly distributed integer in the range [a, b], inclusive
-static uint32_t rnd(uint32_t a, uint32_t b)
-{
-    return a + pcg32_bounded(b-a+1);
+    if (numGhosts > 0 && (isHeadless || replayPath || spectateAddress)) {
+        fprintf(stderr, "%s: --ghost can't be used with --headless, --replay or --spectate\n", argv[0]);
+        exit(1);
+    }
+
+    if (spectateAddress && (broadcastPort || isHeadless || recordPath || replayPath || numPlayers > 1)) {
+        fprintf(stderr, "%s: --spectate can't be used with --broadcast, --headless, --record, --replay or --players\n", argv[0]);
+        exit(1);
+    }
 }
 
 //
 // Highscores
 // ----------
 
-int64_t bestScoreEver  = 0;
-int64_t bestScoreToday = 0;
-time_t bestScoreExpiration = 0;
-FILE *highscoreFile = NULL;
+ScoreSummary bestScores = { 0, 0, 0 };
+ScoreLog scoreLog;
+bool hasScoreLog = false;
 
 static void highscore_init()
 {
-    char *highscorePath = NULL;
+    char *logPath = NULL;
+    char *oldPath = NULL;
 
     // Locate the local highscore file, following the XDG spec
     // https://specifications.freedesktop.org/basedir-spec/basedir-spec-latest.html
-    const char *fileName = "xjump-highscores";
+    // Older versions kept the best scores in a text file, which we import.
+    const char *fileName = "xjump-scores";
+    const char *oldFileName = "xjump-highscores";
     const char *HOME          = getenv("HOME");
     const char *XDG_DATA_HOME = getenv("XDG_DATA_HOME");
     if (!isNullOrEmpty(XDG_DATA_HOME)) {
         const char *ss[] = { XDG_DATA_HOME, "/", fileName, NULL };
-        highscorePath = concat(ss);
+        const char *oo[] = { XDG_DATA_HOME, "/", oldFileName, NULL };
+        logPath = concat(ss);
+        oldPath = concat(oo);
     } else if (!isNullOrEmpty(HOME)) {
         const char *ss[] = { HOME, "/.local/share/", fileName, NULL };
-        highscorePath = concat(ss);
+        const char *oo[] = { HOME, "/.local/share/", oldFileName, NULL };
+        logPath = concat(ss);
+        oldPath = concat(oo);
     } else {
         fprintf(stderr, "Could not find highscore directory. $HOME is not set.\n");
         goto done;
     }
 
-    // Open the local highscore file or create it if it does not already exist.
-    // We need to use low level open() to this precise combination of RW plus
-    // file creation. If we get an error, it's better to get it now than after
-    // a long game.
-    int flags = O_RDWR | O_CREAT;
-    int fd = open(highscorePath, flags, 0666);
-    if (fd < 0) {
-        perror("Could not open highscore file");
+    // Open the score log or create it if it does not already exist. If we get
+    // an error, it's better to get it now than after a long game.
+    if (!scores_open(&scoreLog, logPath)) {
         goto done;
     }
+    hasScoreLog = true;
+    scores_import(&scoreLog, oldPath);
 
-    // Create a more convenient FILE* handle for the highscores.
-    highscoreFile = fdopen(fd, "r+");
-    if (!highscoreFile) {
-        perror("Could not create highscore file handle");
-        goto done;
-    }
+    scores_summary(&scoreLog, &bestScores);
 
 done:
-    if (!highscoreFile) {
+    if (!hasScoreLog) {
         fprintf(stderr, "Highscores will not be recorded\n");
     }
-    free(highscorePath);
+    free(logPath);
+    free(oldPath);
 }
 
-static void highscore_read()
-{
-    rewind(highscoreFile);
-    if (1 != fscanf(highscoreFile, "best %ld\n", &bestScoreEver)) { return; }
-    if (2 != fscanf(highscoreFile, "today %ld %ld\n", &bestScoreToday, &bestScoreExpiration)) { return; }
-}
+// The file I/O happens in a background thread. Taking the lock and writing
+// to the file can take a long time if the home directory is on a network file
+// system, and we don't want the game over screen to freeze in the meantime.
+//
+// The main thread communicates with the writer through a small mailbox. Games
+// last at least a few seconds so it normally holds a single run, but if the
+// file system is stuck it can fill up; then we keep the best runs. When the
+// writer is done, it posts the summary from the file and pushes an SDL event
+// so the main loop knows it should redraw the highscore screen.
 
-static void highscore_write()
-{
-    rewind(highscoreFile);
-    if (0 != ftruncate(fileno(highscoreFile), 0)) {
-        panic("Could not reset highscore file", strerror(errno));
-    }
-    fprintf(highscoreFile, "best %ld\n", bestScoreEver);
-    fprintf(highscoreFile, "today %ld %ld\n", bestScoreToday, bestScoreExpiration);
-    fflush(highscoreFile);
-}
+#define HS_MAILBOX_SIZE 4
 
-static time_t end_of_day(time_t now)
-{
-    struct tm *date = localtime(&now);
-    date->tm_mday += 1;
-    date->tm_hour = 0;
-    date->tm_min = 0;
-    date->tm_sec = 0;
-    return mktime(date);
-}
+static SDL_Thread *hsThread;
+static SDL_mutex *hsMutex;
+static SDL_cond  *hsCond;
+static Uint32 hsEvent = (Uint32) -1;    // Sent when there are new best scores
 
-static void highscore_update(int64_t newScore)
-{
-    time_t now = time(NULL);
-    if (highscoreFile) {
+static ScoreRecord hsRequests[HS_MAILBOX_SIZE];  // Runs waiting to be saved
+static int hsNumRequests;
+static bool hsQuit;
 
-        if (0 != flock(fileno(highscoreFile), LOCK_EX)) {
-            panic("Could not acquire file lock", strerror(errno));
-        }
+static bool hsHasResult;        // Summary read back from the file
+static ScoreSummary hsResult;
 
-        highscore_read();
+// Can be called from any thread
+static void highscore_notify()
+{
+    if (hsEvent != (Uint32) -1) {
+        SDL_Event e = { 0 };
+        e.type = hsEvent;
+        SDL_PushEvent(&e);
+    }
+}
 
-        if (newScore > bestScoreEver) {
-            bestScoreEver = newScore;
+static int highscore_worker(void *unused)
+{
+    (void) unused;
+    SDL_LockMutex(hsMutex);
+    while (1) {
+        while (hsNumRequests == 0 && !hsQuit) {
+            SDL_CondWait(hsCond, hsMutex);
         }
+        if (hsNumRequests == 0) break;
 
-        if (newScore > bestScoreToday || bestScoreExpiration < now) {
-            bestScoreToday = newScore;
-            bestScoreExpiration = end_of_day(now);
-        }
+        ScoreRecord rec = hsRequests[0];
+        hsNumRequests--;
+        memmove(&hsRequests[0], &hsRequests[1], hsNumRequests * sizeof(ScoreRecord));
+        SDL_UnlockMutex(hsMutex);
 
-        highscore_write();
+        ScoreSummary summary;
+        bool ok = scores_append(&scoreLog, &rec, &summary);
 
-        if (0 != flock(fileno(highscoreFile), LOCK_UN)) {
-            panic("Could not release file lock", strerror(errno));
+        SDL_LockMutex(hsMutex);
+        if (ok) {
+            hsHasResult = true;
+            hsResult = summary;
+            highscore_notify();
         }
     }
+    SDL_UnlockMutex(hsMutex);
+    return 0;
 }
 
-//
-// Joystick state
-// --------------
-
-// This component keeps track of the "joystick" state.
-// If both LEFT and RIGHT a pressed at the same time, the most recent one wins.
-
-typedef enum {
-    LR_NEUTRAL,
-    LR_LEFT,
-    LR_RIGHT
-} LeftRight;
-
-typedef enum {
-    INPUT_JUMP,
-    INPUT_LEFT,
-    INPUT_RIGHT,
-    INPUT_OTHER,
-} Input;
-
-static struct {
-    LeftRight horizDirection;
-    bool isPressing[INPUT_OTHER+1];
-} K;
-
-static Input translateHotkey(SDL_Keysym key)
+static void highscore_start()
 {
-    switch (key.scancode) {
-        case SDL_SCANCODE_UP:
-        case SDL_SCANCODE_DOWN:
-        case SDL_SCANCODE_W:
-        case SDL_SCANCODE_S:
-        case SDL_SCANCODE_I:
-        case SDL_SCANCODE_K:
-        case SDL_SCANCODE_SPACE:
-        case SDL_SCANCODE_KP_8:
-        case SDL_SCANCODE_KP_5:
-        case SDL_SCANCODE_KP_2:
-            return INPUT_JUMP;
+    hsEvent = SDL_RegisterEvents(1);
+    if (!hasScoreLog) return;
 
-        case SDL_SCANCODE_LEFT:
-        case SDL_SCANCODE_A:
-        case SDL_SCANCODE_J:
-        case SDL_SCANCODE_KP_4:
-            return INPUT_LEFT;
+    hsMutex = SDL_CreateMutex();
+    hsCond  = SDL_CreateCond();
+    if (!hsMutex || !hsCond) panic("Could not create highscore mutex", SDL_GetError());
 
-        case SDL_SCANCODE_RIGHT:
-        case SDL_SCANCODE_D:
-        case SDL_SCANCODE_L:
-        case SDL_SCANCODE_KP_6:
-            return INPUT_RIGHT;
-
-        default:
-            return INPUT_OTHER;
+    hsThread = SDL_CreateThread(highscore_worker, "highscores", NULL);
+    if (!hsThread) {
+        fprintf(stderr, "Could not start highscore thread: %s\n", SDL_GetError());
+        fprintf(stderr, "Highscores will not be recorded\n");
     }
 }
 
-
-static void init_input()
+// Waits for the pending writes, if any
+static void highscore_stop()
 {
-    K.horizDirection = LR_NEUTRAL;
-    for (int i = 0; i < INPUT_OTHER; i++) {
-        K.isPressing[i] = false;
-    }
+    if (!hsThread) return;
+    SDL_LockMutex(hsMutex);
+    hsQuit = true;
+    SDL_CondSignal(hsCond);
+    SDL_UnlockMutex(hsMutex);
+    SDL_WaitThread(hsThread, NULL);
+    hsThread = NULL;
+    scores_close(&scoreLog);
 }
 
-static void input_keydown(const SDL_Keysym key)
+// Updates the scores shown on screen right away, using what we already know,
+// and sends the run to the writer thread. The values from the file arrive
+// later, through highscore_poll.
+static void highscore_update(const ScoreRecord *rec)
 {
-    Input input = translateHotkey(key);
-    if (input != INPUT_OTHER) {
-        K.isPressing[input] = true;
-        switch (input) {
-            case INPUT_LEFT:
-                K.horizDirection = LR_LEFT;
-                break;
-
-            case INPUT_RIGHT:
-                K.horizDirection = LR_RIGHT;
-                break;
+    scores_merge(&bestScores, rec);
 
-            default:
-                break;
+    if (hsThread) {
+        SDL_LockMutex(hsMutex);
+        if (hsNumRequests < HS_MAILBOX_SIZE) {
+            hsRequests[hsNumRequests++] = *rec;
+        } else {
+            int worst = 0;
+            for (int i = 1; i < HS_MAILBOX_SIZE; i++) {
+                if (hsRequests[i].score < hsRequests[worst].score) worst = i;
+            }
+            if (rec->score > hsRequests[worst].score) {
+                hsRequests[worst] = *rec;
+            }
         }
+        SDL_CondSignal(hsCond);
+        SDL_UnlockMutex(hsMutex);
     }
 }
 
-static void input_keyup(const SDL_Keysym key)
+// Combines best scores that come from different places
+static bool merge_summary(ScoreSummary *dst, const ScoreSummary *src)
 {
-    Input input = translateHotkey(key);
-    if (input != INPUT_OTHER) {
-        K.isPressing[input] = false;
-        switch (input) {
-            case INPUT_LEFT:
-                K.horizDirection = (K.isPressing[INPUT_RIGHT] ? LR_RIGHT : LR_NEUTRAL);
-                break;
-
-            case INPUT_RIGHT:
-                K.horizDirection  = (K.isPressing[INPUT_LEFT] ? LR_LEFT : LR_NEUTRAL);
-                break;
+    ScoreSummary old = *dst;
+    if (src->best > dst->best) {
+        dst->best = src->best;
+    }
+    if (src->expiration > dst->expiration) {
+        dst->today = src->today;
+        dst->expiration = src->expiration;
+    } else if (src->expiration == dst->expiration && src->today > dst->today) {
+        dst->today = src->today;
+    }
+    return (old.best != dst->best || old.today != dst->today);
+}
 
-            default:
-                break;
+// Picks up the results of the writer thread and of the leaderboard client.
+// Returns whether anything changed.
+static bool highscore_poll()
+{
+    bool changed = false;
+    if (hsThread) {
+        SDL_LockMutex(hsMutex);
+        if (hsHasResult) {
+            changed |= merge_summary(&bestScores, &hsResult);
+            hsHasResult = false;
         }
+        SDL_UnlockMutex(hsMutex);
     }
+
+    ScoreSummary global;
+    if (leaderboard_poll(&global)) {
+        changed |= merge_summary(&bestScores, &global);
+    }
+    return changed;
 }
-//
-// Game Logic
-// ----------
 
-// HERE BE DRAGONS (SHOULD THIS BE REFACTORED?)
-// The game logic that I am using is taken almost directly from the original
-// XJump source code, with soft scrolling bolted on top. This causes the soft
-// scrolling parts to be a bit unnatural. The original logic is heavily tied
-// to the idea that the hero position is it's position in pixels. However, in
-// soft scrolling mode this is no longer true because the screen can scroll
-// between frames. The end result is stuff like forcedScroll and interpScroll.
 //
-// Part of me really wants to rewrite this code so that the hero coordinates
-// are relative to the bottom of the tower. That would greatly simplify the
-// scrolling logic, because that way the scrolling becomes mostly about the
-// camera position, not the hero position. But that will wait for another day
-// because I don't want to break working code.
-//
-// We should also consider if we really want to keep supporting the legacy
-// --hard-scroll mode. It took a lot of effort to stamp out all the scrolling
-// bugs and in the end the hard scroll logic was completely different than the
-// --soft-scroll one...
-
-#define S 16  /* Size of a sprite tile, in pixels */
-#define R 32  /* Size of the player sprite, in pixels */
-
-#define FIELD_W 32 /* Width of playing field, in tiles */
-#define FIELD_H 24 /* Height of playing field, in tiles */
-#define FIELD_EXTRA 3 /* Number of extra rows that we have to draw, to support scrolling */
-
-#define NFLOORS 64    /* Number of floors held in memory */
+// Theme reloading
+// ---------------
 
-#define GAME_SPEED 25 /* (40 FPS) Time per simulation frame, in milliseconds */
-#define MAX_SCROLL_SPEED 5000  /* scrollCount increment per frame, at max speed */
-#define SCROLL_THRESHOLD 20000 /* scrollCount that triggers a frame change */
+// Sent by the theme watcher, when it has decoded a new version of the theme
+static Uint32 themeEvent = (Uint32) -1;
 
-static const int leftLimit = S;                  // x coordinate that collides with left
-static const int rightLimit = (FIELD_W-1)*S - R; // x coordinate that collides with right
-static const int topLimit = 5*S;        // y coordinate that triggers a forced scroll
-static const int botLimit = FIELD_H*S;  // y coordinate that triggers a game over
-
-typedef struct {
-    int left;
-    int right;
-} Floor;
-
-static struct {
-
-    int64_t score;
-
-    // Physics
-    int x, y;   // Top-left of the hero sprite, relative to top-left of screen.
-    int vx, vy; // Speed. vy is in pixels per frame but vx is in half-pixels.
-    int jump;   // Lowers the gravity during the rising arc of jump, if JUMP button is held.
-
-    // Animations
-    int isStanding;
-    int isFacingRight;
-    int isIdleVariant;
-    int idleCount;
-
-    // Scrolling
-    int hasStarted;   // Don't start scrolling until we jump for the first time
-    int floorOffset;  // Tile height of the row at the top of the screen
-    int forcedScroll; // Additional scroll distance in pixels. Happens when you get close to the top.
-    int scrollCount;
-    int scrollSpeed;
-
-    // Floors
-    int fpos;
-    int next_floor;
-    Floor floors[NFLOORS];
-} G;
-
-static Floor *get_floor(int n)
+// Called from the theme watcher thread
+static void theme_notify()
 {
-    return &G.floors[mod(n, NFLOORS)];
+    SDL_Event e = { 0 };
+    e.type = themeEvent;
+    SDL_PushEvent(&e);
 }
 
-static void generate_floor()
+//
+// Spectator broadcast
+// -------------------
+
+// Sent by the network threads: a spectator connected to our broadcast, or
+// the broadcast that we are watching sent something new.
+static Uint32 netEvent = (Uint32) -1;
+
+// Called from the network threads
+static void net_notify()
 {
-    // Floor positions are measured in tiles and are stored in a circular
-    // buffer. The left and right positions are inclusive, ranging [1,30].
-    // The left and right walls are in positions 0 and 31, respectively.
-    // The "origin" of each floor ranges [5,26] and is encoded by the fpos
-    // variable, which can range between [0,21]. There can be between 2-4
-    // tiles to the left and to the right of the origin, totaling 5-9 tiles.
-    int n = G.next_floor++;
-    Floor *floor = get_floor(n);
-    if (n % 250 == 0) {
-        floor->left  = 1;
-        floor->right = 30;
-    } else if (n % 5 == 0) {
-        int sign = (rnd(0,1) ? +1 : -1);
-        int magnitude = rnd(5,9);
-        G.fpos = mod(G.fpos + sign*magnitude, 22);
-        floor->left  = G.fpos+5 - rnd(2,4);
-        floor->right = G.fpos+5 + rnd(2,4);
-    } else {
-        floor->left  = -10;
-        floor->right = -20;
+    if (netEvent != (Uint32) -1) {
+        SDL_Event e = { 0 };
+        e.type = netEvent;
+        SDL_PushEvent(&e);
     }
 }
 
-static void init_game()
+//
+// Ghosts
+// ------
+//
+// The race happens in the tower of the first ghost, with its scrolling mode
+// and floor generator, unless the seed was given with --seed. Every new game
+// starts the race again.
+
+static Ghost ghosts[MAX_GHOSTS];
+static int64_t raceSeed[2];
+
+// Must be called before replay_init, because the ghosts might change the seed
+static void ghosts_init(int64_t seed[2])
 {
-    G.score = 0;
-
-    G.x    = (FIELD_W/2)*S - R/2;
-    G.y    = (FIELD_H-4)*S - R;
-    G.vx   = 0;
-    G.vy   = 0;
-    G.jump = 0;
-
-    G.isStanding    = true;
-    G.isFacingRight = false;
-    G.isIdleVariant = false;
-    G.idleCount     = 0;
-
-    G.hasStarted   = false;
-    G.floorOffset  = 20;
-    G.forcedScroll = 0;
-    G.scrollCount  = 0;
-    G.scrollSpeed  = 0;
-
-    G.fpos = rnd(0,21);
-    G.next_floor = -3;
-    for (int i=0; i < NFLOORS; i++) {
-        generate_floor();
+    for (int k = 0; k < numGhosts; k++) {
+        if (!ghost_open(&ghosts[k], ghostPaths[k])) { exit(1); }
     }
+    if (numGhosts > 0) {
+        const ReplayHeader *header = &ghosts[0].reader.header;
+        isSoftScroll = (header->flags & REPLAY_FLAG_SOFTSCROLL) != 0;
+        floorGenerator = ((header->flags & REPLAY_FLAG_COUNTERFLOORS) ? FLOORGEN_COUNTER : FLOORGEN_CLASSIC);
+        if (!hasFixedSeed) {
+            seed[0] = header->seed[0];
+            seed[1] = header->seed[1];
+        }
+    }
+    raceSeed[0] = seed[0];
+    raceSeed[1] = seed[1];
 }
 
-static void scroll()
+static void ghosts_stop()
 {
-    generate_floor();
-    G.floorOffset += 1;
-    G.y += S;
-    if (G.forcedScroll >= S) {
-        G.forcedScroll -= S;
+    for (int k = 0; k < numGhosts; k++) {
+        ghost_close(&ghosts[k]);
     }
 }
 
-static bool isStanding(int hx, int hy)
+//
+// Game state
+// ----------
+
+// In split-screen mode every player has a game of their own. The first one is
+// the only one that can be recorded or replayed.
+static XjCore cores[MAX_PLAYERS];
+static XjCore *const core = &cores[0];
+static Game *const G = &cores[0].game;
+static ScoreRecord currRuns[MAX_PLAYERS];  // What goes to the score log at the end
+static bool isAlive[MAX_PLAYERS];
+
+static void start_game()
 {
-    if (G.vy < 0) {
-        return false;
+    if (numGhosts > 0) {
+        pcg32_init(&G->rng, raceSeed);
+        for (int k = 0; k < numGhosts; k++) {
+            ghost_restart(&ghosts[k]);
+        }
     }
 
-    int y = (hy + R)/S;
-    if (y >= FIELD_H) {
-        return false;
+    // The seed of the run is the state of the RNG at this point, so that
+    // "--seed A:B" starts the same game again. All the players get the same
+    // seed, so their towers are identical.
+    const Pcg32 rng = G->rng;
+    for (int i = 0; i < numPlayers; i++) {
+        XjCore *c = &cores[i];
+        ScoreRecord *run = &currRuns[i];
+        c->game.rng = rng;
+        memset(run, 0, sizeof(*run));
+        run->seed[0] = rng.state;
+        run->seed[1] = rng.seq >> 1;
+        run->flags = (c->game.isSoftScroll ? REPLAY_FLAG_SOFTSCROLL : 0)
+                   | (c->game.floorGenerator == FLOORGEN_COUNTER ? REPLAY_FLAG_COUNTERFLOORS : 0);
+        scores_set_theme(run, themePath);
+        xj_reset(c, NULL);
+        isAlive[i] = true;
     }
-
-    // We're standing as long as 8/32 pixels touch the ground.
-    const Floor *fl = get_floor(G.floorOffset - y);
-    return (fl->left*S - 24 <= hx && hx <= fl->right*S + 8);
+    broadcast_new_game(currRuns[0].flags, currRuns[0].seed);
 }
 
-static int collideWithFloor(int hy) {
-    return (hy / S) * S;
-}
+// The keys come in groups, one per side of the keyboard. With a single player
+// all of them control the same hero. In split-screen mode each group belongs
+// to a different player, and the space bar is not used.
+typedef enum {
+    KEYS_WASD,
+    KEYS_IJKL,
+    KEYS_ARROWS,
+    KEYS_KEYPAD,
+    KEYS_SPACE,
+    KEYS_NONE,
+} KeyGroup;
+
+// Which player each group controls, depending on the number of players
+static const int keyGroupPlayer[MAX_PLAYERS][KEYS_NONE] = {
+    { 0,  0, 0,  0,  0 },
+    { 0, -1, 1, -1, -1 },
+    { 0,  1, 2, -1, -1 },
+    { 0,  1, 2,  3, -1 },
+};
 
-static bool updateGame()
+static Input translateHotkey(SDL_Keysym key, KeyGroup *group)
 {
-    G.x += G.vx / 2;
-    G.y += G.vy;
-
-    // First we collide with the walls, setting the x coordinate.
-    // The original version of xjump just set the x coordinate glued to the wall. This version makes
-    // the walls subtly bouncier by taking into account the X velocity after the bounce. It's subtle
-    // but feels better, IMO, specially if you are just bouncing off the walls before the game
-    // starts. The "-2" in the formula is a dampening factor to avoid "flickering" 1px bounces.
-    if (G.x < leftLimit && G.vx <= 0) {
-        G.x  = leftLimit + max(0, leftLimit - G.x - 2)/2;
-        G.vx = -G.vx/2;
-    }
-
-    if (G.x > rightLimit && G.vx >= 0) {
-        G.x  = rightLimit - max(0, G.x - rightLimit - 2)/2;
-        G.vx = -G.vx/2;
-    }
-
-    // Next we collide with the floors, setting the y coordinate.
-    // This must be after the wall collisions because it depends on the x.
-    G.isStanding = isStanding(G.x, G.y);
-    if (G.isStanding) {
-        G.y = collideWithFloor(G.y);
-        G.vy = 0;
-
-        int n = (G.floorOffset - (G.y + R)/S) / 5;
-        if (n > G.score) {
-            G.score = n;
-        }
+    switch (key.scancode) {
+        case SDL_SCANCODE_W:
+        case SDL_SCANCODE_S:     *group = KEYS_WASD;   return INPUT_JUMP;
+        case SDL_SCANCODE_I:
+        case SDL_SCANCODE_K:     *group = KEYS_IJKL;   return INPUT_JUMP;
+        case SDL_SCANCODE_UP:
+        case SDL_SCANCODE_DOWN:  *group = KEYS_ARROWS; return INPUT_JUMP;
+        case SDL_SCANCODE_KP_8:
+        case SDL_SCANCODE_KP_5:
+        case SDL_SCANCODE_KP_2:  *group = KEYS_KEYPAD; return INPUT_JUMP;
+        case SDL_SCANCODE_SPACE: *group = KEYS_SPACE;  return INPUT_JUMP;
 
-        if (++G.idleCount >= 5) {
-          G.isIdleVariant = !G.isIdleVariant;
-          G.idleCount = 0;
-        }
+        case SDL_SCANCODE_A:     *group = KEYS_WASD;   return INPUT_LEFT;
+        case SDL_SCANCODE_J:     *group = KEYS_IJKL;   return INPUT_LEFT;
+        case SDL_SCANCODE_LEFT:  *group = KEYS_ARROWS; return INPUT_LEFT;
+        case SDL_SCANCODE_KP_4:  *group = KEYS_KEYPAD; return INPUT_LEFT;
 
-        if (K.isPressing[INPUT_JUMP]) {
-          G.jump = abs(G.vx)/4+7;
-          G.vy = -G.jump/2-12;
-          G.isStanding = true;
-          if (!G.hasStarted) {
-              G.hasStarted = true;
-              G.scrollSpeed = 200;
-          }
-        }
-    }
+        case SDL_SCANCODE_D:     *group = KEYS_WASD;   return INPUT_RIGHT;
+        case SDL_SCANCODE_L:     *group = KEYS_IJKL;   return INPUT_RIGHT;
+        case SDL_SCANCODE_RIGHT: *group = KEYS_ARROWS; return INPUT_RIGHT;
+        case SDL_SCANCODE_KP_6:  *group = KEYS_KEYPAD; return INPUT_RIGHT;
 
-    int accelx = (G.isStanding ? 3 : 2);
-    switch (K.horizDirection) {
-        case LR_LEFT:
-            G.vx = max(G.vx - accelx, -32);
-            G.isFacingRight = false;
-            break;
-        case LR_RIGHT:
-            G.vx = min(G.vx + accelx, 32);
-            G.isFacingRight = true;
-            break;
-        case LR_NEUTRAL:
-            if (G.isStanding) {
-                if      (G.vx < -2) G.vx += 3;
-                else if (G.vx >  2) G.vx -= 3;
-                else                G.vx = 0;
-            }
-            break;
+        default:
+            *group = KEYS_NONE;
+            return INPUT_OTHER;
     }
+}
 
-    if (!G.isStanding) {
-        if (G.jump > 0) {
-            G.vy   = -G.jump/2 - 12;
-            G.jump = (K.isPressing[INPUT_JUMP] ? G.jump-1 : 0);
-        } else {
-            G.vy = min(G.vy + 2, 16);
-            G.jump = 0;
-        }
-    }
 
-    // Now we scroll the screen.
-    // This must be after we know the x and y.
-    if (G.hasStarted) {
-        G.scrollSpeed = min(MAX_SCROLL_SPEED, G.scrollSpeed + 1);
-        G.scrollCount += G.scrollSpeed;
-    }
+// Key events are not applied as soon as we poll them. Instead, they wait in a
+// queue until the simulation reaches the tick where their SDL timestamp falls.
+// Otherwise, when the main loop runs several ticks to catch up, all of them
+// would see the input as it was at the end. A key that is pressed and released
+// within the same tick still counts as pressed for that tick; the release is
+// postponed to the next one.
 
-    while (G.scrollCount > SCROLL_THRESHOLD) {
-        G.scrollCount -= SCROLL_THRESHOLD;
-        scroll();
-    }
+typedef struct {
+    uint32_t time;
+    int player;
+    Input input;
+    bool isPress;
+} InputEvent;
 
-    // Force scroll if too close to the top. But only if we are in the air, to
-    // avoid big jumps in the scroll due to collideWithFloor. (For softscroll
-    // mode, we do this in the rendering loop)
-    if (!isSoftScroll && !G.isStanding) {
-        while (G.y < topLimit) {
-            scroll();
-        }
-    }
+#define INPUT_QUEUE_SIZE 64
 
-    if (G.y + G.forcedScroll >= botLimit) {
-        return true;
-    }
+static InputEvent inputQueue[INPUT_QUEUE_SIZE];
+static size_t inputHead = 0;
+static size_t inputCount = 0;
 
-    return false;
+static void input_apply_first()
+{
+    const InputEvent *ev = &inputQueue[inputHead];
+    Joystick *input = &cores[ev->player].game.input;
+    if (ev->isPress) {
+        input_press(input, ev->input);
+    } else {
+        input_release(input, ev->input);
+    }
+    inputHead = (inputHead + 1) % INPUT_QUEUE_SIZE;
+    inputCount--;
 }
 
-//
-// Colors
-//
-
-static const SDL_Color backgroundColor  = {   0,   0,   0, 255 };
-static const SDL_Color textColor        = { 255, 255, 255, 255 };
-static const SDL_Color copyrightColor   = {   0, 255,   0, 255 };
-static const SDL_Color boxBorderColor   = {   0,   0, 128, 255 };
-static const SDL_Color boxColor         = {   0,   0, 255, 255 };
-static const SDL_Color scoreBorderColor = { 255, 255, 255, 255 };
+static void input_enqueue(uint32_t time, SDL_Keysym key, bool isPress)
+{
+    KeyGroup group;
+    Input input = translateHotkey(key, &group);
+    if (input == INPUT_OTHER) return;
+    int player = keyGroupPlayer[numPlayers-1][group];
+    if (player < 0) return;
+    if (inputCount == INPUT_QUEUE_SIZE) input_apply_first();
+    inputQueue[(inputHead + inputCount) % INPUT_QUEUE_SIZE] = (InputEvent){ time, player, input, isPress };
+    inputCount++;
+}
 
-//
-// Text rendering
-// --------------
-//
-// To preserve the classic Xjump look, we ship with a copies of the fonts that
-// the original used. On Fedora you needed package xorg-x11-fonts-100dpi.
-//
-//   - Courrier Bold Oblique 18pt, 100dpi variant (courBO18)
-//   - FixedMedim 10x20
-//
-// To accurately emulate the classic Xjump look we need to use bitmapped fonts.
-// I experimented with using the SDL_TTF library to render the text but the
-// True Type fonts only looked nice if we used antialiasing and that doesn't
-// match the look that we want... Not to mention that the fonts are not the
-// same as the original and that locating system fonts on Linux is a pain.
-// The big downside of bitmapped fonts is that they can't represent special
-// characters. We are effectively restricted to ACII.
-//
-// On the matter of font dimensions, both of our fonts are monospaced, where
-// the text is arranged in a rectangular grid. However, one subtlety is that in
-// the oblique font each letter might reach into the text box for the glyph to
-// their right. For this reason, the glyphs in the font file might be arranged
-// farther apart than they are in the text.
+// Applies the events that happened before the tick that ends at the given time
+static void input_apply_until(uint32_t time)
+{
+    bool wasPressed[MAX_PLAYERS][INPUT_OTHER+1] = { { false } };
+    while (inputCount > 0) {
+        const InputEvent *ev = &inputQueue[inputHead];
+        if ((int32_t) (ev->time - time) > 0) break;
+        if (!ev->isPress && wasPressed[ev->player][ev->input]) break;
+        if (ev->isPress) wasPressed[ev->player][ev->input] = true;
+        input_apply_first();
+    }
+}
 
-typedef struct {
-    int w, h;   // Dimensions in the text
-    int ow, oh; // Dimentions in the sprite file
-} FontSize;
-
-static void text_draw_line(
-        SDL_Renderer *renderer,
-        SDL_Texture *font,
-        const FontSize *fz,
-        const char *message,
-        const SDL_Rect *where)
+// When the game is not running there are no ticks to wait for
+static void input_apply_all()
 {
-    int w  = fz->w;
-    int h  = fz->h;
-    int ow = fz->ow;
-    int oh = fz->oh;
-
-    int x = where->x;
-    int y = where->y;
-
-    for (int i = 0; message[i] != '\0'; i++) {
-        char c = message[i];
-        if (c < ' ' || '~' < c) { c = 127; } // Default glyph
-        int oi = (c - ' ') % 16;
-        int oj = (c - ' ') / 16;
-        const SDL_Rect src = { oi*ow, oj*oh, ow, oh };
-        const SDL_Rect dst = { x + i*w, y + 0*h, ow, oh };
-        SDL_RenderCopy(renderer, font, &src, &dst);
+    while (inputCount > 0) {
+        input_apply_first();
     }
 }
 
-static void text_set_color(SDL_Texture *font, SDL_Color color)
+static void input_keydown(const SDL_KeyboardEvent *e)
 {
-    // This method of setting colors assumes that the original texture has
-    // white text on a transparent background.
-    SDL_SetTextureColorMod(font, color.r, color.g, color.b);
+    input_enqueue(e->timestamp, e->keysym, true);
 }
 
+static void input_keyup(const SDL_KeyboardEvent *e)
+{
+    input_enqueue(e->timestamp, e->keysym, false);
+}
 
-// Boxes around text
-// -------------------------
+//
+// Replays
+// -------
+//
+// We only record the first game. When the playback of a replay is over, the
+// game continues normally, with keyboard input.
 
-#define boxBorder 4
-#define boxPadding 4
+ReplayWriter recorder;
+ReplayReader player;
+bool isRecording = false;
+bool isReplaying = false;
 
-static void text_draw_box(SDL_Renderer *renderer, const SDL_Rect *content)
+// Must be called before pcg32_init, because the replay might change the seed
+static void replay_init(int64_t seed[2])
 {
-    const SDL_Rect padding = {
-        content->x - boxPadding,
-        content->y - boxPadding,
-        content->w + 2*boxPadding,
-        content->h + 2*boxPadding,
-    };
-    const SDL_Rect border = {
-       padding.x - boxBorder,
-       padding.y - boxBorder,
-       padding.w + 2*boxBorder,
-       padding.h + 2*boxBorder,
-    };
-
-    SDL_SetRenderDrawColor(renderer, boxBorderColor.r, boxBorderColor.g, boxBorderColor.b, boxBorderColor.a);
-    SDL_RenderFillRect(renderer, &border);
+    if (replayPath) {
+        if (!replay_open(&player, replayPath)) { exit(1); }
+        isReplaying = true;
+        isSoftScroll = (player.header.flags & REPLAY_FLAG_SOFTSCROLL) != 0;
+        floorGenerator = ((player.header.flags & REPLAY_FLAG_COUNTERFLOORS) ? FLOORGEN_COUNTER : FLOORGEN_CLASSIC);
+        seed[0] = player.header.seed[0];
+        seed[1] = player.header.seed[1];
+    }
 
-    SDL_SetRenderDrawColor(renderer, boxColor.r, boxColor.g, boxColor.b, boxColor.a);
-    SDL_RenderFillRect(renderer, &padding);
+    if (recordPath) {
+        ReplayHeader header;
+        header.flags = (isSoftScroll ? REPLAY_FLAG_SOFTSCROLL : 0)
+                     | (floorGenerator == FLOORGEN_COUNTER ? REPLAY_FLAG_COUNTERFLOORS : 0);
+        header.seed[0] = seed[0];
+        header.seed[1] = seed[1];
+        if (!replay_writer_open(&recorder, recordPath, &header)) { exit(1); }
+        isRecording = true;
+    }
 }
 
-//
-// Window placement
-//
+static void record_tick()
+{
+    if (isRecording) {
+        replay_write_tick(&recorder, G);
+    }
+}
 
-// Parameters
-
-static const int windowMarginTop   = 24;
-static const int windowMarginLeft  = 24;
-static const int windowMarginInner = 24;
-
-static const int windowMarginBottom = windowMarginTop;
-static const int windowMarginRight  = windowMarginLeft;
-
-char titleBuf[] = "FALLING TOWER ver " XJUMP_VERSION;
-static const char *titleMsg      = titleBuf;
-static const char *scoreLabelMsg = "Floor";
-static const char *copyrightMsg  = "(C) 1997 ROYALPANDA";
-static const char *gameOverMsg   = "Game Over";
-static const char *pauseMsg      = "Pause";
-static const char *highscoreMsg1 = "High Score";
-static const char *highscoreMsg2 = "Today     "; // Please make these two strings have the same length
-
-static const int NscoreDigits = 10;
-
-// Game spritesheet
-
-static const SDL_Rect skySprite   = { 4*R, 0*S, S, S};
-static const SDL_Rect LWallSprite = { 4*R, 1*S, S, S};
-static const SDL_Rect RWallSprite = { 4*R, 2*S, S, S};
-static const SDL_Rect floorSprite = { 4*R, 3*S, S, S};
-static const SDL_Rect heroSprite[8] = {
-    { 0*R, 0*R, R, R}, // Stand L (1/2)
-    { 1*R, 0*R, R, R}, // Stand R (1/2)
-    { 2*R, 0*R, R, R}, // Stand L (2/2)
-    { 3*R, 0*R, R, R}, // Stand R (2/2)
-    { 0*R, 1*R, R, R}, // Jump L
-    { 1*R, 1*R, R, R}, // Jump R
-    { 2*R, 1*R, R, R}, // Fall L
-    { 3*R, 1*R, R, R}, // Fall R
-};
+static void record_scroll(int bump)
+{
+    if (isRecording && bump > 0) {
+        replay_write_scroll(&recorder, bump);
+    }
+}
 
-void init_title()
+static void record_stop()
 {
-    // Hide the minor version number from the app title
-    int n = 0;
-    for (char *p = titleBuf; *p != 0; p++) {
-        if (*p == '.') {
-            if (++n == 2) {
-                *p = '\0';
-                break;
-            }
-        }
+    if (isRecording) {
+        replay_writer_close(&recorder, G->score, game_checksum(G));
+        isRecording = false;
     }
 }
 
-SDL_Surface *loadThemeFile(const char *filename)
+// Must be called after init_game
+static void replay_start_playback()
 {
-    SDL_Surface *surface = SDL_LoadBMP(filename);
-    if (!surface) {
-        fprintf(stderr, "Error loading theme file. %s\n.", SDL_GetError());
-        return NULL;
+    if (isReplaying && seekTick > 0) {
+        replay_seek(&player, G, seekTick);
     }
-    if (surface->w != 4*R + S || surface->h != 2*R) {
-        fprintf(stderr, "Theme spritesheet has the wrong dimensions.\n");
-        return NULL;
+}
+
+// Returns whether the playback matched the original game
+static bool replay_finish()
+{
+    bool ok = replay_matches(&player, G);
+    if (!ok) {
+        fprintf(stderr, "Replay diverged from the recorded game (recorded score %ld)\n", player.footer.score);
     }
-    return surface;
+    replay_close(&player);
+    isReplaying = false;
+    return ok;
 }
 
 //
@@ -883,6 +915,35 @@ uint32_t frameTime;   // (if RUNNING)  Moment when we ran the last simulation fr
 uint32_t pauseTime;   // (if PAUSED)   Remaining time difference when we paused (avoids jerky scrolling when unpausing)
 uint32_t deathTime;   // (if GAMEOVER) Moment when when we entered the game over screen
 
+static const uint32_t gameOverDelay = 2000; // How long the game over screen lasts, in ms
+
+// Saves the score of a player whose game ended. In split-screen mode the
+// others keep playing until they die too.
+static void finish_run(int i)
+{
+    isAlive[i] = false;
+    if (i == 0) broadcast_game_over();
+    if (i == 0 && isReplaying) {
+        replay_finish();
+        record_stop();
+        return;
+    }
+
+    // It is the broadcaster's score, not ours
+    if (spectateAddress) return;
+
+    ScoreRecord *run = &currRuns[i];
+    run->score = cores[i].game.score;
+    run->time = time(NULL);
+    highscore_update(run);
+
+    // Only the first game is recorded. The replay file must be
+    // complete before the leaderboard client reads it.
+    bool hasReplay = (i == 0 && isRecording);
+    if (i == 0) record_stop();
+    leaderboard_submit(run, (hasReplay ? recordPath : NULL));
+}
+
 static void state_set(GameState state)
 {
     switch (state) {
@@ -901,7 +962,9 @@ static void state_set(GameState state)
 
         case STATE_GAMEOVER:
             deathTime = currTime;
-            highscore_update(G.score);
+            for (int i = 0; i < numPlayers; i++) {
+                if (isAlive[i]) finish_run(i);
+            }
             break;
 
         case STATE_HIGHSCORES:
@@ -910,188 +973,460 @@ static void state_set(GameState state)
     currState = state;
 }
 
-int main(int argc, char **argv)
+// How long we can sleep before the current state needs to do something, in
+// ms, if there are no events. Returns -1 if it can wait forever.
+static int state_timeout()
 {
-    // Configuration
-    parseCommandLine(argc, argv);
+    switch (currState) {
+        case STATE_GAMEOVER: {
+            // Spectators wait for the next game instead
+            if (spectateAddress) return -1;
+            int32_t remaining = (int32_t) (deathTime + gameOverDelay - currTime);
+            return (remaining > 0 ? remaining : 0);
+        }
 
-    // This is necessary for correct app icon (must be before SDL_Init)
-    setenv("SDL_VIDEO_WAYLAND_WMCLASS", XJUMP_APPNAME, 0);
-    setenv("SDL_VIDEO_X11_WMCLASS",     XJUMP_APPNAME, 0);
+        case STATE_RUNNING:
+            return 0;
 
-    // Initialize subsystems
-    if (0 != SDL_Init(SDL_INIT_VIDEO))
-        panic("Could not initialize SDL", SDL_GetError());
-    atexit(SDL_Quit);
+        case STATE_PAUSED:
+        case STATE_HIGHSCORES:
+            return -1;
+    }
+    return -1;
+}
 
-    int64_t seed[2];
-    ssize_t nread = getrandom(seed, sizeof(seed), GRND_NONBLOCK);
-    if (nread == -1) panic("Could not initialize RNG", strerror(errno));
+// Called before the ticks of each frame. If the simulation is more than
+// stallTicks behind the clock, the process probably didn't get to run for a
+// while, and running all of the missed ticks at once would take the hero
+// straight to wherever they lead, usually to a death the player never saw.
+// With STALL_DILATE we run only stallTicks of them and give up the rest, so
+// the game slows down to recover. With STALL_PAUSE we give up all of them
+// and pause the game.
+static void handle_stall(Profiler *prof, int stallTicks)
+{
+    int32_t behind = (int32_t) (currTime - frameTime) / GAME_SPEED;
+    if (behind <= stallTicks) return;
+
+    switch (stallPolicy) {
+        case STALL_DILATE: {
+            int32_t skipped = behind - stallTicks;
+            frameTime += skipped * GAME_SPEED;
+            profile_dilate(prof, skipped);
+            break;
+        }
 
-    pcg32_init(seed);
-    highscore_init();
-    init_input();
-    init_game();
-    init_title();
+        case STALL_PAUSE:
+            frameTime += behind * GAME_SPEED;
+            profile_drop(prof, behind);
+            state_set(STATE_PAUSED);
+            break;
+
+        case STALL_CATCHUP:
+            break;
+    }
+}
+
+// Plays the frames that arrived from the broadcast. It goes at the normal
+// speed, unless it is falling behind, in which case it runs the extra frames
+// right away to catch up. There is no pausing and no highscores screen; the
+// spectator follows whatever the broadcaster is doing.
+static void spectate_update(Profiler *prof)
+{
+    int lag = spectate_lag();
+    while (1) {
+        if (frameTime + GAME_SPEED > currTime) {
+            if (lag <= SPECTATE_MAX_LAG) break;
+            frameTime = currTime - GAME_SPEED;
+        }
+
+        SpectateEvent ev = spectate_feed(G);
+        if (ev == SPECTATE_WAIT) {
+            // Don't build up a debt of frames while the network is quiet
+            if (frameTime + GAME_SPEED < currTime) frameTime = currTime - GAME_SPEED;
+            break;
+        }
+        if (ev == SPECTATE_NEWGAME) {
+            isAlive[0] = true;
+            state_set(STATE_RUNNING);
+            continue;
+        }
+        if (ev == SPECTATE_GAMEOVER) {
+            if (currState == STATE_RUNNING) state_set(STATE_GAMEOVER);
+            continue;
+        }
+
+        frameTime += GAME_SPEED;
+        lag--;
+        if (currState != STATE_RUNNING) continue;
+        profile_tick(prof);
+        currRuns[0].ticks++;
+        if (xj_update(core)) {
+            state_set(STATE_GAMEOVER);
+        }
+    }
+}
+
+//
+// Frame pacing
+// ------------
+//
+// SDL_GetTicks only has millisecond resolution, which is not enough to
+// interpolate the hero on a 144 Hz or 240 Hz display, or to hit a frame rate
+// cap accurately. The fine clock counts in 1/INTERP_ONE ms and shares its
+// origin with SDL_GetTicks, so that the whole-millisecond part can still be
+// compared with the event timestamps.
 
-    // Widths and Heights
+static uint64_t perfFreq;
+static uint64_t fineOrigin;
 
-    static const FontSize uiFZ = { 15, 28, 20, 28 };
-    static const FontSize hsFZ = { 10, 20, 10, 20 };
+static uint64_t perf_to_fine(uint64_t pc)
+{
+    // Split to avoid overflowing 64 bits when the counter is in nanoseconds
+    return (pc / perfFreq) * (1000 * INTERP_ONE) + (pc % perfFreq) * (1000 * INTERP_ONE) / perfFreq;
+}
+
+static void clock_init()
+{
+    perfFreq = SDL_GetPerformanceFrequency();
+    uint32_t ms = SDL_GetTicks();
+    fineOrigin = perf_to_fine(SDL_GetPerformanceCounter()) - (uint64_t) ms * INTERP_ONE;
+}
+
+static uint64_t clock_fine()
+{
+    return perf_to_fine(SDL_GetPerformanceCounter()) - fineOrigin;
+}
 
-    const int titleW      = uiFZ.w * strlen(titleMsg);
-    const int scoreLabelW = uiFZ.w * strlen(scoreLabelMsg);
-    const int copyrightW  = uiFZ.w * strlen(copyrightMsg);
-    const int gameOverW   = uiFZ.w * strlen(gameOverMsg);
-    const int pauseW      = uiFZ.w * strlen(pauseMsg);
+// Waits until the deadline, in fine clock units. The OS sleep can overshoot by
+// a millisecond or more, so we sleep until shortly before the deadline and
+// then spin for the rest. The spin is short enough to not matter for power
+// use, and it is what makes the frame pacing regular.
+static void pace_until(uint64_t deadline)
+{
+    const uint64_t spinMargin = 2 * INTERP_ONE;
+    uint64_t now = clock_fine();
+    if (now + spinMargin < deadline) {
+        SDL_Delay((deadline - now - spinMargin) / INTERP_ONE);
+    }
+    while (clock_fine() < deadline) {
+        // Spin
+    }
+}
+
+//
+// Headless mode
+// -------------
+//
+// Runs the simulation as fast as possible, without opening a window. This is
+// intended for bots and regression tests. The input is a stream of characters,
+// one per simulation frame:
+//
+//   .  no buttons      j  jump
+//   l  left            L  left + jump
+//   r  right           R  right + jump
+//
+// Whitespace is ignored and a # starts a comment that lasts until the end of
+// the line. The game ends when the hero dies or when the input runs out.
+//
+// In soft scroll mode, we emulate a renderer that draws exactly one frame
+// after each simulation step. Otherwise no forced scroll would ever happen.
 
-    const int textBoxH = uiFZ.h + boxBorder + 2*boxPadding + boxBorder;
+static int headless_read(FILE *f)
+{
+    while (1) {
+        int c = getc(f);
+        switch (c) {
+            case ' ': case '\t': case '\r': case '\n':
+                break;
 
-    const int gameW = S * FIELD_W;
-    const int gameH = S * FIELD_H;
+            case '#':
+                do { c = getc(f); } while (c != '\n' && c != EOF);
+                if (c == EOF) return EOF;
+                break;
 
-    const int backgroundW = S * FIELD_W;
-    const int backgroundH = S * (FIELD_H + FIELD_EXTRA);
+            case '.': case 'j':
+            case 'l': case 'L':
+            case 'r': case 'R':
+            case EOF:
+                return c;
 
-    const int scoreDigitsW = uiFZ.w * NscoreDigits;
-    const int scoreW = scoreLabelW + uiFZ.w + scoreDigitsW;
+            default:
+                fprintf(stderr, "Invalid headless input character '%c'\n", c);
+                exit(1);
+        }
+    }
+}
+
+static double monotonic_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int run_headless()
+{
+    FILE *in = stdin;
+    if (isReplaying) {
+        in = NULL;
+    } else if (0 != strcmp(inputPath, "-")) {
+        in = fopen(inputPath, "r");
+        if (!in) {
+            perror("Could not open input file");
+            return 1;
+        }
+    }
+
+    xj_reset(core, NULL);
+    replay_start_playback();
+
+    int64_t ticks = player.tick;
+    bool isDead = false;
+    double startTime = monotonic_seconds();
+
+    bool replayOk = true;
+    bool wasReplaying = isReplaying;
+
+    while (!isDead) {
+        if (isReplaying) {
+            if (!replay_feed(&player, G)) break;
+        } else {
+            int c = headless_read(in);
+            if (c == EOF) break;
+            switch (c) {
+                case '.': xj_set_action(core, 0); break;
+                case 'j': xj_set_action(core, XJ_ACTION_JUMP); break;
+                case 'l': xj_set_action(core, XJ_ACTION_LEFT); break;
+                case 'L': xj_set_action(core, XJ_ACTION_LEFT | XJ_ACTION_JUMP); break;
+                case 'r': xj_set_action(core, XJ_ACTION_RIGHT); break;
+                case 'R': xj_set_action(core, XJ_ACTION_RIGHT | XJ_ACTION_JUMP); break;
+            }
+        }
+
+        record_tick();
+        isDead = xj_update(core);
+        ticks++;
+
+        // When replaying, the forced scrolls come from the replay file
+        if (!isReplaying) {
+            record_scroll(xj_settle(core));
+        }
+    }
+
+    double elapsed = monotonic_seconds() - startTime;
+
+    if (isReplaying) {
+        replayOk = replay_finish();
+    }
+    record_stop();
+
+    printf("score %ld\n", G->score);
+    printf("ticks %ld\n", ticks);
+    printf("dead %d\n", isDead);
+    printf("ticks/s %.0f\n", (elapsed > 0 ? ticks / elapsed : 0.0));
+    if (wasReplaying) {
+        printf("checksum %s\n", (replayOk ? "ok" : "mismatch"));
+    }
+
+    if (in && in != stdin) fclose(in);
+    return (replayOk ? 0 : 1);
+}
+
+int main(int argc, char **argv)
+{
+    // For measuring how long it takes until the first frame is on screen
+    double startTime = monotonic_seconds();
+    double startupMs = 0.0;
 
-    const int windowW = windowMarginLeft + gameW + windowMarginRight;
-    const int windowH = windowMarginTop + 3*windowMarginInner + textBoxH + 2*uiFZ.h + + gameH + windowMarginBottom;
+    // Configuration
+    parseCommandLine(argc, argv);
 
-    // Screen positions
+    int64_t seed[2];
+    if (hasFixedSeed) {
+        seed[0] = fixedSeed[0];
+        seed[1] = fixedSeed[1];
+    } else {
+        ssize_t nread = getrandom(seed, sizeof(seed), GRND_NONBLOCK);
+        if (nread == -1) panic("Could not initialize RNG", strerror(errno));
+    }
 
-    const int titleX     = (windowW - titleW)/2;
-    const int scoreX     = (windowW - scoreW)/2;
-    const int gameX      = (windowW - gameW)/2;
-    const int copyrightX = (windowW - copyrightW)/2;
+    ghosts_init(seed);
+    replay_init(seed);
+    for (int i = 0; i < numPlayers; i++) {
+        xj_init(&cores[i], isSoftScroll, floorGenerator);
+    }
+    pcg32_init(&G->rng, seed);
 
-    const int titleY     = windowMarginTop + boxBorder + boxPadding;
-    const int scoreY     = titleY + uiFZ.h + boxPadding + boxBorder + windowMarginInner;
-    const int gameY      = scoreY + uiFZ.h + windowMarginInner;
-    const int copyrightY = gameY + gameH + windowMarginInner;
+    if (isHeadless) {
+        return run_headless();
+    }
 
-    const int scoreLabelX  = scoreX;
-    const int scoreDigitsX = scoreX + scoreLabelW + uiFZ.w;
+    // This is necessary for correct app icon (must be before SDL_Init)
+    setenv("SDL_VIDEO_WAYLAND_WMCLASS", XJUMP_APPNAME, 0);
+    setenv("SDL_VIDEO_X11_WMCLASS",     XJUMP_APPNAME, 0);
 
-    const int gameOverX = gameX + (gameW - gameOverW)/2;
-    const int gameOverY = gameY + (gameH - uiFZ.h)*2/5;
+    // Initialize subsystems
+    if (0 != SDL_Init(SDL_INIT_VIDEO))
+        panic("Could not initialize SDL", SDL_GetError());
+    atexit(SDL_Quit);
 
-    const int pauseX = gameX + (gameW - pauseW)/2;
-    const int pauseY = gameY + (gameH - uiFZ.h)*2/5;
+    highscore_init();
+    highscore_start();
+    if (leaderboardUrl && !leaderboard_start(leaderboardUrl, highscore_notify)) {
+        exit(1);
+    }
+    if (broadcastPort || spectateAddress) {
+        netEvent = SDL_RegisterEvents(1);
+    }
+    if (broadcastPort && !broadcast_start(broadcastPort, net_notify)) {
+        exit(1);
+    }
+    if (spectateAddress && !spectate_start(spectateAddress, net_notify)) {
+        exit(1);
+    }
+    start_game();
+    replay_start_playback();
 
-    const SDL_Rect titleDst       = { titleX, titleY, titleW, uiFZ.h };
-    const SDL_Rect scoreLabelDst  = { scoreLabelX, scoreY, scoreLabelW, uiFZ.h };
-    const SDL_Rect scoreDigitsDst = { scoreDigitsX, scoreY, scoreDigitsW, uiFZ.h };
-    const SDL_Rect copyrightDst   = { copyrightX, copyrightY, copyrightW, uiFZ.h };
-    const SDL_Rect gameOverDst    = { gameOverX, gameOverY, gameOverW, uiFZ.h };
-    const SDL_Rect pauseDst       = { pauseX, pauseY, pauseW, uiFZ.h };
-    const SDL_Rect gameDst        = { gameX, gameY, gameW, gameH };
+    Screen screen;
+    screen_layout(&screen, numPlayers);
 
     // Load SDL resources
 
     SDL_Surface *spritesSurface = loadThemeFile(themePath);
     if (!spritesSurface) { exit(1); }
 
-    SDL_Surface *uiFontSurface = SDL_LoadBMP(XJUMP_FONTDIR "/font-ui.bmp");
+    SDL_Surface *uiFontSurface = loadDataFile(XJUMP_FONTDIR "/font-ui.bmp");
     if (!uiFontSurface) panic("Could not load font file", SDL_GetError());
 
-    SDL_Surface *hsFontSurface = SDL_LoadBMP(XJUMP_FONTDIR "/font-hs.bmp");
+    SDL_Surface *hsFontSurface = loadDataFile(XJUMP_FONTDIR "/font-hs.bmp");
     if (!hsFontSurface) panic("Could not load font file", SDL_GetError());
 
+    // Several fields side by side can be wider than the display. The renderer
+    // stretches the drawing to fit the window, so it can start smaller.
+    int windowW = screen.windowW;
+    int windowH = screen.windowH;
+    SDL_Rect usable;
+    if (!isCpuRender && !exportPath && 0 == SDL_GetDisplayUsableBounds(0, &usable) && usable.w > 0 && usable.w < windowW) {
+        windowH = (int) ((int64_t) windowH * usable.w / windowW);
+        windowW = usable.w;
+    }
+
     SDL_Window *window = SDL_CreateWindow(
         /*title*/ "xjump",
         /*x*/ SDL_WINDOWPOS_UNDEFINED,
         /*y*/ SDL_WINDOWPOS_UNDEFINED,
         /*w*/ windowW,
         /*h*/ windowH,
-        /*flags*/ SDL_WINDOW_RESIZABLE);
+        /*flags*/ (exportPath ? SDL_WINDOW_HIDDEN :
+                   isIntegerScale && !isCpuRender ? SDL_WINDOW_RESIZABLE | SDL_WINDOW_ALLOW_HIGHDPI :
+                   SDL_WINDOW_RESIZABLE));
     if (!window) panic("Could not create window", SDL_GetError());
 
-    SDL_RendererFlags renderFlags = SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC |SDL_RENDERER_TARGETTEXTURE;
-    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, renderFlags);
-    if (!renderer) panic("Coult not create SDL renderer", SDL_GetError());
-
-    SDL_Texture *sprites = SDL_CreateTextureFromSurface(renderer, spritesSurface);
-    if (!sprites) panic("Could not create texture", SDL_GetError());
-
-    SDL_Texture *uiFont = SDL_CreateTextureFromSurface(renderer, uiFontSurface);
-    if (!uiFont) panic("Could not create texture", SDL_GetError());
+    // Without an accelerated renderer, we draw with the CPU ourselves instead
+    // of going through SDL's software renderer.
+    // When exporting, any renderer that can draw to a texture will do, and
+    // there is no point in waiting for vsync.
+    SDL_Renderer *renderer = NULL;
+    if (exportPath) {
+        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_TARGETTEXTURE);
+        if (!renderer) panic("Could not create SDL renderer", SDL_GetError());
+    } else if (!isCpuRender) {
+        SDL_RendererFlags renderFlags = SDL_RENDERER_ACCELERATED | SDL_RENDERER_TARGETTEXTURE;
+        if (isVsync) renderFlags |= SDL_RENDERER_PRESENTVSYNC;
+        renderer = SDL_CreateRenderer(window, -1, renderFlags);
+        if (!renderer) {
+            fprintf(stderr, "Could not create SDL renderer: %s\n", SDL_GetError());
+            fprintf(stderr, "Drawing with the CPU instead\n");
+            isCpuRender = 1;
+        }
+    }
 
-    SDL_Texture *hsFont = SDL_CreateTextureFromSurface(renderer, hsFontSurface);
-    if (!hsFont) panic("Could not create texture", SDL_GetError());
+    if (isCpuRender) {
+        if (!screen_init_cpu(&screen, window, spritesSurface, uiFontSurface, hsFontSurface)) { exit(1); }
+    } else {
+        if (!screen_init(&screen, renderer, spritesSurface, uiFontSurface, hsFontSurface)) { exit(1); }
+    }
 
     // At this point, everything we need is loaded to textures
     SDL_FreeSurface(spritesSurface);
     SDL_FreeSurface(uiFontSurface);
     SDL_FreeSurface(hsFontSurface);
 
-    // Create background textures with all the things that don't change from
-    // frame to frame. This reduces the number of draw calls in the inner loop.
-    SDL_Texture *windowBackground = SDL_CreateTexture(
-            renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET,
-            windowW, windowH);
-    if (!windowBackground) panic("Could not create window background texture", SDL_GetError());
-
-    SDL_Texture *gameBackground = SDL_CreateTexture(
-            renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET,
-            backgroundW, backgroundH + S);
-    if (!gameBackground) panic("Could not create game background texture", SDL_GetError());
-
-    text_set_color(uiFont, textColor);
-
-    {
-        SDL_SetRenderTarget(renderer, windowBackground);
-
-        SDL_SetRenderDrawColor(renderer, backgroundColor.r,  backgroundColor.g, backgroundColor.b, backgroundColor.a);
-        SDL_RenderClear(renderer);
-
-        text_draw_box(renderer, &titleDst);
-        text_draw_line(renderer, uiFont, &uiFZ, titleMsg, &titleDst);
-        text_draw_line(renderer, uiFont, &uiFZ, scoreLabelMsg, &scoreLabelDst);
-
-        text_set_color(uiFont, copyrightColor);
-        text_draw_line(renderer, uiFont, &uiFZ, copyrightMsg, &copyrightDst);
-        text_set_color(uiFont, textColor);
+    if (isWatchTheme) {
+        themeEvent = SDL_RegisterEvents(1);
+        if (!themewatch_start(themePath, theme_notify)) {
+            fprintf(stderr, "The theme will not be reloaded\n");
+        }
+    }
 
-        SDL_RenderPresent(renderer);
-        SDL_SetRenderTarget(renderer, NULL);
+    // Tell the renderer to stretch the drawing if the window is resized, or,
+    // with --integer-scale, draw the textures again at the largest scale that
+    // fits each time it is. The CPU path doesn't stretch; it centers the
+    // drawing in the window.
+    bool isFitOutput = (renderer && !exportPath && isIntegerScale);
+    if (isFitOutput) {
+        if (!screen_fit_output(&screen)) { exit(1); }
+    } else if (renderer && !exportPath) {
+        SDL_RenderSetLogicalSize(renderer, screen.windowW, screen.windowH);
     }
 
-    {
-        SDL_SetRenderTarget(renderer, gameBackground);
+    // The exported frames are drawn into a texture of the same size as the
+    // window, and the game runs on a virtual clock that advances by exactly
+    // one frame each time, as fast as we can draw.
+    SDL_Texture *exportTarget = NULL;
+    int exportFps = (maxFps > 0 ? maxFps : EXPORT_DEFAULT_FPS);
+    uint64_t exportFrame = 0;
+    if (exportPath) {
+        exportTarget = SDL_CreateTexture(
+                renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET,
+                screen.windowW, screen.windowH);
+        if (!exportTarget) panic("Could not create the export texture", SDL_GetError());
+        SDL_SetRenderTarget(renderer, exportTarget);
+        if (!export_start(exportPath, renderer, screen.windowW, screen.windowH)) { exit(1); }
+        fprintf(stderr, "Exporting %dx%d RGB24 frames at %d fps\n", screen.windowW, screen.windowH, exportFps);
+        maxFps = 0;
+    }
 
-        SDL_SetTextureBlendMode(gameBackground, SDL_BLENDMODE_BLEND);
-        SDL_SetRenderDrawColor(renderer, 0,  0, 0, 0);
-        SDL_RenderClear(renderer);
+    // The CPU path has no vsync to wait for, so we cap it at the refresh rate
+    if (isCpuRender && isVsync && maxFps == 0) {
+        SDL_DisplayMode mode;
+        bool hasRate = (0 == SDL_GetWindowDisplayMode(window, &mode) && mode.refresh_rate > 0);
+        maxFps = (hasRate ? mode.refresh_rate : 60);
+    }
 
-        // Background
-        for (int y = 0; y < FIELD_H + FIELD_EXTRA; y++) {
-            for (int x = 0; x < FIELD_W; x++) {
-                const SDL_Rect *src = ((x == 0) ? &LWallSprite : (x == FIELD_W-1) ? &RWallSprite : &skySprite);
-                const SDL_Rect dst = { x*S, y*S, S, S };
-                SDL_RenderCopy(renderer, sprites, src, &dst);
-            }
-        }
+    // Frame timing. The F3 key shows the overlay, and turns on the profiler
+    // if it wasn't already on because of --profile.
+    Profiler prof = { 0 };
+    bool showOverlay = false;
+    if (profilePath) {
+        profile_init(&prof, true);
+    }
 
-        // Wide floor
-        for (int x = 0; x < FIELD_W; x++) {
-            const SDL_Rect dst = { x*S, backgroundH, S, S };
-            SDL_RenderCopy(renderer, sprites, &floorSprite, &dst);
-        }
+    // Frame rate cap. Without vsync and without a cap we draw as fast as we can.
+    clock_init();
+    uint64_t framePeriod = (maxFps > 0 ? 1000 * INTERP_ONE / maxFps : 0);
 
-        SDL_RenderPresent(renderer);
-        SDL_SetRenderTarget(renderer, NULL);
+    // What counts as a stall. With a low frame rate cap, every frame needs
+    // several ticks.
+    int stallTicks = STALL_TICKS;
+    if (maxFps > 0 && (1000/maxFps)/GAME_SPEED + 2 > stallTicks) {
+        stallTicks = (1000/maxFps)/GAME_SPEED + 2;
     }
-
-    // Tell the renderer to stretch the drawing if the window is resized
-    SDL_RenderSetLogicalSize(renderer, windowW, windowH);
+    uint64_t nextFrame = clock_fine();
+    int status = 0;
 
     state_set(STATE_RUNNING);
 
+    // Spectators show the pause screen until the broadcast starts
+    if (spectateAddress) {
+        state_set(STATE_PAUSED);
+    }
+
     while (1) {
 
-        currTime = SDL_GetTicks();
+        uint64_t fineTime = (exportPath ? exportFrame * 1000 * INTERP_ONE / exportFps : clock_fine());
+        currTime = fineTime / INTERP_ONE;
+        profile_start(&prof);
 
         //
         // Respond to events
@@ -1105,18 +1440,26 @@ int main(int argc, char **argv)
                 case SDL_QUIT:
                     goto quit;
 
-                case SDL_KEYUP: {
-                    SDL_Keysym key = e.key.keysym;
-                    input_keyup(key);
+                case SDL_KEYUP:
+                    if (!spectateAddress) input_keyup(&e.key);
                     break;
-                }
 
                 case SDL_KEYDOWN: {
                     SDL_Keysym key = e.key.keysym;
-                    input_keydown(key);
+                    if (!spectateAddress) input_keydown(&e.key);
                     if (key.sym == SDLK_q && (key.mod & KMOD_SHIFT)) {
                         goto quit;
                     }
+                    if (key.sym == SDLK_F3) {
+                        if (!prof.enabled) profile_init(&prof, false);
+                        showOverlay = !showOverlay;
+                        wasResized = true; // Force a repaint
+                        break;
+                    }
+                    if (spectateAddress) {
+                        // The broadcaster is in control
+                        break;
+                    }
                     switch (currState) {
                         case STATE_RUNNING:
                             if (key.sym == SDLK_p
@@ -1134,209 +1477,275 @@ int main(int argc, char **argv)
                             break;
 
                         case STATE_HIGHSCORES:
-                            init_input();
-                            init_game();
+                            start_game();
                             state_set(STATE_RUNNING);
                             break;
                     }
                     break;
                 }
 
+                case SDL_RENDER_TARGETS_RESET:
+                    screen_invalidate(&screen);
+                    wasResized = true;
+                    break;
+
                 case SDL_WINDOWEVENT:
                     switch (e.window.event) {
                         case SDL_WINDOWEVENT_FOCUS_LOST:
-                            if (currState == STATE_RUNNING) {
+                            if (currState == STATE_RUNNING && !spectateAddress && !exportPath) {
                                 state_set(STATE_PAUSED);
                             }
                             break;
 
 
-                        case SDL_WINDOWEVENT_RESIZED:
                         case SDL_WINDOWEVENT_SIZE_CHANGED:
+                            if (isFitOutput && !screen_fit_output(&screen)) { exit(1); }
+                            screen_damage_all(&screen);
+                            wasResized = true;
+                            break;
+
+                        case SDL_WINDOWEVENT_EXPOSED:
+                        case SDL_WINDOWEVENT_RESIZED:
                         case SDL_WINDOWEVENT_MINIMIZED:
                         case SDL_WINDOWEVENT_MAXIMIZED:
                         case SDL_WINDOWEVENT_RESTORED:
+                            screen_damage_all(&screen);
                             wasResized = true;
                             break;
                     }
                     break;
 
                 default:
+                    // The highscore thread finished writing the file
+                    if (e.type == hsEvent && highscore_poll()) {
+                        wasResized = true;
+                    }
+                    // The theme file changed, and the new one is decoded
+                    if (e.type == themeEvent) {
+                        SDL_Surface *surface = themewatch_poll();
+                        if (surface && screen_set_theme(&screen, surface)) {
+                            wasResized = true;
+                        }
+                        SDL_FreeSurface(surface);
+                    }
                     break;
             }
         }
 
+        profile_mark(&prof, PHASE_EVENTS);
+
         //
         // Run the current state
         //
 
-        switch (currState) {
-            case STATE_RUNNING:
-                while (frameTime + GAME_SPEED <= currTime) {
-                    frameTime += GAME_SPEED;
-                    if (updateGame()) {
-                        state_set(STATE_GAMEOVER);
-                        break;
+        if (spectateAddress) {
+            spectate_update(&prof);
+        } else {
+            switch (currState) {
+                case STATE_RUNNING:
+                    // The virtual clock of the export never stalls
+                    if (!exportPath) handle_stall(&prof, stallTicks);
+                    while (currState == STATE_RUNNING && frameTime + GAME_SPEED <= currTime) {
+                        frameTime += GAME_SPEED;
+                        input_apply_until(frameTime);
+                        if (isReplaying && !replay_feed(&player, G)) {
+                            state_set(STATE_GAMEOVER);
+                            break;
+                        }
+                        record_tick();
+                        broadcast_tick(G);
+                        profile_tick(&prof);
+                        for (int k = 0; k < numGhosts; k++) {
+                            ghost_tick(&ghosts[k]);
+                        }
+                        bool isAnyAlive = false;
+                        for (int i = 0; i < numPlayers; i++) {
+                            if (!isAlive[i]) continue;
+                            currRuns[i].ticks++;
+                            if (xj_update(&cores[i])) {
+                                finish_run(i);
+                            } else {
+                                isAnyAlive = true;
+                            }
+                        }
+                        if (!isAnyAlive) {
+                            state_set(STATE_GAMEOVER);
+                            break;
+                        }
                     }
-                }
-                break;
+                    break;
 
-            case STATE_GAMEOVER:
-                if (deathTime + 2000 <= currTime) {
-                    state_set(STATE_HIGHSCORES);
-                }
-                break;
+                case STATE_GAMEOVER:
+                    if (deathTime + gameOverDelay <= currTime) {
+                        state_set(STATE_HIGHSCORES);
+                    }
+                    break;
 
-            case STATE_PAUSED:
-            case STATE_HIGHSCORES:
-                // Nothing
-                break;
+                case STATE_PAUSED:
+                case STATE_HIGHSCORES:
+                    // Nothing
+                    break;
+            }
         }
 
+        if (currState != STATE_RUNNING) {
+            input_apply_all();
+        }
+
+        // The video ends with the game over screen
+        if (exportPath && currState == STATE_HIGHSCORES) {
+            goto quit;
+        }
+
+        profile_mark(&prof, PHASE_UPDATE);
+
         //
         // Draw
         //
 
-        bool needsRepaint = (currState == STATE_RUNNING || currState != lastDrawn || wasResized);
+        bool needsRepaint = (currState == STATE_RUNNING || currState != lastDrawn || wasResized || exportPath);
         if (needsRepaint) {
 
-            SDL_SetRenderDrawColor(renderer, backgroundColor.r,  backgroundColor.g, backgroundColor.b, backgroundColor.a);
-            SDL_RenderClear(renderer);
-            SDL_RenderCopy(renderer, windowBackground, NULL, NULL);
-
-            char scoreDigits[32];
-            snprintf(scoreDigits, sizeof(scoreDigits), "%010ld", G.score);
-            text_draw_line(renderer, uiFont, &uiFZ, scoreDigits, &scoreDigitsDst);
+            int64_t scores[MAX_PLAYERS];
+            for (int i = 0; i < numPlayers; i++) {
+                scores[i] = cores[i].game.score;
+            }
+            screen_draw_frame(&screen, scores);
 
             if (currState == STATE_HIGHSCORES)  {
-
-                // Clear background
-                SDL_SetRenderDrawColor(renderer, scoreBorderColor.r,  scoreBorderColor.g, scoreBorderColor.b, scoreBorderColor.a);
-                SDL_RenderFillRect(renderer, &gameDst);
-
-                const SDL_Rect innerRect = { gameX+1, gameY+1, gameW-2, gameH-2 };
-                SDL_SetRenderDrawColor(renderer, backgroundColor.r,  backgroundColor.g, backgroundColor.b, backgroundColor.a);
-                SDL_RenderFillRect(renderer, &innerRect);
-
-                // Draw the high scores
-                // To avoid showing repeated high scores in the first day the
-                // person is playing, only show the best time today if it is
-                // different. This also gives a nice visual cue if you get an
-                // all time highscore :)
-                char lines[2][32];
-
-                snprintf(lines[0], sizeof(lines[0]), "%s %6ld", highscoreMsg1, bestScoreEver);
-                snprintf(lines[1], sizeof(lines[1]), "%s %6ld", highscoreMsg2, bestScoreToday);
-
-                int N = (bestScoreToday != bestScoreEver ? 2 : 1);
-
-                int highscoreW = hsFZ.w * 17;
-                int highscoreH = hsFZ.h * N;
-                int highscoreX = gameX + (gameW - highscoreW)/2;
-                int highscoreY = gameY + (gameH - highscoreH)/2;
-
-                for (int i = 0; i < N; i ++) {
-                    const SDL_Rect dst = { highscoreX, highscoreY + i*hsFZ.h, highscoreW, hsFZ.h };
-                    text_draw_line(renderer, hsFont, &hsFZ, lines[i], &dst);
-                }
-
+                screen_draw_highscores(&screen, bestScores.best, bestScores.today);
             } else {
-                SDL_RenderSetClipRect(renderer, &gameDst);
-
-                int sx, sy, interpScroll;
-                if (!isSoftScroll) {
-                    // In hard scroll more we don't interpolate the hero
-                    // position at all because it causes too much flickering
-                    // during forced scrolls
-                    sx = G.x;
-                    sy = G.y;
-                    interpScroll = 0;
-                } else {
-                    // In soft scroll mode, we compute the hero and scroll
-                    // coordinates using linear interpolation.
-
-                    // Predict current hero position (without scroll)
-                    int dt = currTime - frameTime;
-                    int hx = G.x + (G.vx/2)*dt/GAME_SPEED;
-                    if (hx < leftLimit) { hx = leftLimit; }
-                    if (hx > rightLimit) { hx = rightLimit; }
-                    int hy = G.y + (G.vy)*dt/GAME_SPEED;
-                    int stand = isStanding(hx, hy);
-                    if (stand) { hy = collideWithFloor(hy); }
-
-                    // Predict current hero position (with scroll)
-                    int c = G.scrollCount + dt*G.scrollSpeed/GAME_SPEED;
-                    sx = hx;
-                    sy = hy + G.forcedScroll + S*c/SCROLL_THRESHOLD;
-                    if (!stand && sy < topLimit) {
-                        G.forcedScroll += (topLimit - sy);
-                        G.scrollCount = 0;
-                        sy = topLimit;
+                FieldView views[MAX_PLAYERS];
+                GhostView ghostViews[MAX_PLAYERS][MAX_GHOSTS];
+                int bumps[MAX_PLAYERS] = { 0 };
+                int liveDt = (currTime - frameTime) * INTERP_ONE + (int) (fineTime % INTERP_ONE);
+                int ghostDt = (currState == STATE_RUNNING ? liveDt : 0);
+                for (int i = 0; i < numPlayers; i++) {
+                    Game *g = &cores[i].game;
+                    FieldView *v = &views[i];
+                    v->game = g;
+                    if (!g->isSoftScroll) {
+                        // In hard scroll more we don't interpolate the hero
+                        // position at all because it causes too much flickering
+                        // during forced scrolls
+                        v->sx = g->x * INTERP_ONE;
+                        v->sy = g->y * INTERP_ONE;
+                        v->interpScroll = 0;
+                    } else {
+                        // In soft scroll mode, we compute the hero and scroll
+                        // coordinates using linear interpolation. We use the
+                        // sub-millisecond part of the clock too, otherwise a
+                        // 240 Hz display would show each position several times.
+                        // A game that is over stays where it ended.
+                        int dt = (isAlive[i] ? liveDt : 0);
+                        v->interpScroll = interpolateHeroFine(g, dt, &v->sx, &v->sy, &bumps[i]);
+                        if (!isAlive[i]) bumps[i] = 0;
                     }
 
-                    interpScroll = sy - hy;
+                    v->banner = (!isAlive[i]                ? BANNER_GAMEOVER :
+                                 currState == STATE_PAUSED  ? BANNER_PAUSE : BANNER_NONE);
+
+                    // Every field shows all of the ghosts that are still climbing
+                    v->ghosts = ghostViews[i];
+                    v->nghosts = 0;
+                    for (int k = 0; k < numGhosts; k++) {
+                        if (!ghosts[k].isRunning) continue;
+                        GhostView *gv = &ghostViews[i][v->nghosts++];
+                        gv->game = &ghosts[k].game;
+                        ghost_locate(&ghosts[k], g, ghostDt, v->interpScroll, &gv->sx, &gv->sy);
+                    }
                 }
-
-                // Background
-                const SDL_Rect backgroundSrc = { 0, 0, backgroundW, backgroundH };
-                const SDL_Rect backgroundDst = { gameX, gameY - S*FIELD_EXTRA + interpScroll, backgroundW, backgroundH };
-                SDL_RenderCopy(renderer, gameBackground, &backgroundSrc, &backgroundDst);
-
-                // Floors
-                for (int y = -FIELD_EXTRA; y < FIELD_H; y++) {
-                    const Floor *floor = get_floor(G.floorOffset - y);
-                    int xl = floor->left;
-                    int xr = floor->right;
-                    if (xl <= xr) {
-                        int w = xr - xl + 1;
-                        const SDL_Rect src = { 0, backgroundH, w*S, S };
-                        const SDL_Rect dst = { gameX + xl*S, gameY + y*S + interpScroll, w*S, S };
-                        SDL_RenderCopy(renderer, gameBackground, &src, &dst);
+                screen_draw_games(&screen, views);
+
+                for (int i = 0; i < numPlayers; i++) {
+                    Game *g = &cores[i].game;
+                    if (g->isSoftScroll) {
+                        // When replaying, the forced scrolls come from the replay
+                        // file. Spectators get them from the broadcast.
+                        if (i == 0 && (isReplaying || spectateAddress)) { bumps[i] = 0; }
+                        if (i == 0) record_scroll(bumps[i]);
+                        if (i == 0) broadcast_scroll(bumps[i]);
+                        applyForcedScroll(g, bumps[i]);
                     }
                 }
+            }
+            broadcast_flush(G, currState == STATE_GAMEOVER || currState == STATE_HIGHSCORES);
+
+            if (showOverlay) {
+                char lines[PROFILE_NLINES+1][PROFILE_LINE];
+                const char *ptrs[PROFILE_NLINES+1];
+                int n = profile_overlay(&prof, lines);
+                snprintf(lines[n++], PROFILE_LINE, "%-8s %6.1f", "startup", startupMs);
+                for (int i = 0; i < n; i++) ptrs[i] = lines[i];
+                screen_draw_overlay(&screen, ptrs, n);
+            }
+            profile_mark(&prof, PHASE_DRAW);
 
-                // Hero sprite
-                int isFlying  = !G.isStanding;
-                int isRight   = G.isFacingRight;
-                int isVariant = (G.isStanding? G.isIdleVariant : (G.vy > 0));
-                int sprite_index = (isFlying&1) << 2 | (isVariant&1) << 1 | (isRight&1) << 0;
-                const SDL_Rect heroDst = { gameX + sx, gameY + sy, R, R };
-                SDL_RenderCopy(renderer, sprites, &heroSprite[sprite_index], &heroDst);
-
-                // Text box
-                if (currState == STATE_GAMEOVER) {
-                    text_draw_box(renderer, &gameOverDst);
-                    text_draw_line(renderer, uiFont, &uiFZ, gameOverMsg, &gameOverDst);
-                }
-                if (currState == STATE_PAUSED) {
-                    text_draw_box(renderer, &pauseDst);
-                    text_draw_line(renderer, uiFont, &uiFZ, pauseMsg, &pauseDst);
+            if (exportPath) {
+                if (!export_frame()) {
+                    status = 1;
+                    goto quit;
                 }
+                exportFrame++;
+            } else {
+                screen_present(&screen);
+            }
+            lastDrawn = currState;
+            profile_mark(&prof, PHASE_PRESENT);
+            profile_frame(&prof);
 
-                if (isSoftScroll) {
-                    // We need to do this after drawing the floors, otherwise it
-                    // messes up the G.floorOffset
-                    while (G.forcedScroll >= S) {
-                        scroll();
-                    }
+            if (startupMs == 0.0) {
+                startupMs = (monotonic_seconds() - startTime) * 1000.0;
+                if (profilePath) {
+                    fprintf(stderr, "startup %.1f ms\n", startupMs);
                 }
-
-                SDL_RenderSetClipRect(renderer, NULL);
             }
 
-            SDL_RenderPresent(renderer);
-            lastDrawn = currState;
+            if (framePeriod) {
+                // If we fell behind by more than a frame, for example after
+                // a pause, start counting again instead of rushing to catch up.
+                nextFrame += framePeriod;
+                uint64_t now = clock_fine();
+                if (nextFrame + framePeriod < now) {
+                    nextFrame = now;
+                }
+                pace_until(nextFrame);
+            }
 
         } else {
 
             // Normally, the game yields the CPU when it calls RenderPresent, due to the
             // PRESENTVSYNC setting. However, when we don't draw anything to the screen
             // we have to put the program to sleep ourselves to prevent the game from
-            // using 100% of the CPU.
+            // using 100% of the CPU. We sleep until the next event arrives or until
+            // the current state has something to do, whichever comes first. The
+            // event stays in the queue, for the next iteration of the loop.
+            // (Before 2.0.16, SDL implemented the wait by polling every 1 ms.)
+            broadcast_flush(G, currState == STATE_GAMEOVER || currState == STATE_HIGHSCORES);
+#if SDL_VERSION_ATLEAST(2, 0, 16)
+            SDL_WaitEventTimeout(NULL, state_timeout());
+#else
             SDL_Delay(GAME_SPEED);
+#endif
         }
     }
 
 quit:
-    return 0;
+    if (exportPath) {
+        uint64_t nframes = 0;
+        if (!export_finish(&nframes)) status = 1;
+        fprintf(stderr, "Exported %" PRIu64 " frames\n", nframes);
+    }
+    record_stop();
+    highscore_stop();
+    leaderboard_stop();
+    broadcast_stop();
+    spectate_stop();
+    ghosts_stop();
+    themewatch_stop();
+    if (profilePath) {
+        profile_write_csv(&prof, profilePath);
+    }
+    profile_free(&prof);
+    return status;
 }